@@ -4,16 +4,21 @@ prefix   = ENV['PREFIX'] || '/usr/local'
 host_cpu = RbConfig::CONFIG['host_cpu']
 host_os  = RbConfig::CONFIG['host_os']
 
+# Every build defines MRB_USE_DEBUG_HOOK: the time budget of hotkey blocks
+# runs on mruby's code fetch hook. It changes struct mrb_state, so it goes
+# here for mruby and all gems alike rather than into mrbgem.rake.
+
 if host_cpu == 'aarch64' && host_os =~ /linux/i
   MRuby::Build.new('debug') do |conf|
     conf.toolchain :gcc
     conf.enable_debug
     conf.gembox 'full-core'
     conf.enable_sanitizer "address,undefined,leak"
+    conf.enable_test
     conf.cc.flags  << '-Og' << '-g' << '-fno-omit-frame-pointer'
     conf.cxx.flags << '-Og' << '-g' << '-std=c++20' << '-fno-omit-frame-pointer'
-    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"}
-    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"}
+    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
+    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
     conf.gem File.expand_path(File.dirname(__FILE__))
   end
 
@@ -25,8 +30,20 @@ if host_cpu == 'aarch64' && host_os =~ /linux/i
     conf.cc.flags  << '-g0'
     conf.cxx.flags << '-g0'
     conf.linker.flags << '-Wl,--strip-debug'
-    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"}
-    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"}
+    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
+    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
+    conf.gem File.expand_path(File.dirname(__FILE__))
+  end
+elsif ENV['TNK_BENCH']
+  # native build for `rake bench`, which runs against dummy_hcd on this machine
+  MRuby::Build.new('bench') do |conf|
+    conf.toolchain :gcc
+    conf.gembox 'full-core'
+    conf.cc.flags  << '-O2'
+    conf.cxx.flags << '-O2' << '-std=c++20'
+    conf.enable_test
+    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
+    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
     conf.gem File.expand_path(File.dirname(__FILE__))
   end
 else
@@ -56,8 +73,8 @@ else
 
 
     conf.gembox 'full-core'
-    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"}
-    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"}
+    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
+    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
     conf.gem File.expand_path(File.dirname(__FILE__))
   end
 
@@ -79,8 +96,8 @@ else
     conf.linker.flags << '-static'
 
     conf.gembox 'full-core'
-    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"}
-    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"}
+    conf.cc.defines  << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
+    conf.cxx.defines << %Q{TNK_PREFIX=\\"#{prefix}\\"} << 'MRB_USE_DEBUG_HOOK'
     conf.gem File.expand_path(File.dirname(__FILE__))
   end
 end
@@ -0,0 +1,21 @@
+#ifndef TNK_GADGET_H
+#define TNK_GADGET_H
+
+#include <stdint.h>
+#include <mruby.h>
+
+/*
+ * Native helpers for bringing up the USB gadget without shelling out:
+ * kernel modules through finit_module(2), the NCM link through rtnetlink and
+ * the mass storage backing file through an in-process FAT16 formatter.
+ */
+
+/* Writes a FAT16 filesystem onto fd, which must already be size bytes long
+ * and read as zeros (a fresh ftruncate()d file). Only the boot sector, the
+ * first FAT sectors and the label touch the disk, so the file stays sparse.
+ * Returns 0 or -1 with errno set. */
+int tnk_fat16_format(int fd, uint64_t size, const char *label);
+
+void tnk_gadget_init(mrb_state *mrb, struct RClass *tnk);
+
+#endif
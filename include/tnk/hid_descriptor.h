@@ -0,0 +1,155 @@
+#ifndef TNK_HID_DESCRIPTOR_H
+#define TNK_HID_DESCRIPTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <mruby.h>
+#include <mruby/data.h>
+
+/*
+ * Compiled HID report descriptor.
+ *
+ * tnk_hid_compile walks a report descriptor once and turns it into a flat
+ * table of fields grouped by report ID, so decoders can pull keys, modifiers
+ * and mouse deltas out of a report by index instead of assuming an 8 byte
+ * boot keyboard. Constant (padding) items only advance the bit offset and
+ * are not recorded.
+ */
+
+#define TNK_HID_MAX_REPORTS 32
+#define TNK_HID_MAX_FIELDS  128
+#define TNK_HID_MAX_USAGES  512
+
+enum tnk_hid_report_type {
+  TNK_HID_INPUT,
+  TNK_HID_OUTPUT,
+  TNK_HID_FEATURE,
+  TNK_HID_REPORT_TYPES
+};
+
+/* low byte of the Input/Output/Feature item data */
+#define TNK_HID_FIELD_CONSTANT 0x01
+#define TNK_HID_FIELD_VARIABLE 0x02
+#define TNK_HID_FIELD_RELATIVE 0x04
+
+/* usages are stored extended: usage page in the upper 16 bits */
+#define TNK_HID_USAGE(page, id) (((uint32_t)(page) << 16) | (uint16_t)(id))
+#define TNK_HID_USAGE_PAGE(u)   ((uint16_t)((u) >> 16))
+#define TNK_HID_USAGE_ID(u)     ((uint16_t)((u) & 0xFFFF))
+
+#define TNK_HID_PAGE_GENERIC_DESKTOP 0x01
+#define TNK_HID_PAGE_KEYBOARD        0x07
+#define TNK_HID_PAGE_LED             0x08
+#define TNK_HID_PAGE_BUTTON          0x09
+#define TNK_HID_PAGE_CONSUMER        0x0C
+#define TNK_HID_PAGE_DIGITIZER       0x0D
+
+struct tnk_hid_field {
+  uint16_t bit_offset;  /* from the first payload byte, after the report ID */
+  uint8_t bit_size;
+  uint8_t report_id;
+  uint16_t count;
+  uint8_t type;         /* enum tnk_hid_report_type */
+  uint8_t flags;        /* TNK_HID_FIELD_* */
+  uint32_t application; /* usage of the enclosing application collection */
+  uint32_t usage_min;   /* usage range when usage_count is 0 */
+  uint32_t usage_max;
+  uint16_t usage_index; /* explicit usages in tnk_hid_layout.usages */
+  uint16_t usage_count;
+  int32_t logical_min;
+  int32_t logical_max;
+};
+
+struct tnk_hid_report {
+  uint8_t id;
+  uint16_t bits[TNK_HID_REPORT_TYPES];
+  uint16_t first_field; /* fields of a report are contiguous */
+  uint16_t nfields;
+};
+
+struct tnk_hid_layout {
+  bool has_report_ids;
+  uint16_t nreports;
+  uint16_t nfields;
+  uint16_t nusages;
+  uint8_t report_index[256]; /* report ID -> reports[], 0xFF if unused */
+  struct tnk_hid_report reports[TNK_HID_MAX_REPORTS];
+  struct tnk_hid_field fields[TNK_HID_MAX_FIELDS];
+  uint32_t usages[TNK_HID_MAX_USAGES];
+};
+
+extern const struct mrb_data_type tnk_hid_layout_type;
+
+/* Returns NULL on success or a static error message. */
+const char *tnk_hid_compile(const uint8_t *desc, size_t len, struct tnk_hid_layout *layout);
+
+/* Defines Tnk::Hidraw::Layout. */
+void tnk_hid_descriptor_init(mrb_state *mrb, struct RClass *tnk);
+
+static inline const struct tnk_hid_report *
+tnk_hid_report_by_id(const struct tnk_hid_layout *layout, uint8_t id)
+{
+  uint8_t idx = layout->report_index[id];
+  return idx == 0xFF ? NULL : &layout->reports[idx];
+}
+
+/* Report length in bytes as seen on hidraw/hidg, including the ID byte. */
+static inline size_t
+tnk_hid_report_len(const struct tnk_hid_layout *layout, const struct tnk_hid_report *report,
+                   enum tnk_hid_report_type type)
+{
+  if (!report || report->bits[type] == 0) return 0;
+  return (size_t)((report->bits[type] + 7) / 8) + (layout->has_report_ids ? 1 : 0);
+}
+
+/* Usage of element +i+ of a field, the last explicit usage repeats. */
+static inline uint32_t
+tnk_hid_field_usage(const struct tnk_hid_layout *layout, const struct tnk_hid_field *field, uint32_t i)
+{
+  if (field->usage_count) {
+    if (i >= field->usage_count) i = field->usage_count - 1;
+    return layout->usages[field->usage_index + i];
+  }
+  uint32_t usage = field->usage_min + i;
+  return usage > field->usage_max ? field->usage_max : usage;
+}
+
+/* Raw value of element +i+ of a field, +payload+ starts after the ID byte. */
+static inline uint32_t
+tnk_hid_field_raw(const struct tnk_hid_field *field, const uint8_t *payload, size_t len, uint32_t i)
+{
+  uint32_t bit = (uint32_t)field->bit_offset + i * field->bit_size;
+  uint32_t value = 0;
+  for (uint32_t b = 0; b < field->bit_size; b++, bit++) {
+    if ((bit >> 3) >= len) break;
+    value |= (uint32_t)((payload[bit >> 3] >> (bit & 7)) & 1) << b;
+  }
+  return value;
+}
+
+/* Stores the low bit_size bits of +value+ as element +i+ of a field. */
+static inline void
+tnk_hid_field_set_raw(const struct tnk_hid_field *field, uint8_t *payload, size_t len, uint32_t i,
+                      uint32_t value)
+{
+  uint32_t bit = (uint32_t)field->bit_offset + i * field->bit_size;
+  for (uint32_t b = 0; b < field->bit_size; b++, bit++) {
+    if ((bit >> 3) >= len) break;
+    uint8_t mask = (uint8_t)(1u << (bit & 7));
+    payload[bit >> 3] = (uint8_t)(((value >> b) & 1) ? (payload[bit >> 3] | mask) : (payload[bit >> 3] & ~mask));
+  }
+}
+
+/* Value of element +i+, sign extended when the logical range is signed. */
+static inline int32_t
+tnk_hid_field_value(const struct tnk_hid_field *field, const uint8_t *payload, size_t len, uint32_t i)
+{
+  uint32_t raw = tnk_hid_field_raw(field, payload, len, i);
+  if (field->logical_min < 0 && field->bit_size < 32 && (raw & (1u << (field->bit_size - 1)))) {
+    raw |= ~((1u << field->bit_size) - 1);
+  }
+  return (int32_t)raw;
+}
+
+#endif
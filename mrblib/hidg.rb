@@ -2,25 +2,77 @@ class Tnk
   module Hidg
     extend self
     @@hid_map = []
+    @@functions = {} # index => [hidraw_dev or nil when idle, report descriptor]
+    @@composite = [] # [hidraw_dev or nil when idle, report descriptor, id map] per part
+    @@timeline = []
+    @@evdev_sinks = []
+
+    DISK_IMAGE_SIZE = 128 * 1024 * 1024
+    UDC_TIMEOUT_MS = 3000
+    # what a host takes for a report descriptor (HID_MAX_DESCRIPTOR_SIZE)
+    COMPOSITE_DESC_MAX = 4096
 
     GADGET = "/sys/kernel/config/usb_gadget/tnk"
+    # how our own gadget shows up in HID_ID when the host is this machine (dummy_hcd)
+    GADGET_HID_ID = "00001D6B:00000104"
+
+    # What input devices without a hidraw node are forwarded as: a boot
+    # keyboard and a 5 button mouse with 16 bit motion, a wheel and AC pan.
+    EVDEV_KEYBOARD_DESC = [
+      0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7,
+      0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+      0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+      0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+      0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+      0x81, 0x00, 0xc0
+    ].pack("C*")
+    EVDEV_MOUSE_DESC = [
+      0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09,
+      0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01,
+      0x81, 0x02, 0x95, 0x01, 0x75, 0x03, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30,
+      0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xff, 0x7f, 0x75, 0x10, 0x95, 0x02,
+      0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x01,
+      0x81, 0x06, 0x05, 0x0c, 0x0a, 0x38, 0x02, 0x15, 0x81, 0x25, 0x7f, 0x75,
+      0x08, 0x95, 0x01, 0x81, 0x06, 0xc0, 0xc0
+    ].pack("C*")
 
+    # [[hidraw_dev, hidg_dev, id map or nil], ...], see add_composite_function
     def hid_map
       @@hid_map
     end
 
+    # [keyboard hidg, mouse hidg] fed from evdev devices
+    def evdev_sinks
+      @@evdev_sinks
+    end
+
+    # [[label, ms since boot], ...] of the last setup, starting at process start
+    def timeline
+      @@timeline
+    end
+
     def setup
       @@hid_map.clear
+      @@functions.clear
+      @@composite.clear
+      @@timeline.clear
+      @@evdev_sinks.clear
+      @@timeline << ["process start", Gadget.process_start_ms]
+      mark "setup"
       if File.exist?("#{GADGET}/UDC")
         udc = read_first_line("#{GADGET}/UDC")
         if udc.delete(" \t\r\n\f\v") != ""
           stop
+          mark "previous gadget stopped"
         end
       end
 
-      sh_silent "modprobe -r dwc2"
-      sh_silent "modprobe dwc2"
-      sh_silent "modprobe libcomposite"
+      # the controller driver reloads in the background, nothing but the final
+      # UDC bind depends on it. A UDC picked through TNK_UDC (dummy_hcd for
+      # benchmarks) is brought up by whoever picked it.
+      dwc2 = load_module_async("dwc2", true) unless Gadget.configured_udc
+      wait_module("libcomposite", load_module_async("libcomposite"))
+      mark "libcomposite loaded"
       mkdir_p(GADGET)
       Dir.chdir(GADGET) do
         file_write("idVendor",     "0x1d6b")
@@ -47,8 +99,8 @@ class Tnk
         disk_img = File.join(share_dir, "disk.img")
         unless File.exist?(disk_img)
           debug_puts "📦 Creating disk.img..."
-          sh "dd if=/dev/zero of=#{disk_img} bs=128M count=1"
-          sh "mkfs.vfat #{disk_img}"
+          Gadget.make_fat_image(disk_img, DISK_IMAGE_SIZE, "TNK")
+          mark "disk.img created"
         else
           debug_puts "✅ disk.img exists – skipping creation."
         end
@@ -63,33 +115,105 @@ class Tnk
         ln_s("functions/ncm.usb0", "configs/c.1/ncm.usb0")
 
         debug_puts "🧠 Scanning for HID report descriptors..."
+        devices = []
+        each_hidraw_report_descriptor do |desc_path|
+          hidraw_name = File.basename(File.dirname(File.dirname(desc_path)))
+          devices << ["/dev/#{hidraw_name}", desc_path]
+        end
+        devices = add_composite_function(devices) if Gadget.composite?
         hid_index = 0
-        each_hidraw_report_descriptor do |hidraw|
-          length = Tnk::Hidraw.calc_report_length_smart(hidraw)
-          debug_puts "🔧 Adding HID function #{hid_index} (report_length=#{length})..."
-          func_dir = "functions/hid.usb#{hid_index}"
-          mkdir_p(func_dir)
-          file_write("#{func_dir}/protocol", "0")
-          file_write("#{func_dir}/subclass", "0")
-          file_write("#{func_dir}/report_length", length.to_s)
-          File.open("#{func_dir}/report_desc", "wb") do |out|
-            File.open(hidraw, "rb") { |inp| out.write(inp.read) }
-          end
-          ln_s(func_dir, "configs/c.1/hid.usb#{hid_index}")
-          hidraw_name = File.basename(File.dirname(File.dirname(hidraw)))
-          hidraw_dev  = "/dev/#{hidraw_name}"
-          @@hid_map << [hidraw_dev, "/dev/hidg#{hid_index}"]
+        devices.each do |hidraw_dev, desc_path|
+          add_hid_function(hid_index, desc_path)
+          @@functions[hid_index][0] = hidraw_dev
+          @@hid_map << [hidraw_dev, hidg_device(hid_index), nil]
           hid_index += 1
         end
+        # always there, so Bluetooth keyboards and the like can come and go
+        # without a UDC rebind
+        add_function("hid.evkbd", EVDEV_KEYBOARD_DESC, 8, 1, 1)
+        add_function("hid.evmouse", EVDEV_MOUSE_DESC, 7, 0, 0)
+        @@evdev_sinks.replace([function_device("hid.evkbd"), function_device("hid.evmouse")])
+        mark "configfs populated"
+
+        unless Gadget.configured_udc
+          wait_module("dwc2", dwc2, true)
+          mark "dwc2 loaded"
+        end
+        file_write("UDC", first_udc)
+        mark "UDC bound"
 
-        udc_name = sh_capture("ls /sys/class/udc").split("\n").first
-        file_write("UDC", udc_name)
+        ifname = read_first_line("functions/ncm.usb0/ifname")
+        begin
+          Gadget.link_up(ifname)
+          Gadget.add_address(ifname, "fe80::1", 128)
+        rescue SystemCallError => e
+          debug_puts "⚠️  Could not bring up #{ifname}: #{e.message}"
+        end
+        mark "#{ifname} up"
+      end
+
+      print_timeline
+    end
+
+    # Exposes a hotplugged hidraw node to the host and returns its hidg node
+    # and id map. An idle function or composite part with the same descriptor
+    # is reused as is, anything else needs a new function and the UDC has to be
+    # rebound for the host to see it. The composite function is never grown:
+    # its descriptor can't change without unlinking it, which would take the
+    # hidg nodes of every device in it away from under the worker.
+    def add_hidraw(hidraw_dev)
+      desc_path = "/sys/class/hidraw/#{File.basename(hidraw_dev)}/device/report_descriptor"
+      return nil unless File.exist?(desc_path)
+      return nil if own_gadget?(File.basename(hidraw_dev))
+      desc = File.open(desc_path, "rb") { |f| f.read }
+
+      part = @@composite.find { |dev, d, _| dev.nil? && d == desc }
+      if part
+        part[0] = hidraw_dev
+        hidg_dev = function_device("hid.composite")
+        @@hid_map << [hidraw_dev, hidg_dev, part[2]]
+        return [hidg_dev, part[2]]
+      end
+
+      index = nil
+      @@functions.each do |i, (dev, d)|
+        if dev.nil? && d == desc
+          index = i
+          break
+        end
+      end
 
-        unless sh_silent("ip link set usb0 up")
-          debug_puts "⚠️  Could not bring up usb0 (ip failed)"
+      Dir.chdir(GADGET) do
+        unless index
+          debug_puts "🔌 Rebinding UDC for #{hidraw_dev}..."
+          udc = read_first_line("UDC")
+          file_write("UDC", "") if udc.delete(" \t\r\n\f\v") != ""
+          remove_idle_functions
+          index = 0
+          index += 1 while @@functions.key?(index)
+          add_hid_function(index, desc_path)
+          file_write("UDC", first_udc)
+          mark "UDC rebound for #{hidraw_dev}"
         end
-        sh_silent("ip -6 addr add fe80::1 dev usb0")
       end
+
+      @@functions[index][0] = hidraw_dev
+      hidg_dev = hidg_device(index)
+      @@hid_map << [hidraw_dev, hidg_dev, nil]
+      [hidg_dev, nil]
+    end
+
+    # The function stays configured as an idle spare, removing it would mean
+    # rebinding the UDC and dropping every other device for a moment.
+    def remove_hidraw(hidraw_dev)
+      @@hid_map.delete_if { |raw, _| raw == hidraw_dev }
+      @@functions.each_value do |f|
+        f[0] = nil if f[0] == hidraw_dev
+      end
+      @@composite.each do |part|
+        part[0] = nil if part[0] == hidraw_dev
+      end
+      nil
     end
 
     def stop
@@ -116,8 +240,170 @@ class Tnk
       Dir.chdir(original_pwd)
     end
 
+    # All keys up on a composite function: the empty report of a device, with
+    # its first report ID.
+    def composite_release_report(id_map, length)
+      return id_map[0] + "\x00" * length if id_map.getbyte(0) != 0
+      id = (1..255).find { |i| id_map.getbyte(i) != 0 }
+      id_map[id] + "\x00" * (length - 1)
+    end
+
+    # The worker never touches the gadget, what setup kept about it (report
+    # descriptors, the timeline) only takes up memory there.
+    def forget
+      @@hid_map.clear
+      @@functions.clear
+      @@composite.clear
+      @@timeline.clear
+      @@evdev_sinks.clear
+      nil
+    end
+
     private
 
+    # TNK_COMPOSITE=1: the hidraw devices share a single HID function, so
+    # their number isn't bounded by the endpoints of the UDC (dwc2 runs out
+    # after a few functions). Each device's descriptor goes into the composite
+    # one with report IDs of its own, the id map (256 bytes, new ID by the
+    # device's, 0 for none) tells the forwarder how to translate its reports,
+    # a device without report IDs uses entry 0 as the ID to put in front.
+    # Devices that don't fit get a function of their own, those are returned.
+    def add_composite_function(devices)
+      merged = ""
+      next_id = 1
+      length = 0
+      rest = []
+      devices.each do |hidraw_dev, desc_path|
+        desc = File.open(desc_path, "rb") { |f| f.read }
+        layout = Hidraw::Layout.new(desc) rescue nil
+        ids = layout.report_ids? ? layout.report_ids - [0] : [0] if layout
+        if !ids || next_id + ids.size > 256
+          rest << [hidraw_dev, desc_path]
+          next
+        end
+        id_map = "\x00" * 256
+        ids.each_with_index { |id, i| id_map.setbyte(id, next_id + i) }
+        part = Hidraw.remap_report_ids(desc, id_map)
+        if merged.bytesize + part.bytesize > COMPOSITE_DESC_MAX
+          rest << [hidraw_dev, desc_path]
+          next
+        end
+        merged << part
+        next_id += ids.size
+        # reports of a device without IDs grow by the one put in front
+        part_length = layout.input_length + (layout.report_ids? ? 0 : 1)
+        length = part_length if part_length > length
+        @@composite << [hidraw_dev, desc, id_map]
+      end
+      return rest if @@composite.empty?
+
+      debug_puts "🔧 Adding composite HID function for #{@@composite.size} devices (report_length=#{length})..."
+      add_function("hid.composite", merged, length)
+      hidg_dev = function_device("hid.composite")
+      @@composite.each do |hidraw_dev, _, id_map|
+        @@hid_map << [hidraw_dev, hidg_dev, id_map]
+      end
+      rest
+    end
+
+    def add_hid_function(index, desc_path)
+      length = Tnk::Hidraw.calc_report_length_smart(desc_path)
+      debug_puts "🔧 Adding HID function #{index} (report_length=#{length})..."
+      desc = File.open(desc_path, "rb") { |f| f.read }
+      add_function("hid.usb#{index}", desc, length)
+      @@functions[index] = [nil, desc]
+    end
+
+    def add_function(name, desc, length, subclass = 0, protocol = 0)
+      func_dir = "functions/#{name}"
+      mkdir_p(func_dir)
+      file_write("#{func_dir}/protocol", protocol.to_s)
+      file_write("#{func_dir}/subclass", subclass.to_s)
+      file_write("#{func_dir}/report_length", length.to_s)
+      File.open("#{func_dir}/report_desc", "wb") { |out| out.write(desc) }
+      ln_s(func_dir, "configs/c.1/#{name}")
+    end
+
+    def remove_idle_functions
+      @@functions.keys.each do |index|
+        next if @@functions[index][0]
+        File.delete("configs/c.1/hid.usb#{index}") if File.symlink?("configs/c.1/hid.usb#{index}")
+        Dir.rmdir("functions/hid.usb#{index}")
+        @@functions.delete(index)
+      end
+    end
+
+    # the minor is handed out when the function is created and need not match
+    # its index once functions have come and gone
+    def hidg_device(index)
+      function_device("hid.usb#{index}")
+    end
+
+    def function_device(name)
+      dev = read_first_line("#{GADGET}/functions/#{name}/dev")
+      "/dev/hidg#{dev.split(":").last}"
+    end
+
+    def first_udc
+      Gadget.wait_udc(UDC_TIMEOUT_MS) or raise GadgetError, "no USB device controller found"
+    end
+
+    def mark(label)
+      @@timeline << [label, Gadget.boottime_ms]
+    end
+
+    def print_timeline
+      start = @@timeline.first[1]
+      prev = start
+      @@timeline.each do |label, at|
+        debug_puts "⏱  #{format_ms(at - start)} (+#{format_ms(at - prev)}) #{label}"
+        prev = at
+      end
+      puts "⏱  gadget bound #{format_ms(prev - start)} after start, #{format_ms(prev)} after boot"
+    end
+
+    def format_ms(ms)
+      "#{(ms * 10).round / 10.0} ms"
+    end
+
+    # Kernel module and its dependencies in load order, nil if modules.dep
+    # doesn't know it (built in, or no module tree for this kernel).
+    def module_paths(name)
+      base = "/lib/modules/#{read_first_line("/proc/sys/kernel/osrelease")}"
+      wanted = name.tr("-", "_")
+      File.open("#{base}/modules.dep") do |f|
+        while line = f.gets
+          mod, deps = line.chomp.split(":", 2)
+          next unless File.basename(mod).split(".").first.tr("-", "_") == wanted
+          paths = deps.to_s.split(" ").reverse
+          paths << mod
+          return paths.map { |path| path.start_with?("/") ? path : "#{base}/#{path}" }
+        end
+      end
+      nil
+    rescue Errno::ENOENT
+      nil
+    end
+
+    def load_module_async(name, reload = false)
+      paths = module_paths(name)
+      return Gadget::ModuleLoader.new(paths, reload ? name : nil) if paths
+      modprobe(name, reload)
+      nil
+    end
+
+    def wait_module(name, loader, reload = false)
+      loader.wait if loader
+    rescue SystemCallError => e
+      debug_puts "⚠️  finit_module #{name}: #{e.message}, falling back to modprobe"
+      modprobe(name, reload)
+    end
+
+    def modprobe(name, reload)
+      sh_silent "modprobe -r #{name}" if reload
+      sh_silent "modprobe #{name}"
+    end
+
     def read_first_line(path)
       File.open(path) { |f| f.gets.to_s.chomp }
     end
@@ -154,26 +440,11 @@ class Tnk
       end
     end
 
-    def sh(cmd)
-      debug_puts "→ #{cmd}"
-      IO.popen(cmd) do |io|
-        while line = io.gets
-          debug_puts line
-        end
-      end
-      status = $?
-      raise GadgetError, "Command failed: #{cmd}" unless status == 0
-    end
-
     def sh_silent(cmd)
       IO.popen(cmd) { |io| io.read }
       $? == 0
     end
 
-    def sh_capture(cmd)
-      IO.popen(cmd) { |io| io.read }.chomp
-    end
-
     def each_hidraw_report_descriptor
       base = "/sys/class/hidraw"
       Dir.open(base) do |d|
@@ -181,9 +452,24 @@ class Tnk
           next if entry == "." || entry == ".."
           next unless entry.start_with?("hidraw")
           path = "#{base}/#{entry}/device/report_descriptor"
-          yield path if File.exist?(path)
+          yield path if File.exist?(path) && !own_gadget?(entry)
+        end
+      end
+    end
+
+    # Forwarding our own gadget back into itself would rebind the UDC forever.
+    # Only dummy_hcd (TNK_UDC) loops the gadget back to this host, behind dwc2
+    # a hidraw with the gadget's IDs is some other real keyboard.
+    def own_gadget?(hidraw_name)
+      return false unless Gadget.configured_udc
+      File.open("/sys/class/hidraw/#{hidraw_name}/device/uevent") do |f|
+        while line = f.gets
+          return line.chomp.end_with?(GADGET_HID_ID) if line.start_with?("HID_ID=")
         end
       end
+      false
+    rescue SystemCallError
+      false
     end
 
     def remove_symlinks(dir)
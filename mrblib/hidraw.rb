@@ -1,6 +1,10 @@
 class Tnk
   module Hidraw
-    def self.hidraw_to_by_id_names(hidraw_dev)
+    # The /dev/input/event* nodes of the HID device behind a hidraw node,
+    # found through sysfs. The /dev/input/by-id links only show up once udev
+    # got to the device, after the kernel uevent a hotplug is handled on,
+    # while devtmpfs has the event nodes in place before it is sent.
+    def self.hidraw_to_event_paths(hidraw_dev)
       sys_class   = "/sys/class/hidraw"
       hidraw_name = File.basename(hidraw_dev)
       sys_path    = File.join(sys_class, hidraw_name, "device")
@@ -23,19 +27,10 @@ class Tnk
           event_nodes.concat(find_event_nodes(path))
         end
       end
-      event_nodes.map! { |p| File.realpath(p) rescue p }
-
-      by_id_dir = "/dev/input/by-id"
-
-      Dir.entries(by_id_dir).filter_map do |name|
-        link_path = File.join(by_id_dir, name)
-        next unless File.symlink?(link_path)
-        target = File.realpath(link_path) rescue nil
-        event_nodes.include?(target) ? name : nil
-      end.sort
+      event_nodes.uniq.sort
     end
 
-    def self.calc_report_length(path)
+    def self.layout(path)
       raise ReportDescriptorError, "No path provided" if !path || path.empty?
 
       data =
@@ -45,77 +40,30 @@ class Tnk
           raise ReportDescriptorError, "Could not open '#{path}': #{e.message}"
         end
 
-      bytes = data.bytes
-      i = 0
-      max_report_size = 0
-      current_report_id = 0
-      has_report_ids = false
-      report_bits = 0
-
-      input_size_bits = 0
-      input_count = 0
-
-      byte_length = ->(bits) { (bits + 7) / 8 }
-
-      update_max = lambda do
-        if report_bits > 0
-          length = byte_length.call(report_bits)
-          length += 1 if current_report_id != 0 || has_report_ids
-          max_report_size = length if length > max_report_size
-        end
-      end
-
-      while i < bytes.size
-        b = bytes[i]; i += 1
-
-        if b == 0xFE
-          raise ReportDescriptorError, "Malformed long item" if i + 2 > bytes.size
-          size = bytes[i]
-          i += 2 + size
-          next
-        end
-
-        size_code = b & 0x03
-        size = [0, 1, 2, 4][size_code]
-        type = (b >> 2) & 0x03
-        tag = (b >> 4) & 0x0F
-
-        value = 0
-        if size > 0
-          size.times do |j|
-            value |= (bytes[i + j] || 0) << (8 * j)
-          end
-          i += size
-        end
+      Layout.new(data)
+    end
 
-        if type == 1 # Global
-          case tag
-          when 0x07 then input_size_bits = value
-          when 0x09 then input_count = value
-          when 0x08
-            update_max.call
-            current_report_id = value
-            has_report_ids = true
-            report_bits = 0
-          end
-        elsif type == 0 && tag == 0x08 # Main Input
-          report_bits += input_size_bits * input_count
-        end
-      end
+    def self.layout_smart(path)
+      layout(report_descriptor_path(path))
+    end
 
-      update_max.call
-      max_report_size = 8 if max_report_size == 0
-      max_report_size
+    def self.calc_report_length(path)
+      length = layout(path).input_length
+      length == 0 ? 8 : length
     end
 
     def self.calc_report_length_smart(path)
+      calc_report_length(report_descriptor_path(path))
+    end
+
+    def self.report_descriptor_path(path)
       if path.start_with?("/dev/hidraw")
         node = path.split("/").last
         sysfs_path = "/sys/class/hidraw/#{node}/device/report_descriptor"
         debug_puts "[INFO] Using sysfs report descriptor: #{sysfs_path}"
-        calc_report_length(sysfs_path)
+        sysfs_path
       else
-        calc_report_length(path)
+        path
       end
     end
 
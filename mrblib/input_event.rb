@@ -4,14 +4,34 @@ class Tnk
       @hidraw_device = hidraw_device
       @event_devices = []
 
-      Tnk::Hidraw.hidraw_to_by_id_names(hidraw_device).each do |by_id_name|
-        path = File.join("/dev/input/by-id", by_id_name)
-        file = File.open(path, 'rb')
-        Tnk.grab(file)
-        @event_devices << file
+      Tnk::Hidraw.hidraw_to_event_paths(hidraw_device).each do |path|
+        begin
+          file = File.open(path, 'rb')
+          Tnk.grab(file)
+        rescue SystemCallError => e
+          # still forwarded, its keys just reach the console too
+          debug_puts "⚠️  Could not grab #{path}: #{e.message}"
+        end
+        @event_devices << file if file
       end
     end
 
+    # /dev/input/event* nodes no hidraw node stands for: uinput and other
+    # virtual devices, Bluetooth keyboards on some stacks. A HID device's
+    # input devices hang off the hid bus, everything else gets read as evdev.
+    def self.standalone_paths
+      Dir.entries("/sys/class/input").filter_map do |name|
+        next unless name.start_with?("event")
+        path = "/dev/input/#{name}"
+        hid_backed?(path) ? nil : path
+      end.sort
+    end
+
+    def self.hid_backed?(event_path)
+      subsystem = File.realpath("/sys/class/input/#{File.basename(event_path)}/device/device/subsystem") rescue nil
+      subsystem ? subsystem.end_with?("/bus/hid") : false
+    end
+
     def close
       @event_devices.each do |file|
         Tnk.ungrab(file) rescue nil
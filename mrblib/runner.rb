@@ -13,10 +13,18 @@ class Tnk
       runner.setup_user
     end
 
+    def hotplug(action, hidraw_path)
+      runner.hotplug(action, hidraw_path)
+    end
+
     def run
       runner.run
     end
 
+    def release
+      runner.release
+    end
+
     def close
       runner.close
       self.instance = nil
@@ -2,61 +2,151 @@ class Tnk
   def initialize
     @hidraw_to_hidg = {}
     @empty_report = {}
+    @id_maps = {} # hidraw file => id map of its part of the composite function
     @event_devices = {}
+    @hidraw_files = {}
+    @evdev_files = {}
+    @evdev_sinks = []
   end
 
   def setup_root
     Hidg.setup
-    Hidg.hid_map.each do |hidraw_path, hidg_path|
-      hidraw_file = File.open(hidraw_path, 'rb')
-      hidg_file   = File.open(hidg_path, 'wb')
-      @hidraw_to_hidg[hidraw_file] = hidg_file
-      @event_devices[hidraw_file]  = EventDevices.new(hidraw_path)
-      @empty_report[hidraw_file]   = "\x00" * Hidraw.calc_report_length_smart(hidraw_path)
+    Hidg.hid_map.each do |hidraw_path, hidg_path, id_map|
+      attach(hidraw_path, hidg_path, id_map)
+    end
+    @evdev_sinks = Hidg.evdev_sinks.map { |path| File.open(path, 'wb') }
+    EventDevices.standalone_paths.each do |path|
+      attach_evdev(path)
     end
   end
 
-  def setup_user
-    Tnk.gen_keymap
-    @io_uring = IO::Uring.new
-    hid_proc = Proc.new do |hidraw, hidg|
-      @io_uring.prep_read_fixed(hidraw) do |read_op|
-        Hotkeys.handle_hid_report(read_op.buf)
-        @io_uring.prep_write_fixed(hidg, read_op) do |write_op|
-          @io_uring.return_used_buffer(write_op)
-        end
-        hid_proc.call(hidraw, hidg)
-      end
+  # Called in the root process for every hidraw and input uevent. Returns the
+  # descriptors the worker needs to forward a newly added device.
+  def hotplug(action, hidraw_path)
+    return hotplug_evdev(action, hidraw_path) if hidraw_path.start_with?("/dev/input/")
+
+    case action
+    when "add"
+      return nil if @hidraw_files.key?(hidraw_path)
+      hidg_path, id_map = Hidg.add_hidraw(hidraw_path)
+      return nil unless hidg_path
+      debug_puts "🔌 #{hidraw_path} -> #{hidg_path}"
+      hidraw_file = attach(hidraw_path, hidg_path, id_map)
+      fds = [hidraw_file.fileno, @hidraw_to_hidg[hidraw_file].fileno, @empty_report[hidraw_file].bytesize]
+      fds << id_map if id_map
+      fds
+    when "remove"
+      detach(hidraw_path)
+      Hidg.remove_hidraw(hidraw_path)
+      nil
     end
+  end
 
+  def hotplug_evdev(action, event_path)
+    case action
+    when "add"
+      return nil if @evdev_files.key?(event_path) || EventDevices.hid_backed?(event_path)
+      file = attach_evdev(event_path)
+      return nil unless file
+      debug_puts "🔌 #{event_path} -> evdev"
+      [file.fileno]
+    when "remove"
+      file = @evdev_files.delete(event_path)
+      file.close if file
+      nil
+    end
+  end
+
+  def setup_user
+    Tnk.gen_keymap
+    @forwarder = Forwarder.new
     @hidraw_to_hidg.each do |hidraw, hidg|
-      hid_proc.call(hidraw, hidg)
+      @forwarder.add(hidraw, hidg, @empty_report[hidraw].bytesize, :auto, @id_maps[hidraw])
     end
+    @forwarder.evdev_sinks(*@evdev_sinks) if @evdev_sinks.size == 2
+    @evdev_files.each_value do |file|
+      @forwarder.add_evdev(file)
+    end
+    Hidg.forget
 
     debug_puts "✅ setup complete"
   end
 
   def run
-    while true
-      @io_uring.wait do |op|
-        if op.errno
-          if op.errno.is_a?(Errno::EIO)
-            return
-          else
-            debug_puts op.inspect
-            raise op.errno
-          end
-        end
-      end
+    @forwarder.run
+  end
+
+  def attach(hidraw_path, hidg_path, id_map = nil)
+    hidraw_file = File.open(hidraw_path, 'rb')
+    hidg_file   = File.open(hidg_path, 'wb')
+    @hidraw_files[hidraw_path]   = hidraw_file
+    @hidraw_to_hidg[hidraw_file] = hidg_file
+    @event_devices[hidraw_file]  = EventDevices.new(hidraw_path)
+    @empty_report[hidraw_file]   = "\x00" * Hidraw.calc_report_length_smart(hidraw_path)
+    @id_maps[hidraw_file]        = id_map if id_map
+    hidraw_file
+  end
+
+  # Keyboards and mice only, the power button has nothing to tell the host.
+  def attach_evdev(event_path)
+    file = File.open(event_path, 'rb')
+    unless Tnk.evdev_kind(file)
+      file.close
+      return nil
+    end
+    Tnk.grab(file)
+    @evdev_files[event_path] = file
+  rescue SystemCallError => e
+    debug_puts "⚠️  #{event_path}: #{e.message}"
+    file.close if file && !file.closed?
+    nil
+  end
+
+  def detach(hidraw_path)
+    hidraw_file = @hidraw_files.delete(hidraw_path)
+    return unless hidraw_file
+    hidg_file = @hidraw_to_hidg.delete(hidraw_file)
+    empty_report = release_report(hidraw_file)
+    @empty_report.delete(hidraw_file)
+    @id_maps.delete(hidraw_file)
+    event_devices = @event_devices.delete(hidraw_file)
+    # release whatever was held down when the device went away
+    hidg_file.write(empty_report) rescue nil
+    hidg_file.close
+    hidraw_file.close
+    event_devices.close if event_devices
+  end
+
+  # the empty report as the device's hidg takes it
+  def release_report(hidraw_file)
+    id_map = @id_maps[hidraw_file]
+    return @empty_report[hidraw_file] unless id_map
+    Hidg.composite_release_report(id_map, @empty_report[hidraw_file].bytesize)
+  end
+
+  # Everything up on the host, for a worker that went away while keys or
+  # buttons were held. The worker made hidg non-blocking, a host that
+  # stopped polling gets nothing (EAGAIN).
+  def release
+    @hidraw_to_hidg.each do |hidraw_file, hidg_file|
+      hidg_file.write(release_report(hidraw_file)) rescue nil
+    end
+    @evdev_sinks.each_with_index do |hidg_file, i|
+      hidg_file.write("\x00" * (i == 0 ? 8 : 7)) rescue nil
     end
   end
 
   def close
+    3.times { release }
     @hidraw_to_hidg.each do |hidraw_file, hidg_file|
-      3.times { hidg_file.write(@empty_report[hidraw_file]) }
       hidraw_file.close
       hidg_file.close
     end
+    @evdev_sinks.each(&:close)
+    @evdev_files.each_value do |file|
+      Tnk.ungrab(file) rescue nil
+      file.close
+    end
 
     @event_devices.each_value(&:close)
     Hidg.stop
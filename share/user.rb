@@ -1 +1,12 @@
-Tnk::Hotkeys.on(:lshift, "z") { "Shift+Z pressed" }
+# A hotkey block may return what the host should see instead of the hotkey:
+# a report string (e.g. from Tnk::Hotkeys.generate_hid_report), a text to
+# type from Tnk::Hotkeys.type(text, pace_ms = 0), an integer to pause that
+# many ms, or an array of those, played back in order.
+# Anything else is ignored.
+#
+# Tnk::Hotkeys.on(*keys, trigger: :press) matches the keys held down, in any
+# order; trigger: :release runs the block when one of them goes up again.
+# Tnk::Hotkeys.sequence(*chords, timeout: 1000) matches a leader chord
+# followed by more chords, each within timeout ms of the last.
+Tnk::Hotkeys.on(:lshift, "z") { Tnk::Hotkeys.type("Shift Z pressed\n") }
+Tnk::Hotkeys.sequence([:lctrl, "t"], "d") { Tnk::Hotkeys.type("leader, then d\n") }
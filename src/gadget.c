@@ -0,0 +1,581 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_addr.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/data.h>
+#include <mruby/presym.h>
+#include <mruby/string.h>
+#include <tnk/gadget.h>
+
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+/* ---- FAT16 ---- */
+
+#define FAT_SECTOR        512
+#define FAT_RESERVED      1
+#define FAT_COPIES        2
+#define FAT_ROOT_ENTRIES  512
+#define FAT_MEDIA         0xF8
+#define FAT16_MIN_CLUSTERS 4085
+#define FAT16_MAX_CLUSTERS 65524
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static int
+pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+  const uint8_t *p = (const uint8_t *)buf;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, off);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+    off += n;
+  }
+  return 0;
+}
+
+int
+tnk_fat16_format(int fd, uint64_t size, const char *label)
+{
+  uint64_t total = size / FAT_SECTOR;
+  uint32_t root_sectors = FAT_ROOT_ENTRIES * 32 / FAT_SECTOR;
+  uint32_t fat_sectors = 0, clusters = 0;
+  unsigned spc;
+
+  if (total > UINT32_MAX || total < FAT_RESERVED + root_sectors + 2) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* smallest cluster size that keeps the cluster count FAT16 sized, FAT
+   * size as in the Microsoft FAT specification */
+  for (spc = 1; spc <= 64; spc <<= 1) {
+    uint32_t tmp1 = (uint32_t)total - (FAT_RESERVED + root_sectors);
+    uint32_t tmp2 = 256 * spc + FAT_COPIES;
+    fat_sectors = (tmp1 + tmp2 - 1) / tmp2;
+    clusters = ((uint32_t)total - FAT_RESERVED - FAT_COPIES * fat_sectors - root_sectors) / spc;
+    if (clusters <= FAT16_MAX_CLUSTERS) break;
+  }
+  if (spc > 64 || clusters < FAT16_MIN_CLUSTERS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char name[11];
+  memset(name, ' ', sizeof(name));
+  if (!label || !*label) label = "NO NAME";
+  for (size_t i = 0; i < sizeof(name) && label[i]; i++) {
+    char c = label[i];
+    name[i] = (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : c;
+  }
+
+  uint8_t sector[FAT_SECTOR];
+  memset(sector, 0, sizeof(sector));
+  sector[0] = 0xEB; sector[1] = 0x3C; sector[2] = 0x90;
+  memcpy(sector + 3, "MSWIN4.1", 8);
+  put16(sector + 11, FAT_SECTOR);
+  sector[13] = (uint8_t)spc;
+  put16(sector + 14, FAT_RESERVED);
+  sector[16] = FAT_COPIES;
+  put16(sector + 17, FAT_ROOT_ENTRIES);
+  if (total < 0x10000) {
+    put16(sector + 19, (uint16_t)total);
+  } else {
+    put32(sector + 32, (uint32_t)total);
+  }
+  sector[21] = FAT_MEDIA;
+  put16(sector + 22, (uint16_t)fat_sectors);
+  put16(sector + 24, 32); /* sectors per track */
+  put16(sector + 26, 64); /* heads */
+  sector[36] = 0x80;      /* drive number */
+  sector[38] = 0x29;      /* extended boot signature */
+  put32(sector + 39, (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16));
+  memcpy(sector + 43, name, sizeof(name));
+  memcpy(sector + 54, "FAT16   ", 8);
+  sector[510] = 0x55;
+  sector[511] = 0xAA;
+  if (pwrite_all(fd, sector, sizeof(sector), 0) == -1) return -1;
+
+  /* cluster 0 carries the media byte, cluster 1 the clean shutdown bits */
+  static const uint8_t fat_head[4] = { FAT_MEDIA, 0xFF, 0xFF, 0xFF };
+  for (uint32_t i = 0; i < FAT_COPIES; i++) {
+    off_t off = (off_t)(FAT_RESERVED + i * fat_sectors) * FAT_SECTOR;
+    if (pwrite_all(fd, fat_head, sizeof(fat_head), off) == -1) return -1;
+  }
+
+  uint8_t entry[32];
+  memset(entry, 0, sizeof(entry));
+  memcpy(entry, name, sizeof(name));
+  entry[11] = 0x08; /* volume label */
+  off_t root = (off_t)(FAT_RESERVED + FAT_COPIES * fat_sectors) * FAT_SECTOR;
+  return pwrite_all(fd, entry, sizeof(entry), root);
+}
+
+static mrb_value
+gadget_make_fat_image(mrb_state *mrb, mrb_value self)
+{
+  const char *path;
+  mrb_int size;
+  const char *label = NULL;
+  mrb_get_args(mrb, "zi|z!", &path, &size, &label);
+  if (size <= 0 || size % FAT_SECTOR) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "image size must be a positive multiple of 512");
+  }
+
+  mrb_value tmp = mrb_format(mrb, "%s.tmp", path);
+  const char *tmp_path = RSTRING_CSTR(mrb, tmp);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    mrb_sys_fail(mrb, tmp_path);
+  }
+  if (ftruncate(fd, (off_t)size) == -1 ||
+      tnk_fat16_format(fd, (uint64_t)size, label) == -1 ||
+      fsync(fd) == -1) {
+    int err = errno;
+    close(fd);
+    unlink(tmp_path);
+    errno = err;
+    mrb_sys_fail(mrb, tmp_path);
+  }
+  close(fd);
+  if (rename(tmp_path, path) == -1) {
+    int err = errno;
+    unlink(tmp_path);
+    errno = err;
+    mrb_sys_fail(mrb, path);
+  }
+
+  return self;
+}
+
+/* ---- kernel modules ---- */
+
+/* Loads one module file; 0 if it is loaded now or was already. */
+static int
+finit_module_path(const char *path, const char *params)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+
+  size_t len = strlen(path);
+  int flags = (len < 3 || strcmp(path + len - 3, ".ko") != 0) ? MODULE_INIT_COMPRESSED_FILE : 0;
+  long ret = syscall(SYS_finit_module, fd, params, flags);
+  int err = errno;
+  close(fd);
+  if (ret == -1 && err != EEXIST) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Tnk::Gadget::ModuleLoader runs finit_module(2) for a module and its
+ * dependencies on a thread of its own, so the gadget can be assembled in
+ * configfs while a slow controller driver probes.
+ */
+struct module_loader {
+  pthread_t thread;
+  bool running;
+  char *unload;   /* removed first, errors ignored like `modprobe -r` would be */
+  char *params;   /* for the last path, the module itself */
+  char **paths;   /* dependencies first */
+  size_t npaths;
+  int err;
+  size_t failed;
+};
+
+static void *
+module_loader_run(void *arg)
+{
+  struct module_loader *ml = (struct module_loader *)arg;
+
+  if (ml->unload) {
+    syscall(SYS_delete_module, ml->unload, O_NONBLOCK);
+  }
+  for (size_t i = 0; i < ml->npaths; i++) {
+    if (finit_module_path(ml->paths[i], i + 1 == ml->npaths ? ml->params : "") == -1) {
+      ml->err = errno;
+      ml->failed = i;
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void
+module_loader_join(struct module_loader *ml)
+{
+  if (ml->running) {
+    pthread_join(ml->thread, NULL);
+    ml->running = false;
+  }
+}
+
+static void
+module_loader_free(mrb_state *mrb, void *p)
+{
+  struct module_loader *ml = (struct module_loader *)p;
+  if (!ml) return;
+  module_loader_join(ml);
+  for (size_t i = 0; i < ml->npaths; i++) {
+    mrb_free(mrb, ml->paths[i]);
+  }
+  mrb_free(mrb, ml->paths);
+  mrb_free(mrb, ml->unload);
+  mrb_free(mrb, ml->params);
+  mrb_free(mrb, ml);
+}
+
+static const struct mrb_data_type module_loader_type = {
+  "Tnk::Gadget::ModuleLoader", module_loader_free
+};
+
+static char *
+dup_cstr(mrb_state *mrb, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *d = (char *)mrb_malloc(mrb, len);
+  memcpy(d, s, len);
+  return d;
+}
+
+static mrb_value
+module_loader_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *paths;
+  mrb_int npaths;
+  const char *unload = NULL;
+  const char *params = "";
+  mrb_get_args(mrb, "a|z!z", &paths, &npaths, &unload, &params);
+
+  struct module_loader *ml = (struct module_loader *)DATA_PTR(self);
+  if (ml) {
+    module_loader_free(mrb, ml);
+  }
+  mrb_data_init(self, NULL, &module_loader_type);
+  ml = (struct module_loader *)mrb_calloc(mrb, 1, sizeof(*ml));
+  mrb_data_init(self, ml, &module_loader_type);
+
+  ml->paths = (char **)mrb_calloc(mrb, (size_t)npaths ? (size_t)npaths : 1, sizeof(char *));
+  for (mrb_int i = 0; i < npaths; i++) {
+    mrb_value path = paths[i];
+    ml->paths[i] = dup_cstr(mrb, mrb_string_value_cstr(mrb, &path));
+    ml->npaths++;
+  }
+  ml->unload = unload ? dup_cstr(mrb, unload) : NULL;
+  ml->params = dup_cstr(mrb, params);
+
+  int err = pthread_create(&ml->thread, NULL, module_loader_run, ml);
+  if (err) {
+    errno = err;
+    mrb_sys_fail(mrb, "pthread_create");
+  }
+  ml->running = true;
+
+  return self;
+}
+
+static mrb_value
+module_loader_wait(mrb_state *mrb, mrb_value self)
+{
+  struct module_loader *ml = (struct module_loader *)mrb_data_get_ptr(mrb, self, &module_loader_type);
+  module_loader_join(ml);
+  if (ml->err) {
+    errno = ml->err;
+    mrb_sys_fail(mrb, ml->paths[ml->failed]);
+  }
+  return self;
+}
+
+/* ---- rtnetlink ---- */
+
+static int
+rtnl_talk(struct nlmsghdr *req)
+{
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1) return -1;
+
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+  req->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+  req->nlmsg_seq = 1;
+  if (sendto(fd, req, req->nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  union {
+    char buf[4096];
+    struct nlmsghdr align;
+  } u;
+  int ret = -1;
+  errno = EPROTO;
+  ssize_t n;
+  while ((n = recv(fd, u.buf, sizeof(u.buf), 0)) == -1 && errno == EINTR);
+  if (n > 0) {
+    for (struct nlmsghdr *nh = &u.align; NLMSG_OK(nh, (size_t)n); nh = NLMSG_NEXT(nh, n)) {
+      if (nh->nlmsg_seq != req->nlmsg_seq || nh->nlmsg_type != NLMSG_ERROR) continue;
+      const struct nlmsgerr *e = (const struct nlmsgerr *)NLMSG_DATA(nh);
+      if (e->error == 0) {
+        ret = 0;
+      } else {
+        errno = -e->error;
+      }
+      break;
+    }
+  }
+  int err = errno;
+  close(fd);
+  errno = err;
+  return ret;
+}
+
+static int
+link_index(mrb_state *mrb, const char *ifname)
+{
+  unsigned idx = if_nametoindex(ifname);
+  if (idx == 0) {
+    mrb_sys_fail(mrb, ifname);
+  }
+  return (int)idx;
+}
+
+static mrb_value
+gadget_link_up(mrb_state *mrb, mrb_value self)
+{
+  const char *ifname;
+  mrb_get_args(mrb, "z", &ifname);
+
+  struct {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifi;
+  } req;
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+  req.nh.nlmsg_type = RTM_NEWLINK;
+  req.ifi.ifi_family = AF_UNSPEC;
+  req.ifi.ifi_index = link_index(mrb, ifname);
+  req.ifi.ifi_flags = IFF_UP;
+  req.ifi.ifi_change = IFF_UP;
+
+  if (rtnl_talk(&req.nh) == -1) {
+    mrb_sys_fail(mrb, "RTM_NEWLINK");
+  }
+  return self;
+}
+
+/* Tnk::Gadget.add_address(ifname, address, prefixlen) -> false if already set */
+static mrb_value
+gadget_add_address(mrb_state *mrb, mrb_value self)
+{
+  const char *ifname, *address;
+  mrb_int prefixlen;
+  mrb_get_args(mrb, "zzi", &ifname, &address, &prefixlen);
+
+  struct {
+    struct nlmsghdr nh;
+    struct ifaddrmsg ifa;
+    char attrs[2 * RTA_SPACE(16)];
+  } req;
+  memset(&req, 0, sizeof(req));
+
+  unsigned char addr[16];
+  size_t addr_len;
+  if (inet_pton(AF_INET6, address, addr) == 1) {
+    req.ifa.ifa_family = AF_INET6;
+    addr_len = 16;
+  } else if (inet_pton(AF_INET, address, addr) == 1) {
+    req.ifa.ifa_family = AF_INET;
+    addr_len = 4;
+  } else {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid address: %s", address);
+  }
+  if (prefixlen < 0 || (size_t)prefixlen > addr_len * 8) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid prefix length");
+  }
+
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+  req.nh.nlmsg_type = RTM_NEWADDR;
+  req.nh.nlmsg_flags = NLM_F_CREATE | NLM_F_EXCL;
+  req.ifa.ifa_prefixlen = (unsigned char)prefixlen;
+  req.ifa.ifa_index = (unsigned)link_index(mrb, ifname);
+
+  static const unsigned short types[2] = { IFA_LOCAL, IFA_ADDRESS };
+  for (int i = 0; i < 2; i++) {
+    struct rtattr *rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    rta->rta_type = types[i];
+    rta->rta_len = (unsigned short)RTA_LENGTH(addr_len);
+    memcpy(RTA_DATA(rta), addr, addr_len);
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+  }
+
+  if (rtnl_talk(&req.nh) == -1) {
+    if (errno == EEXIST) return mrb_false_value();
+    mrb_sys_fail(mrb, "RTM_NEWADDR");
+  }
+  return mrb_true_value();
+}
+
+/* ---- UDC / clocks ---- */
+
+static void
+sleep_ms(long ms)
+{
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static double
+boottime_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/* Tnk::Gadget.configured_udc -> UDC named by $TNK_UDC, e.g. dummy_udc.0, or nil */
+static mrb_value
+gadget_configured_udc(mrb_state *mrb, mrb_value self)
+{
+  const char *udc = getenv("TNK_UDC");
+  return (udc && *udc) ? mrb_str_new_cstr(mrb, udc) : mrb_nil_value();
+}
+
+/* Tnk::Gadget.composite? -> whether $TNK_COMPOSITE=1 asks for all hidraw
+ * devices in one HID function */
+static mrb_value
+gadget_composite_p(mrb_state *mrb, mrb_value self)
+{
+  const char *composite = getenv("TNK_COMPOSITE");
+  return mrb_bool_value(composite && strcmp(composite, "1") == 0);
+}
+
+/* Tnk::Gadget.wait_udc(timeout_ms) -> name of the first UDC, or of the
+ * configured one, or nil */
+static mrb_value
+gadget_wait_udc(mrb_state *mrb, mrb_value self)
+{
+  mrb_int timeout_ms = 0;
+  mrb_get_args(mrb, "|i", &timeout_ms);
+
+  const char *configured = getenv("TNK_UDC");
+  if (configured && (!*configured || strchr(configured, '/'))) {
+    configured = NULL;
+  }
+
+  for (mrb_int waited = 0;; waited += 5) {
+    if (configured) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "/sys/class/udc/%s", configured);
+      if (access(path, F_OK) == 0) {
+        return mrb_str_new_cstr(mrb, configured);
+      }
+      if (waited >= timeout_ms) break;
+      sleep_ms(5);
+      continue;
+    }
+
+    DIR *d = opendir("/sys/class/udc");
+    if (d) {
+      struct dirent *e;
+      while ((e = readdir(d))) {
+        if (e->d_name[0] == '.') continue;
+        mrb_value name = mrb_str_new_cstr(mrb, e->d_name);
+        closedir(d);
+        return name;
+      }
+      closedir(d);
+    }
+    if (waited >= timeout_ms) break;
+    sleep_ms(5);
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value
+gadget_boottime_ms(mrb_state *mrb, mrb_value self)
+{
+  return mrb_float_value(mrb, boottime_ms());
+}
+
+/* when this process was started, on the same clock as boottime_ms */
+static mrb_value
+gadget_process_start_ms(mrb_state *mrb, mrb_value self)
+{
+  char buf[1024];
+  int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) mrb_sys_fail(mrb, "/proc/self/stat");
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) mrb_sys_fail(mrb, "/proc/self/stat");
+  buf[n] = '\0';
+
+  /* starttime is field 22, counting from the state right after the comm */
+  char *p = strrchr(buf, ')');
+  unsigned long long start = 0;
+  for (int field = 2; p && field < 22; field++) {
+    p = strchr(p + 1, ' ');
+  }
+  if (!p || sscanf(p + 1, "%llu", &start) != 1) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot parse /proc/self/stat");
+  }
+  return mrb_float_value(mrb, (double)start * 1e3 / (double)sysconf(_SC_CLK_TCK));
+}
+
+void
+tnk_gadget_init(mrb_state *mrb, struct RClass *tnk)
+{
+  struct RClass *gadget = mrb_define_module_under_id(mrb, tnk, MRB_SYM(Gadget));
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM(make_fat_image), gadget_make_fat_image, MRB_ARGS_ARG(2, 1));
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM(link_up), gadget_link_up, MRB_ARGS_REQ(1));
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM(add_address), gadget_add_address, MRB_ARGS_REQ(3));
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM(configured_udc), gadget_configured_udc, MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM_Q(composite), gadget_composite_p, MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM(wait_udc), gadget_wait_udc, MRB_ARGS_OPT(1));
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM(boottime_ms), gadget_boottime_ms, MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, gadget, MRB_SYM(process_start_ms), gadget_process_start_ms, MRB_ARGS_NONE());
+
+  struct RClass *loader = mrb_define_class_under_id(mrb, gadget, MRB_SYM(ModuleLoader), mrb->object_class);
+  MRB_SET_INSTANCE_TT(loader, MRB_TT_DATA);
+  mrb_define_method_id(mrb, loader, MRB_SYM(initialize), module_loader_initialize, MRB_ARGS_ARG(1, 2));
+  mrb_define_method_id(mrb, loader, MRB_SYM(wait), module_loader_wait, MRB_ARGS_NONE());
+}
@@ -0,0 +1,506 @@
+#include <string.h>
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/data.h>
+#include <mruby/hash.h>
+#include <mruby/presym.h>
+#include <mruby/string.h>
+#include <tnk/hid_descriptor.h>
+
+#define HID_ITEM_MAIN   0
+#define HID_ITEM_GLOBAL 1
+#define HID_ITEM_LOCAL  2
+
+#define HID_MAIN_INPUT          0x8
+#define HID_MAIN_OUTPUT         0x9
+#define HID_MAIN_COLLECTION     0xA
+#define HID_MAIN_FEATURE        0xB
+#define HID_MAIN_END_COLLECTION 0xC
+
+#define HID_GLOBAL_USAGE_PAGE   0x0
+#define HID_GLOBAL_LOGICAL_MIN  0x1
+#define HID_GLOBAL_LOGICAL_MAX  0x2
+#define HID_GLOBAL_REPORT_SIZE  0x7
+#define HID_GLOBAL_REPORT_ID    0x8
+#define HID_GLOBAL_REPORT_COUNT 0x9
+#define HID_GLOBAL_PUSH         0xA
+#define HID_GLOBAL_POP          0xB
+
+#define HID_LOCAL_USAGE     0x0
+#define HID_LOCAL_USAGE_MIN 0x1
+#define HID_LOCAL_USAGE_MAX 0x2
+
+#define HID_COLLECTION_APPLICATION 0x01
+
+#define HID_GLOBAL_STACK 4
+#define HID_COLLECTION_STACK 16
+
+struct hid_globals {
+  uint16_t usage_page;
+  int32_t logical_min;
+  int32_t logical_max;
+  uint32_t logical_max_raw;
+  uint32_t report_size;
+  uint32_t report_count;
+  uint8_t report_id;
+};
+
+struct hid_locals {
+  uint32_t usage_min;
+  uint32_t usage_max;
+  bool usage_min_extended;
+  bool usage_max_extended;
+  bool has_range;
+  uint16_t first_usage;   /* index into layout->usages */
+  uint16_t nusages;
+};
+
+static int32_t
+hid_sign_extend(uint32_t value, uint8_t size)
+{
+  switch (size) {
+    case 1: return (int8_t)value;
+    case 2: return (int16_t)value;
+    default: return (int32_t)value;
+  }
+}
+
+static struct tnk_hid_report *
+hid_report_get(struct tnk_hid_layout *layout, uint8_t id)
+{
+  uint8_t idx = layout->report_index[id];
+  if (idx != 0xFF) return &layout->reports[idx];
+  if (layout->nreports >= TNK_HID_MAX_REPORTS) return NULL;
+
+  idx = (uint8_t)layout->nreports++;
+  layout->report_index[id] = idx;
+  struct tnk_hid_report *report = &layout->reports[idx];
+  memset(report, 0, sizeof(*report));
+  report->id = id;
+  return report;
+}
+
+static uint32_t
+hid_complete_usage(uint32_t usage, bool extended, uint16_t page)
+{
+  return extended ? usage : TNK_HID_USAGE(page, usage);
+}
+
+static const char *
+hid_add_main(struct tnk_hid_layout *layout, const struct hid_globals *g, struct hid_locals *l,
+             enum tnk_hid_report_type type, uint32_t data, uint32_t application, bool *keep_usages)
+{
+  struct tnk_hid_report *report = hid_report_get(layout, g->report_id);
+  if (!report) return "too many reports";
+
+  /* straight from the descriptor, the product may not fit 32 bits */
+  uint64_t bits = (uint64_t)g->report_size * g->report_count;
+  uint32_t offset = report->bits[type];
+  if (offset + bits > 0xFFFF) return "report too long";
+  report->bits[type] = (uint16_t)(offset + bits);
+
+  if ((data & TNK_HID_FIELD_CONSTANT) || bits == 0) {
+    return NULL;
+  }
+  if (g->report_size > 32) return "report size too large";
+  if (g->report_count > 0xFFFF) return "report count too large";
+  if (layout->nfields >= TNK_HID_MAX_FIELDS) return "too many fields";
+
+  struct tnk_hid_field *field = &layout->fields[layout->nfields++];
+  memset(field, 0, sizeof(*field));
+  field->bit_offset = (uint16_t)offset;
+  field->bit_size = (uint8_t)g->report_size;
+  field->report_id = g->report_id;
+  field->count = (uint16_t)g->report_count;
+  field->type = (uint8_t)type;
+  field->flags = (uint8_t)(data & (TNK_HID_FIELD_CONSTANT | TNK_HID_FIELD_VARIABLE | TNK_HID_FIELD_RELATIVE));
+  field->application = application;
+  field->logical_min = g->logical_min;
+  /* an unsigned logical range may use the sign bit of the maximum */
+  field->logical_max = g->logical_min >= 0 ? (int32_t)g->logical_max_raw : g->logical_max;
+
+  for (uint16_t i = 0; i < l->nusages; i++) {
+    uint32_t *u = &layout->usages[l->first_usage + i];
+    if (!(*u >> 16)) *u = TNK_HID_USAGE(g->usage_page, *u);
+  }
+  if (l->has_range) {
+    field->usage_min = hid_complete_usage(l->usage_min, l->usage_min_extended, g->usage_page);
+    field->usage_max = hid_complete_usage(l->usage_max, l->usage_max_extended, g->usage_page);
+  } else if (l->nusages) {
+    field->usage_index = l->first_usage;
+    field->usage_count = l->nusages;
+    *keep_usages = true;
+  }
+
+  return NULL;
+}
+
+/* Fields of one report end up next to each other, in descriptor order. */
+static void
+hid_group_fields(struct tnk_hid_layout *layout)
+{
+  for (uint16_t i = 1; i < layout->nfields; i++) {
+    struct tnk_hid_field tmp = layout->fields[i];
+    uint8_t rank = layout->report_index[tmp.report_id];
+    uint16_t j = i;
+    while (j > 0 && layout->report_index[layout->fields[j - 1].report_id] > rank) {
+      layout->fields[j] = layout->fields[j - 1];
+      j--;
+    }
+    layout->fields[j] = tmp;
+  }
+  for (uint16_t i = 0; i < layout->nfields; i++) {
+    struct tnk_hid_report *report = &layout->reports[layout->report_index[layout->fields[i].report_id]];
+    if (report->nfields == 0) report->first_field = i;
+    report->nfields++;
+  }
+}
+
+const char *
+tnk_hid_compile(const uint8_t *desc, size_t len, struct tnk_hid_layout *layout)
+{
+  static const uint8_t item_sizes[4] = { 0, 1, 2, 4 };
+  struct hid_globals stack[HID_GLOBAL_STACK];
+  uint32_t applications[HID_COLLECTION_STACK];
+  int depth = 0;
+  int collections = 0;
+  uint32_t application = 0;
+  struct hid_globals g;
+  struct hid_locals l;
+  const char *err;
+
+  memset(layout, 0, sizeof(*layout));
+  memset(layout->report_index, 0xFF, sizeof(layout->report_index));
+  memset(&g, 0, sizeof(g));
+  memset(&l, 0, sizeof(l));
+
+  size_t i = 0;
+  while (i < len) {
+    uint8_t b = desc[i++];
+
+    if (b == 0xFE) {
+      if (i + 2 > len) return "malformed long item";
+      if (i + 2 + (size_t)desc[i] > len) return "truncated item";
+      i += 2 + (size_t)desc[i];
+      continue;
+    }
+
+    uint8_t size = item_sizes[b & 0x03];
+    uint8_t type = (b >> 2) & 0x03;
+    uint8_t tag = (b >> 4) & 0x0F;
+    if (i + size > len) return "truncated item";
+
+    uint32_t value = 0;
+    for (uint8_t j = 0; j < size; j++) {
+      value |= (uint32_t)desc[i + j] << (8 * j);
+    }
+    i += size;
+
+    switch (type) {
+      case HID_ITEM_MAIN: {
+        bool keep_usages = false;
+        switch (tag) {
+          case HID_MAIN_INPUT:
+            err = hid_add_main(layout, &g, &l, TNK_HID_INPUT, value, application, &keep_usages);
+            break;
+          case HID_MAIN_OUTPUT:
+            err = hid_add_main(layout, &g, &l, TNK_HID_OUTPUT, value, application, &keep_usages);
+            break;
+          case HID_MAIN_FEATURE:
+            err = hid_add_main(layout, &g, &l, TNK_HID_FEATURE, value, application, &keep_usages);
+            break;
+          case HID_MAIN_COLLECTION:
+            if (collections >= HID_COLLECTION_STACK) return "collections nested too deep";
+            applications[collections++] = application;
+            if ((value & 0xFF) == HID_COLLECTION_APPLICATION && l.nusages) {
+              uint32_t usage = layout->usages[l.first_usage];
+              application = (usage >> 16) ? usage : TNK_HID_USAGE(g.usage_page, usage);
+            }
+            err = NULL;
+            break;
+          case HID_MAIN_END_COLLECTION:
+            if (collections == 0) return "unbalanced end collection";
+            application = applications[--collections];
+            err = NULL;
+            break;
+          default:
+            err = NULL;
+            break;
+        }
+        if (err) return err;
+        /* local items only live until the next main item, usages that
+         * didn't end up in a field are dropped again */
+        if (!keep_usages) layout->nusages = l.first_usage;
+        memset(&l, 0, sizeof(l));
+        l.first_usage = layout->nusages;
+      } break;
+
+      case HID_ITEM_GLOBAL:
+        switch (tag) {
+          case HID_GLOBAL_USAGE_PAGE:   g.usage_page = (uint16_t)value; break;
+          case HID_GLOBAL_LOGICAL_MIN:  g.logical_min = hid_sign_extend(value, size); break;
+          case HID_GLOBAL_LOGICAL_MAX:
+            g.logical_max = hid_sign_extend(value, size);
+            g.logical_max_raw = value;
+            break;
+          case HID_GLOBAL_REPORT_SIZE:  g.report_size = value; break;
+          case HID_GLOBAL_REPORT_COUNT: g.report_count = value; break;
+          case HID_GLOBAL_REPORT_ID:
+            if (value == 0 || value > 0xFF) return "invalid report id";
+            g.report_id = (uint8_t)value;
+            layout->has_report_ids = true;
+            break;
+          case HID_GLOBAL_PUSH:
+            if (depth >= HID_GLOBAL_STACK) return "global stack overflow";
+            stack[depth++] = g;
+            break;
+          case HID_GLOBAL_POP:
+            if (depth == 0) return "global stack underflow";
+            g = stack[--depth];
+            break;
+        }
+        break;
+
+      case HID_ITEM_LOCAL:
+        switch (tag) {
+          case HID_LOCAL_USAGE:
+            if (layout->nusages >= TNK_HID_MAX_USAGES) return "too many usages";
+            /* extended usages carry their page, short ones get the page that
+             * is current when the main item is reached */
+            layout->usages[layout->nusages++] = size == 4 ? value : (value & 0xFFFF);
+            l.nusages++;
+            break;
+          case HID_LOCAL_USAGE_MIN:
+            l.usage_min = size == 4 ? value : (value & 0xFFFF);
+            l.usage_min_extended = size == 4;
+            l.has_range = true;
+            break;
+          case HID_LOCAL_USAGE_MAX:
+            l.usage_max = size == 4 ? value : (value & 0xFFFF);
+            l.usage_max_extended = size == 4;
+            l.has_range = true;
+            break;
+        }
+        break;
+    }
+  }
+
+  /* the usages still pending after the last main item belong to no field */
+  layout->nusages = l.first_usage;
+
+  if (layout->nreports == 0) {
+    hid_report_get(layout, 0);
+  }
+  hid_group_fields(layout);
+  return NULL;
+}
+
+static void
+tnk_hid_layout_free(mrb_state *mrb, void *p)
+{
+  mrb_free(mrb, p);
+}
+
+const struct mrb_data_type tnk_hid_layout_type = {
+  "Tnk::Hidraw::Layout", tnk_hid_layout_free
+};
+
+static struct tnk_hid_layout *
+layout_get(mrb_state *mrb, mrb_value self)
+{
+  return (struct tnk_hid_layout *)mrb_data_get_ptr(mrb, self, &tnk_hid_layout_type);
+}
+
+static mrb_value
+layout_initialize(mrb_state *mrb, mrb_value self)
+{
+  const char *desc;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &desc, &len);
+
+  struct tnk_hid_layout *layout = (struct tnk_hid_layout *)DATA_PTR(self);
+  if (layout) {
+    mrb_free(mrb, layout);
+  }
+  mrb_data_init(self, NULL, &tnk_hid_layout_type);
+  layout = (struct tnk_hid_layout *)mrb_malloc(mrb, sizeof(*layout));
+  mrb_data_init(self, layout, &tnk_hid_layout_type);
+
+  const char *err = tnk_hid_compile((const uint8_t *)desc, (size_t)len, layout);
+  if (err) {
+    struct RClass *tnk = mrb_class_get_id(mrb, MRB_SYM(Tnk));
+    mrb_raise(mrb, mrb_class_get_under_id(mrb, tnk, MRB_SYM(ReportDescriptorError)), err);
+  }
+
+  return self;
+}
+
+static mrb_value
+layout_report_ids_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(layout_get(mrb, self)->has_report_ids);
+}
+
+static mrb_value
+layout_report_ids(mrb_state *mrb, mrb_value self)
+{
+  struct tnk_hid_layout *layout = layout_get(mrb, self);
+  mrb_value ids = mrb_ary_new_capa(mrb, layout->nreports);
+  for (uint16_t i = 0; i < layout->nreports; i++) {
+    mrb_ary_push(mrb, ids, mrb_fixnum_value(layout->reports[i].id));
+  }
+  return ids;
+}
+
+static mrb_value
+layout_length(mrb_state *mrb, mrb_value self, enum tnk_hid_report_type type)
+{
+  struct tnk_hid_layout *layout = layout_get(mrb, self);
+  mrb_value id = mrb_nil_value();
+  mrb_get_args(mrb, "|o", &id);
+
+  if (!mrb_nil_p(id)) {
+    mrb_int rid = mrb_as_int(mrb, id);
+    if (rid < 0 || rid > 0xFF) return mrb_fixnum_value(0);
+    return mrb_fixnum_value((mrb_int)tnk_hid_report_len(layout, tnk_hid_report_by_id(layout, (uint8_t)rid), type));
+  }
+
+  size_t max = 0;
+  for (uint16_t i = 0; i < layout->nreports; i++) {
+    size_t len = tnk_hid_report_len(layout, &layout->reports[i], type);
+    if (len > max) max = len;
+  }
+  return mrb_fixnum_value((mrb_int)max);
+}
+
+static mrb_value
+layout_input_length(mrb_state *mrb, mrb_value self)
+{
+  return layout_length(mrb, self, TNK_HID_INPUT);
+}
+
+static mrb_value
+layout_output_length(mrb_state *mrb, mrb_value self)
+{
+  return layout_length(mrb, self, TNK_HID_OUTPUT);
+}
+
+static mrb_value
+layout_feature_length(mrb_state *mrb, mrb_value self)
+{
+  return layout_length(mrb, self, TNK_HID_FEATURE);
+}
+
+static mrb_value
+layout_fields(mrb_state *mrb, mrb_value self)
+{
+  static const mrb_sym types[TNK_HID_REPORT_TYPES] = {
+    MRB_SYM(input), MRB_SYM(output), MRB_SYM(feature)
+  };
+  struct tnk_hid_layout *layout = layout_get(mrb, self);
+  mrb_value fields = mrb_ary_new_capa(mrb, layout->nfields);
+  int ai = mrb_gc_arena_save(mrb);
+
+  for (uint16_t i = 0; i < layout->nfields; i++) {
+    const struct tnk_hid_field *f = &layout->fields[i];
+    mrb_value h = mrb_hash_new_capa(mrb, 12);
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(report_id)), mrb_fixnum_value(f->report_id));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(type)), mrb_symbol_value(types[f->type]));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(offset)), mrb_fixnum_value(f->bit_offset));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(size)), mrb_fixnum_value(f->bit_size));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(count)), mrb_fixnum_value(f->count));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(flags)), mrb_fixnum_value(f->flags));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(application)), mrb_fixnum_value(f->application));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(logical_min)), mrb_fixnum_value(f->logical_min));
+    mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(logical_max)), mrb_fixnum_value(f->logical_max));
+    if (f->usage_count) {
+      mrb_value usages = mrb_ary_new_capa(mrb, f->usage_count);
+      for (uint16_t u = 0; u < f->usage_count; u++) {
+        mrb_ary_push(mrb, usages, mrb_fixnum_value(layout->usages[f->usage_index + u]));
+      }
+      mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(usages)), usages);
+    } else {
+      mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(usage_min)), mrb_fixnum_value(f->usage_min));
+      mrb_hash_set(mrb, h, mrb_symbol_value(MRB_SYM(usage_max)), mrb_fixnum_value(f->usage_max));
+    }
+    mrb_ary_push(mrb, fields, h);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return fields;
+}
+
+/* Tnk::Hidraw.remap_report_ids(desc, id_map) -> desc as part of a composite
+ * descriptor: every Report ID item becomes the one id_map holds for it, a
+ * descriptor without report IDs gets a Report ID item of id_map[0] up front.
+ * Push/Pop around it keep its globals from leaking into the next part. */
+static mrb_value
+hidraw_remap_report_ids(mrb_state *mrb, mrb_value self)
+{
+  static const uint8_t item_sizes[4] = { 0, 1, 2, 4 };
+  const char *desc, *map;
+  mrb_int len, map_len;
+  mrb_get_args(mrb, "ss", &desc, &len, &map, &map_len);
+  if (map_len != 256) mrb_raise(mrb, E_ARGUMENT_ERROR, "id map must have 256 entries");
+
+  const uint8_t *d = (const uint8_t *)desc;
+  const uint8_t *m = (const uint8_t *)map;
+  struct RClass *tnk = mrb_class_get_id(mrb, MRB_SYM(Tnk));
+  struct RClass *error = mrb_class_get_under_id(mrb, tnk, MRB_SYM(ReportDescriptorError));
+  /* Report ID items never grow, so this is enough for Push, Pop and the
+   * one added up front */
+  mrb_value out = mrb_str_new(mrb, NULL, len + 4);
+  uint8_t *o = (uint8_t *)RSTRING_PTR(out);
+  size_t n = 0;
+
+  o[n++] = (HID_ITEM_GLOBAL << 2) | (HID_GLOBAL_PUSH << 4);
+  if (m[0]) {
+    o[n++] = (HID_ITEM_GLOBAL << 2) | (HID_GLOBAL_REPORT_ID << 4) | 1;
+    o[n++] = m[0];
+  }
+
+  size_t i = 0;
+  while (i < (size_t)len) {
+    uint8_t b = d[i];
+    size_t item_len;
+    if (b == 0xFE) {
+      if (i + 2 > (size_t)len) mrb_raise(mrb, error, "malformed long item");
+      item_len = 3 + (size_t)d[i + 1];
+    } else {
+      item_len = 1 + item_sizes[b & 0x03];
+    }
+    if (i + item_len > (size_t)len) mrb_raise(mrb, error, "truncated item");
+
+    uint8_t type = (b >> 2) & 0x03;
+    uint8_t tag = (b >> 4) & 0x0F;
+    if (b != 0xFE && type == HID_ITEM_GLOBAL && tag == HID_GLOBAL_REPORT_ID && item_len > 1) {
+      uint8_t id = m[d[i + 1]];
+      if (id == 0) mrb_raise(mrb, error, "report id missing from the id map");
+      o[n++] = (HID_ITEM_GLOBAL << 2) | (HID_GLOBAL_REPORT_ID << 4) | 1;
+      o[n++] = id;
+    } else {
+      memcpy(o + n, d + i, item_len);
+      n += item_len;
+    }
+    i += item_len;
+  }
+
+  o[n++] = (HID_ITEM_GLOBAL << 2) | (HID_GLOBAL_POP << 4);
+  return mrb_str_resize(mrb, out, (mrb_int)n);
+}
+
+void
+tnk_hid_descriptor_init(mrb_state *mrb, struct RClass *tnk)
+{
+  struct RClass *hidraw = mrb_define_module_under_id(mrb, tnk, MRB_SYM(Hidraw));
+  struct RClass *layout = mrb_define_class_under_id(mrb, hidraw, MRB_SYM(Layout), mrb->object_class);
+  MRB_SET_INSTANCE_TT(layout, MRB_TT_DATA);
+  mrb_define_method_id(mrb, layout, MRB_SYM(initialize), layout_initialize, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, layout, MRB_SYM_Q(report_ids), layout_report_ids_p, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, layout, MRB_SYM(report_ids), layout_report_ids, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, layout, MRB_SYM(input_length), layout_input_length, MRB_ARGS_OPT(1));
+  mrb_define_method_id(mrb, layout, MRB_SYM(output_length), layout_output_length, MRB_ARGS_OPT(1));
+  mrb_define_method_id(mrb, layout, MRB_SYM(feature_length), layout_feature_length, MRB_ARGS_OPT(1));
+  mrb_define_method_id(mrb, layout, MRB_SYM(fields), layout_fields, MRB_ARGS_NONE());
+  mrb_define_module_function_id(mrb, hidraw, MRB_SYM(remap_report_ids), hidraw_remap_report_ids, MRB_ARGS_REQ(2));
+}
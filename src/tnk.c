@@ -5,6 +5,8 @@
 #include <mruby/error.h>
 #include <mruby/variable.h>
 #include <mruby/presym.h>
+#include <tnk/gadget.h>
+#include <tnk/hid_descriptor.h>
 
 static mrb_value grab(mrb_state *mrb, mrb_value self)
 {
@@ -30,6 +32,33 @@ static mrb_value ungrab(mrb_state *mrb, mrb_value self)
     return self;
 }
 
+#define TNK_BITS_LONGS(n) (((n) + 8 * sizeof(long) - 1) / (8 * sizeof(long)))
+#define TNK_TEST_BIT(bits, n) (((bits)[(n) / (8 * sizeof(long))] >> ((n) % (8 * sizeof(long)))) & 1)
+
+/* :keyboard, :mouse or nil, by what the event device says it can send */
+static mrb_value evdev_kind(mrb_state *mrb, mrb_value self)
+{
+    mrb_value io;
+    mrb_get_args(mrb, "o", &io);
+    int fd = (int) mrb_integer(mrb_type_convert(mrb, io, MRB_TT_INTEGER, MRB_SYM(fileno)));
+    unsigned long keys[TNK_BITS_LONGS(KEY_CNT)] = {0};
+    unsigned long rels[TNK_BITS_LONGS(REL_CNT)] = {0};
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) {
+        mrb_sys_fail(mrb, "ioctl(EVIOCGBIT, EV_KEY)");
+    }
+    if (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(rels)), rels) < 0) {
+        mrb_sys_fail(mrb, "ioctl(EVIOCGBIT, EV_REL)");
+    }
+
+    if (TNK_TEST_BIT(rels, REL_X) && TNK_TEST_BIT(rels, REL_Y) && TNK_TEST_BIT(keys, BTN_LEFT)) {
+        return mrb_symbol_value(MRB_SYM(mouse));
+    }
+    if (TNK_TEST_BIT(keys, KEY_A) && TNK_TEST_BIT(keys, KEY_SPACE)) {
+        return mrb_symbol_value(MRB_SYM(keyboard));
+    }
+    return mrb_nil_value();
+}
+
 void
 mrb_totally_normal_keyboard_gem_init(mrb_state *mrb)
 {
@@ -41,7 +70,10 @@ mrb_totally_normal_keyboard_gem_init(mrb_state *mrb)
     struct RClass *tnk = mrb_define_class_id(mrb, MRB_SYM(Tnk), mrb->object_class);
     mrb_define_module_function_id(mrb, tnk, MRB_SYM(grab), grab, MRB_ARGS_REQ(1));
     mrb_define_module_function_id(mrb, tnk, MRB_SYM(ungrab), ungrab, MRB_ARGS_REQ(1));
+    mrb_define_module_function_id(mrb, tnk, MRB_SYM(evdev_kind), evdev_kind, MRB_ARGS_REQ(1));
     mrb_define_const_id(mrb, tnk, MRB_SYM(PREFIX), mrb_str_new_lit(mrb, TNK_PREFIX));
+    tnk_hid_descriptor_init(mrb, tnk);
+    tnk_gadget_init(mrb, tnk);
 }
 
 void mrb_totally_normal_keyboard_gem_final(mrb_state* mrb)
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <mruby.h>
+#include <mruby/array.h>
+
+/* the arena under its own name, mrbtest keeps mruby's allocator */
+#define mrb_basic_alloc_func arena_test_alloc
+#include "../tools/tnk/arena.c"
+#undef mrb_basic_alloc_func
+
+#define ARENA_TEST_SLOTS 4000
+
+static void *blocks[ARENA_TEST_SLOTS];
+static uint32_t sizes[ARENA_TEST_SLOTS];
+static uint32_t seed = 1;
+
+static uint32_t
+arena_test_rand(void)
+{
+  seed = seed * 1103515245u + 12345u;
+  return seed >> 8;
+}
+
+/* TnkTest.arena_churn(count) -> [corrupted blocks, bytes used, whole arena?]
+ * count random allocations, resizes and frees on a 1 MiB arena, everything
+ * freed again at the end; the arena has to merge back into one block */
+static mrb_value
+arena_churn(mrb_state *mrb, mrb_value self)
+{
+  mrb_int count;
+  mrb_get_args(mrb, "i", &count);
+  if (!arena.base) {
+    setenv("TNK_USER_MEM_MB", "1", 1);
+    if (!tnk_arena_init()) mrb_raise(mrb, E_RUNTIME_ERROR, "arena init failed");
+  }
+
+  /* nothing of mruby may run while entered, it would allocate from the arena */
+  mrb_int corrupted = 0;
+  tnk_arena_enter();
+  for (mrb_int n = 0; n < count; n++) {
+    uint32_t i = arena_test_rand() % ARENA_TEST_SLOTS;
+    uint8_t *p = (uint8_t *)blocks[i];
+    if (!p) {
+      uint32_t len = arena_test_rand() % (arena_test_rand() % 50 == 0 ? 20000 : 300) + 1;
+      if ((p = (uint8_t *)arena_test_alloc(NULL, len))) {
+        memset(p, (int)(i & 0xFF), len);
+        blocks[i] = p;
+        sizes[i] = len;
+      }
+      continue;
+    }
+    for (uint32_t j = 0; j < sizes[i]; j++) {
+      if (p[j] != (uint8_t)i) {
+        corrupted++;
+        break;
+      }
+    }
+    if (arena_test_rand() % 3 == 0) {
+      uint32_t len = arena_test_rand() % 600 + 1;
+      uint8_t *q = (uint8_t *)arena_test_alloc(p, len);
+      if (!q) continue;
+      if (len > sizes[i]) memset(q + sizes[i], (int)(i & 0xFF), len - sizes[i]);
+      blocks[i] = q;
+      sizes[i] = len;
+    } else {
+      arena_test_alloc(p, 0);
+      blocks[i] = NULL;
+    }
+  }
+  for (uint32_t i = 0; i < ARENA_TEST_SLOTS; i++) {
+    if (blocks[i]) arena_test_alloc(blocks[i], 0);
+    blocks[i] = NULL;
+  }
+  struct tnk_arena_stats st;
+  tnk_arena_stats(&st);
+  void *whole = arena_test_alloc(NULL, st.cap - sizeof(struct tnk_arena_block));
+  if (whole) arena_test_alloc(whole, 0);
+  tnk_arena_leave();
+
+  mrb_value ret[3] = {
+    mrb_fixnum_value(corrupted),
+    mrb_fixnum_value((mrb_int)st.used),
+    mrb_bool_value(whole != NULL),
+  };
+  return mrb_ary_new_from_values(mrb, 3, ret);
+}
+
+void
+tnk_test_arena_init(mrb_state *mrb, struct RClass *t)
+{
+  mrb_define_module_function(mrb, t, "arena_churn", arena_churn, MRB_ARGS_REQ(1));
+}
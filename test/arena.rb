@@ -0,0 +1,3 @@
+assert('arena merges back into one block after random churn') do
+  assert_equal [0, 0, true], TnkTest.arena_churn(200_000)
+end
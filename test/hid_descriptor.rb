@@ -0,0 +1,156 @@
+BOOT_KEYBOARD = [
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01,
+  0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+  0x95, 0x01, 0x75, 0x08, 0x81, 0x01,
+  0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+  0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+  0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,
+  0xc0
+].pack("C*")
+
+# keyboard (1), mouse (2) and consumer control (3) behind report IDs
+WITH_REPORT_IDS = [
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x85, 0x01,
+  0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+  0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,
+  0xc0,
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xa1, 0x00,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02,
+  0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06,
+  0xc0, 0xc0,
+  0x05, 0x0c, 0x09, 0x01, 0xa1, 0x01, 0x85, 0x03,
+  0x15, 0x00, 0x26, 0xff, 0x03, 0x19, 0x00, 0x2a, 0xff, 0x03, 0x75, 0x10, 0x95, 0x01, 0x81, 0x00,
+  0xc0
+].pack("C*")
+
+def hid_field(layout, type, index = 0)
+  layout.fields.select { |f| f[:type] == type }[index]
+end
+
+assert('Tnk::Hidraw::Layout boot keyboard') do
+  layout = Tnk::Hidraw::Layout.new(BOOT_KEYBOARD)
+  assert_false layout.report_ids?
+  assert_equal [0], layout.report_ids
+  assert_equal 8, layout.input_length
+  assert_equal 1, layout.output_length
+  assert_equal 0, layout.feature_length
+
+  modifiers = hid_field(layout, :input, 0)
+  assert_equal 0, modifiers[:offset]
+  assert_equal 1, modifiers[:size]
+  assert_equal 8, modifiers[:count]
+  assert_equal 0x02, modifiers[:flags]
+  assert_equal 0x00010006, modifiers[:application]
+  assert_equal 0x000700e0, modifiers[:usage_min]
+  assert_equal 0x000700e7, modifiers[:usage_max]
+
+  # the reserved byte is constant and leaves no field behind
+  keys = hid_field(layout, :input, 1)
+  assert_equal 16, keys[:offset]
+  assert_equal 8, keys[:size]
+  assert_equal 6, keys[:count]
+  assert_equal 0x00, keys[:flags]
+  assert_equal 0x65, keys[:logical_max]
+  assert_equal 0x00070000, keys[:usage_min]
+  assert_equal 0x00070065, keys[:usage_max]
+
+  leds = hid_field(layout, :output)
+  assert_equal 0, leds[:offset]
+  assert_equal 5, leds[:count]
+  assert_equal 0x00080001, leds[:usage_min]
+  assert_equal 0x00080005, leds[:usage_max]
+end
+
+assert('Tnk::Hidraw::Layout NKRO bitmap') do
+  desc = [
+    0x05, 0x01, 0x09, 0x06, 0xa1, 0x01,
+    0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+    0x19, 0x00, 0x29, 0x7f, 0x95, 0x80, 0x81, 0x02,
+    0xc0
+  ].pack("C*")
+  layout = Tnk::Hidraw::Layout.new(desc)
+  assert_equal 17, layout.input_length
+
+  bitmap = hid_field(layout, :input, 1)
+  assert_equal 8, bitmap[:offset]
+  assert_equal 1, bitmap[:size]
+  assert_equal 128, bitmap[:count]
+  assert_equal 0x02, bitmap[:flags]
+  assert_equal 0x00070000, bitmap[:usage_min]
+  assert_equal 0x0007007f, bitmap[:usage_max]
+end
+
+assert('Tnk::Hidraw::Layout report IDs') do
+  layout = Tnk::Hidraw::Layout.new(WITH_REPORT_IDS)
+  assert_true layout.report_ids?
+  assert_equal [1, 2, 3], layout.report_ids
+  # lengths count the ID byte, without an ID the longest report
+  assert_equal 8, layout.input_length
+  assert_equal 8, layout.input_length(1)
+  assert_equal 4, layout.input_length(2)
+  assert_equal 3, layout.input_length(3)
+  assert_equal 0, layout.input_length(9)
+
+  motion = layout.fields.find { |f| f[:report_id] == 2 && f[:usages] }
+  assert_equal [0x00010030, 0x00010031], motion[:usages]
+  assert_equal 8, motion[:offset]
+  assert_equal(-127, motion[:logical_min])
+  assert_equal 127, motion[:logical_max]
+  assert_equal 0x06, motion[:flags]
+  assert_equal 0x00010002, motion[:application]
+
+  consumer = layout.fields.find { |f| f[:report_id] == 3 }
+  assert_equal 0x3ff, consumer[:logical_max]
+  assert_equal 0x000c03ff, consumer[:usage_max]
+end
+
+assert('Tnk::Hidraw::Layout Push and Pop') do
+  desc = [
+    0x05, 0x01, 0x09, 0x02, 0xa1, 0x01,
+    0x75, 0x08, 0x95, 0x02, 0x15, 0x81, 0x25, 0x7f,
+    0xa4,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x03, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+    0xb4,
+    0x09, 0x30, 0x09, 0x31, 0x81, 0x06,
+    0xc0
+  ].pack("C*")
+  layout = Tnk::Hidraw::Layout.new(desc)
+  assert_equal 3, layout.input_length
+
+  motion = hid_field(layout, :input, 1)
+  assert_equal 8, motion[:offset]
+  assert_equal 8, motion[:size]
+  assert_equal 2, motion[:count]
+  assert_equal(-127, motion[:logical_min])
+  assert_equal [0x00010030, 0x00010031], motion[:usages]
+
+  assert_raise(Tnk::ReportDescriptorError) { Tnk::Hidraw::Layout.new([0xb4].pack("C*")) }
+end
+
+assert('Tnk::Hidraw::Layout extended usages') do
+  desc = [
+    0x05, 0x0c, 0x09, 0x01, 0xa1, 0x01,
+    0x0b, 0x30, 0x00, 0x01, 0x00,
+    0x0b, 0xe9, 0x00, 0x0c, 0x00,
+    0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x02, 0x81, 0x02,
+    0x95, 0x06, 0x81, 0x01,
+    0xc0
+  ].pack("C*")
+  layout = Tnk::Hidraw::Layout.new(desc)
+  # an extended usage keeps its own page, not the current one
+  assert_equal [0x00010030, 0x000c00e9], hid_field(layout, :input)[:usages]
+end
+
+assert('Tnk::Hidraw::Layout truncated items') do
+  assert_raise(Tnk::ReportDescriptorError) { Tnk::Hidraw::Layout.new([0x05].pack("C*")) }
+  assert_raise(Tnk::ReportDescriptorError) { Tnk::Hidraw::Layout.new([0x26, 0xff].pack("C*")) }
+  assert_raise(Tnk::ReportDescriptorError) { Tnk::Hidraw::Layout.new([0xfe, 0x05, 0x00, 0x01].pack("C*")) }
+end
+
+assert('Tnk::Hidraw::Layout report size times count past 32 bits') do
+  # Report Size 0x10000, Report Count 0x10000, Input (Data,Var,Abs)
+  desc = [0x77, 0x00, 0x00, 0x01, 0x00, 0x97, 0x00, 0x00, 0x01, 0x00, 0x81, 0x02]
+  assert_raise(Tnk::ReportDescriptorError) { Tnk::Hidraw::Layout.new(desc.pack("C*")) }
+end
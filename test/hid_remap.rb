@@ -0,0 +1,54 @@
+# every test file runs in a VM of its own
+BOOT_KEYBOARD = [
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01,
+  0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+  0x95, 0x01, 0x75, 0x08, 0x81, 0x01,
+  0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+  0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+  0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,
+  0xc0
+].pack("C*")
+
+# keyboard (1), mouse (2) and consumer control (3) behind report IDs
+WITH_REPORT_IDS = [
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x85, 0x01,
+  0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+  0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,
+  0xc0,
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xa1, 0x00,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02,
+  0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06,
+  0xc0, 0xc0,
+  0x05, 0x0c, 0x09, 0x01, 0xa1, 0x01, 0x85, 0x03,
+  0x15, 0x00, 0x26, 0xff, 0x03, 0x19, 0x00, 0x2a, 0xff, 0x03, 0x75, 0x10, 0x95, 0x01, 0x81, 0x00,
+  0xc0
+].pack("C*")
+
+def hid_id_map(pairs)
+  map = "\x00" * 256
+  pairs.each { |from, to| map.setbyte(from, to) }
+  map
+end
+
+assert('Tnk::Hidraw.remap_report_ids') do
+  out = Tnk::Hidraw.remap_report_ids(WITH_REPORT_IDS, hid_id_map(1 => 5, 2 => 6, 3 => 7))
+  assert_equal WITH_REPORT_IDS.bytesize + 2, out.bytesize
+  assert_equal 0xa4, out.getbyte(0)
+  assert_equal 0xb4, out.getbyte(out.bytesize - 1)
+  layout = Tnk::Hidraw::Layout.new(out)
+  assert_equal [5, 6, 7], layout.report_ids
+  assert_equal 4, layout.input_length(6)
+
+  # a device without IDs gets the one in entry 0 up front
+  out = Tnk::Hidraw.remap_report_ids(BOOT_KEYBOARD, hid_id_map(0 => 9))
+  assert_equal [0xa4, 0x85, 0x09], out.bytes[0, 3]
+  layout = Tnk::Hidraw::Layout.new(out)
+  assert_equal [9], layout.report_ids
+  assert_equal 9, layout.input_length
+
+  assert_raise(Tnk::ReportDescriptorError) do
+    Tnk::Hidraw.remap_report_ids(WITH_REPORT_IDS, hid_id_map(1 => 5))
+  end
+  assert_raise(ArgumentError) { Tnk::Hidraw.remap_report_ids(BOOT_KEYBOARD, "\x00") }
+end
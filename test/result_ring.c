@@ -0,0 +1,85 @@
+#include <mruby.h>
+#include <mruby/array.h>
+
+#include "../tools/tnk/result_ring.h"
+
+static struct tnk_result_ring ring;
+
+static void
+ring_reset(uint32_t pos)
+{
+  memset(&ring, 0, sizeof(ring));
+  ring.head = ring.read = ring.tail = pos;
+}
+
+/* TnkTest.result_ring_gap(gap) -> [entry offset, bytes head moved, empty?]
+ * with gap bytes left before the end of the buffer when a report is reserved */
+static mrb_value
+result_ring_gap(mrb_state *mrb, mrb_value self)
+{
+  mrb_int gap;
+  mrb_get_args(mrb, "i", &gap);
+  uint32_t start = TNK_RESULT_RING_SIZE - (uint32_t)gap;
+  ring_reset(start);
+
+  struct tnk_result *r = tnk_result_reserve(&ring, TNK_RESULT_REPORT, 8);
+  if (!r) return mrb_nil_value();
+  memcpy(r->data, "tnk-ring", 8);
+  tnk_result_commit(&ring, r);
+
+  struct tnk_result *n = tnk_result_next(&ring);
+  if (!n || n->type != TNK_RESULT_REPORT || memcmp(n->data, "tnk-ring", 8) != 0) return mrb_nil_value();
+  mrb_value offset = mrb_fixnum_value(tnk_result_offset(&ring, n));
+  tnk_result_release(&ring, n);
+  mrb_value ret[3] = {
+    offset,
+    mrb_fixnum_value(ring.head - start),
+    mrb_bool_value(ring.head == ring.tail && ring.read == ring.tail && !tnk_result_next(&ring)),
+  };
+  return mrb_ary_new_from_values(mrb, 3, ret);
+}
+
+/* TnkTest.result_ring_churn(count) -> entries that came out as they went in,
+ * a mix of sizes that keeps landing on every gap at the end of the buffer */
+static mrb_value
+result_ring_churn(mrb_state *mrb, mrb_value self)
+{
+  static const uint32_t lens[] = { 0, 8, 3, 20, 8, 0, 24 };
+  mrb_int count;
+  mrb_get_args(mrb, "i", &count);
+  ring_reset(0);
+
+  mrb_int ok = 0;
+  struct tnk_result *held = NULL;
+  for (mrb_int i = 0; i < count; i++) {
+    uint32_t len = lens[i % (mrb_int)(sizeof(lens) / sizeof(lens[0]))];
+    struct tnk_result *r = tnk_result_reserve(&ring, len ? TNK_RESULT_REPORT : TNK_RESULT_INTEGER, len);
+    if (!r) break;
+    r->value = (int32_t)i;
+    memset(r->data, (int)(i & 0xFF), len);
+    tnk_result_commit(&ring, r);
+
+    struct tnk_result *n = tnk_result_next(&ring);
+    if (!n || n->value != (int32_t)i || n->len != len) break;
+    if (len && (n->data[0] != (uint8_t)i || n->data[len - 1] != (uint8_t)i)) break;
+    /* one entry at a time stays in use, so head trails read */
+    if (held) tnk_result_release(&ring, held);
+    held = n;
+    ok++;
+  }
+  if (held) tnk_result_release(&ring, held);
+  if (ring.head != ring.tail) return mrb_fixnum_value(-1);
+  return mrb_fixnum_value(ok);
+}
+
+/* test/arena.c */
+void tnk_test_arena_init(mrb_state *mrb, struct RClass *t);
+
+void
+mrb_totally_normal_keyboard_gem_test(mrb_state *mrb)
+{
+  struct RClass *t = mrb_define_module(mrb, "TnkTest");
+  tnk_test_arena_init(mrb, t);
+  mrb_define_module_function(mrb, t, "result_ring_gap", result_ring_gap, MRB_ARGS_REQ(1));
+  mrb_define_module_function(mrb, t, "result_ring_churn", result_ring_churn, MRB_ARGS_REQ(1));
+}
@@ -0,0 +1,12 @@
+assert('result ring wraps over a gap too short for a pad entry') do
+  # 8 bytes are less than an entry header, the report starts over at 0
+  assert_equal [0, 32, true], TnkTest.result_ring_gap(8)
+end
+
+assert('result ring wraps over a pad entry') do
+  assert_equal [0, 40, true], TnkTest.result_ring_gap(16)
+end
+
+assert('result ring keeps entries in order across many wraps') do
+  assert_equal 100_000, TnkTest.result_ring_churn(100_000)
+end
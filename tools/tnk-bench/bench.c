@@ -0,0 +1,918 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "../tnk/capture.h"
+#include "../tnk/stats.h"
+
+/*
+ * Hardware-free benchmark of the whole forwarding path.
+ *
+ * Synthetic HID devices are created through /dev/uhid, tnk is started with
+ * its gadget bound to dummy_hcd (TNK_UDC=dummy_udc.0), so this machine
+ * enumerates the gadget as its own host. Reports go in through uhid and are
+ * read back from the host side hidraw nodes of the gadget:
+ *
+ *   uhid -> hidraw -> tnk -> hidg -> dummy_udc -> dummy_hcd -> hidraw
+ *
+ * Every profile carries an 8 bit sequence number in a constant (padding)
+ * byte of its report, so the reports are no-ops for the host's input stack
+ * and can be matched to their send time.
+ *
+ * Phases: startup (tnk start until every gadget node showed up), latency
+ * (open loop at each profile's rate, all profiles at once) and throughput
+ * (closed loop per profile, a few reports in flight). Results are printed
+ * as "key value" lines, --max-p99-us turns the run into a gate.
+ *
+ * --replay takes a capture of tnk (TNK_CAPTURE, see capture.h) instead of
+ * profiles: a uhid device per captured device, fed the reports that were
+ * read from it, at the recorded pace or, with --max-speed, as fast as the
+ * host takes them. The host side input devices are grabbed, what is typed
+ * in a capture doesn't reach this machine's console or session.
+ */
+
+#define BENCH_MAX_PROFILES 16
+#define BENCH_WINDOW       4
+#define BENCH_GADGET_ID    "00001D6B:00000104"
+#define BENCH_TIMEOUT_NS   (30ULL * 1000000000ULL)
+#define BENCH_DRAIN_NS     (200ULL * 1000000ULL)
+
+struct bench_profile_def {
+  const char *name;
+  uint32_t rate_hz;
+  uint32_t report_len;
+  uint32_t seq_off; /* constant byte holding the sequence number */
+  const uint8_t *desc;
+  uint32_t desc_len;
+};
+
+/* boot keyboard, the reserved byte carries the sequence */
+static const uint8_t desc_keyboard[] = {
+  0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7,
+  0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+  0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+  0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+  0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+  0x81, 0x00, 0xC0,
+};
+
+/* 3 buttons, x, y, wheel and a constant byte */
+static const uint8_t desc_mouse[] = {
+  0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+  0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+  0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30,
+  0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03,
+  0x81, 0x06, 0xC0, 0x75, 0x08, 0x95, 0x01, 0x81, 0x01, 0xC0,
+};
+
+/* modifiers, a constant byte and a 120 key bitmap */
+static const uint8_t desc_nkro[] = {
+  0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7,
+  0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x75, 0x08,
+  0x95, 0x01, 0x81, 0x01, 0x05, 0x07, 0x19, 0x00, 0x29, 0x77, 0x15, 0x00,
+  0x25, 0x01, 0x75, 0x01, 0x95, 0x78, 0x81, 0x02, 0xC0,
+};
+
+static const struct bench_profile_def profile_defs[] = {
+  { "keyboard", 125,  8,  1, desc_keyboard, sizeof(desc_keyboard) },
+  { "mouse",    1000, 5,  4, desc_mouse,    sizeof(desc_mouse) },
+  { "nkro",     1000, 17, 1, desc_nkro,     sizeof(desc_nkro) },
+};
+
+struct bench_dev {
+  const struct bench_profile_def *def;
+  uint32_t rate_hz;
+  int uhid_fd;
+  int host_fd;   /* gadget's hidraw node on the host side */
+  int timer_fd;
+  uint8_t seq;
+  uint8_t expect; /* oldest sequence number still on its way */
+  uint32_t inflight;
+  uint64_t sent_ns[256];
+  uint64_t sent, received, lost;
+  struct tnk_hist latency;
+  double throughput;
+  uint32_t pair, gen;    /* replay: the captured device */
+  uint64_t captured_out; /* replay: what tnk wrote when it was captured */
+};
+
+static struct bench_dev devs[BENCH_MAX_PROFILES];
+static uint32_t ndevs;
+static pid_t tnk_pid = -1;
+
+static void
+die(const char *what)
+{
+  perror(what);
+  if (tnk_pid > 0) kill(tnk_pid, SIGTERM);
+  exit(1);
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-t tnk] [-d seconds] [-p profile[:hz],...] [--udc name]\n"
+          "          [--stats file] [--max-p99-us n]\n"
+          "       %s [-t tnk] [--udc name] [--stats file] --replay capture [--max-speed]\n"
+          "profiles: keyboard (125 Hz), mouse (1000 Hz), nkro (1000 Hz)\n",
+          argv0, argv0);
+  exit(2);
+}
+
+static void
+add_profile(const char *spec)
+{
+  char name[32];
+  uint32_t rate = 0;
+  const char *colon = strchr(spec, ':');
+  size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+  if (len >= sizeof(name) || ndevs == BENCH_MAX_PROFILES) {
+    fprintf(stderr, "bad profile: %s\n", spec);
+    exit(2);
+  }
+  memcpy(name, spec, len);
+  name[len] = '\0';
+  if (colon) rate = (uint32_t)strtoul(colon + 1, NULL, 10);
+
+  for (size_t i = 0; i < sizeof(profile_defs) / sizeof(profile_defs[0]); i++) {
+    if (strcmp(profile_defs[i].name, name) == 0) {
+      struct bench_dev *d = &devs[ndevs++];
+      d->def = &profile_defs[i];
+      d->rate_hz = rate ? rate : profile_defs[i].rate_hz;
+      d->uhid_fd = d->host_fd = d->timer_fd = -1;
+      return;
+    }
+  }
+  fprintf(stderr, "unknown profile: %s\n", name);
+  exit(2);
+}
+
+/* ---- uhid ---- */
+
+static void
+uhid_write(int fd, const struct uhid_event *ev)
+{
+  ssize_t n;
+  do {
+    n = write(fd, ev, sizeof(*ev));
+  } while (n == -1 && errno == EINTR);
+  if (n != (ssize_t)sizeof(*ev)) die("write(uhid)");
+}
+
+static void
+uhid_create(struct bench_dev *d, uint32_t index)
+{
+  d->uhid_fd = open("/dev/uhid", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+  if (d->uhid_fd == -1) die("/dev/uhid");
+
+  struct uhid_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = UHID_CREATE2;
+  snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "tnk-bench %s", d->def->name);
+  snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys), "tnk-bench/%" PRIu32, index);
+  ev.u.create2.rd_size = (uint16_t)d->def->desc_len;
+  ev.u.create2.bus = 0x03; /* BUS_USB */
+  ev.u.create2.vendor = 0x1209;
+  ev.u.create2.product = 0x7000 + index;
+  memcpy(ev.u.create2.rd_data, d->def->desc, d->def->desc_len);
+  uhid_write(d->uhid_fd, &ev);
+}
+
+/* Answers what the kernel asks of a uhid device, nothing is supported. */
+static void
+uhid_service(struct bench_dev *d)
+{
+  struct uhid_event ev, reply;
+  while (read(d->uhid_fd, &ev, sizeof(ev)) > 0) {
+    memset(&reply, 0, sizeof(reply));
+    if (ev.type == UHID_GET_REPORT) {
+      reply.type = UHID_GET_REPORT_REPLY;
+      reply.u.get_report_reply.id = ev.u.get_report.id;
+      reply.u.get_report_reply.err = EIO;
+      uhid_write(d->uhid_fd, &reply);
+    } else if (ev.type == UHID_SET_REPORT) {
+      reply.type = UHID_SET_REPORT_REPLY;
+      reply.u.set_report_reply.id = ev.u.set_report.id;
+      reply.u.set_report_reply.err = EIO;
+      uhid_write(d->uhid_fd, &reply);
+    }
+  }
+}
+
+static void
+uhid_send(struct bench_dev *d, uint64_t now)
+{
+  struct uhid_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = UHID_INPUT2;
+  ev.u.input2.size = (uint16_t)d->def->report_len;
+  ev.u.input2.data[d->def->seq_off] = d->seq;
+  d->sent_ns[d->seq] = now;
+  d->seq++;
+  d->sent++;
+  d->inflight++;
+  uhid_write(d->uhid_fd, &ev);
+}
+
+/* ---- host side ---- */
+
+static bool
+is_gadget_node(const char *name)
+{
+  char path[PATH_MAX], line[256];
+  snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", name);
+  FILE *fp = fopen(path, "r");
+  if (!fp) return false;
+  bool found = false;
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "HID_ID=", 7) == 0) {
+      found = strstr(line, BENCH_GADGET_ID) != NULL;
+      break;
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+static bool
+descriptor_matches(int fd, const struct bench_profile_def *def)
+{
+  int size = 0;
+  struct hidraw_report_descriptor rd;
+  if (ioctl(fd, HIDIOCGRDESCSIZE, &size) == -1 || (uint32_t)size != def->desc_len) return false;
+  rd.size = (uint32_t)size;
+  if (ioctl(fd, HIDIOCGRDESC, &rd) == -1) return false;
+  return memcmp(rd.value, def->desc, def->desc_len) == 0;
+}
+
+/* Claims gadget nodes for devices that don't have one yet, true once all do. */
+static bool
+find_host_nodes(void)
+{
+  DIR *dir = opendir("/sys/class/hidraw");
+  if (!dir) return false;
+  struct dirent *e;
+  while ((e = readdir(dir))) {
+    if (strncmp(e->d_name, "hidraw", 6) != 0 || !is_gadget_node(e->d_name)) continue;
+
+    bool claimed = false;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/%s", e->d_name);
+    for (uint32_t i = 0; i < ndevs; i++) {
+      char own[PATH_MAX];
+      struct stat a, b;
+      snprintf(own, sizeof(own), "/proc/self/fd/%d", devs[i].host_fd);
+      if (devs[i].host_fd >= 0 && stat(own, &a) == 0 && stat(path, &b) == 0 && a.st_rdev == b.st_rdev) {
+        claimed = true;
+      }
+    }
+    if (claimed) continue;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) continue;
+    for (uint32_t i = 0; i < ndevs; i++) {
+      if (devs[i].host_fd < 0 && descriptor_matches(fd, devs[i].def)) {
+        devs[i].host_fd = fd;
+        fd = -1;
+        break;
+      }
+    }
+    if (fd >= 0) close(fd);
+  }
+  closedir(dir);
+
+  for (uint32_t i = 0; i < ndevs; i++) {
+    if (devs[i].host_fd < 0) return false;
+  }
+  return true;
+}
+
+/* Reads whatever reached the host, returns the number of reports. */
+static uint32_t
+host_receive(struct bench_dev *d, uint64_t now)
+{
+  uint8_t buf[64];
+  uint32_t got = 0;
+  ssize_t n;
+  while ((n = read(d->host_fd, buf, sizeof(buf))) > 0) {
+    if ((uint32_t)n != d->def->report_len) continue;
+    uint8_t seq = buf[d->def->seq_off];
+    /* reports arrive in order, whatever we skip over was lost */
+    while (d->inflight && d->expect != seq) {
+      d->expect++;
+      d->inflight--;
+      d->lost++;
+    }
+    if (!d->inflight) continue;
+    tnk_hist_add(&d->latency, now - d->sent_ns[seq]);
+    d->expect++;
+    d->inflight--;
+    d->received++;
+    got++;
+  }
+  return got;
+}
+
+/* ---- phases ---- */
+
+static void
+sleep_ns(uint64_t ns)
+{
+  struct timespec ts = { .tv_sec = (time_t)(ns / 1000000000ULL), .tv_nsec = (long)(ns % 1000000000ULL) };
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static void
+spawn_tnk(const char *tnk, const char *udc, const char *stats)
+{
+  tnk_pid = fork();
+  if (tnk_pid == -1) die("fork");
+  if (tnk_pid == 0) {
+    setenv("TNK_UDC", udc, 1);
+    setenv("TNK_STATS_FILE", stats, 1);
+    execl(tnk, tnk, (char *)NULL);
+    perror(tnk);
+    _exit(127);
+  }
+}
+
+static uint64_t
+phase_startup(void)
+{
+  uint64_t start = tnk_now_ns();
+  for (;;) {
+    for (uint32_t i = 0; i < ndevs; i++) uhid_service(&devs[i]);
+    if (find_host_nodes()) break;
+    int status;
+    if (waitpid(tnk_pid, &status, WNOHANG) == tnk_pid) {
+      fprintf(stderr, "tnk exited during startup\n");
+      exit(1);
+    }
+    if (tnk_now_ns() - start > BENCH_TIMEOUT_NS) {
+      fprintf(stderr, "gadget nodes didn't show up on the host\n");
+      kill(tnk_pid, SIGTERM);
+      exit(1);
+    }
+    sleep_ns(5 * 1000000ULL);
+  }
+  return tnk_now_ns() - start;
+}
+
+static void
+reset_counters(struct bench_dev *d)
+{
+  d->expect = d->seq;
+  d->inflight = 0;
+  d->sent = d->received = d->lost = 0;
+  memset(&d->latency, 0, sizeof(d->latency));
+}
+
+static void
+phase_latency(uint32_t seconds)
+{
+  struct pollfd pfds[BENCH_MAX_PROFILES * 3];
+  uint32_t n = 0;
+
+  for (uint32_t i = 0; i < ndevs; i++) {
+    struct bench_dev *d = &devs[i];
+    reset_counters(d);
+    d->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (d->timer_fd == -1) die("timerfd_create");
+    uint64_t period = 1000000000ULL / d->rate_hz;
+    struct itimerspec its = {
+      .it_interval = { (time_t)(period / 1000000000ULL), (long)(period % 1000000000ULL) },
+      .it_value = { (time_t)(period / 1000000000ULL), (long)(period % 1000000000ULL) },
+    };
+    if (timerfd_settime(d->timer_fd, 0, &its, NULL) == -1) die("timerfd_settime");
+    pfds[n++] = (struct pollfd){ .fd = d->timer_fd, .events = POLLIN };
+    pfds[n++] = (struct pollfd){ .fd = d->host_fd, .events = POLLIN };
+    pfds[n++] = (struct pollfd){ .fd = d->uhid_fd, .events = POLLIN };
+  }
+
+  uint64_t end = tnk_now_ns() + (uint64_t)seconds * 1000000000ULL;
+  uint64_t stop_at = end + BENCH_DRAIN_NS;
+  for (;;) {
+    uint64_t now = tnk_now_ns();
+    if (now >= stop_at) break;
+    if (poll(pfds, n, 10) == -1 && errno != EINTR) die("poll");
+    now = tnk_now_ns();
+    for (uint32_t i = 0; i < ndevs; i++) {
+      struct bench_dev *d = &devs[i];
+      uint64_t ticks;
+      if (read(d->timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks) && now < end) {
+        /* a late timer doesn't make up for missed ticks, the rate is a ceiling */
+        uhid_send(d, now);
+      }
+      host_receive(d, now);
+      uhid_service(d);
+    }
+  }
+
+  for (uint32_t i = 0; i < ndevs; i++) {
+    struct bench_dev *d = &devs[i];
+    d->lost += d->inflight;
+    d->inflight = 0;
+    close(d->timer_fd);
+    d->timer_fd = -1;
+  }
+}
+
+static void
+phase_throughput(struct bench_dev *d, uint32_t seconds)
+{
+  struct pollfd pfds[2] = {
+    { .fd = d->host_fd, .events = POLLIN },
+    { .fd = d->uhid_fd, .events = POLLIN },
+  };
+  struct tnk_hist keep = d->latency;
+  uint64_t sent = d->sent, received = d->received, lost = d->lost;
+
+  reset_counters(d);
+  uint64_t start = tnk_now_ns();
+  uint64_t end = start + (uint64_t)seconds * 1000000000ULL;
+  uint64_t last_progress = start;
+  for (;;) {
+    uint64_t now = tnk_now_ns();
+    if (now >= end) break;
+    while (d->inflight < BENCH_WINDOW) {
+      uhid_send(d, now);
+    }
+    if (poll(pfds, 2, 100) == -1 && errno != EINTR) die("poll");
+    now = tnk_now_ns();
+    if (host_receive(d, now)) {
+      last_progress = now;
+    } else if (now - last_progress > 100 * 1000000ULL) {
+      /* the window got stuck on lost reports, start over */
+      d->lost += d->inflight;
+      d->inflight = 0;
+      d->expect = d->seq;
+      last_progress = now;
+    }
+    uhid_service(d);
+  }
+  d->throughput = (double)d->received / ((double)(tnk_now_ns() - start) / 1e9);
+
+  d->latency = keep;
+  d->sent = sent;
+  d->received = received;
+  d->lost = lost;
+}
+
+/* ---- replay ---- */
+
+static struct tnk_capture_header *capture;
+static struct bench_profile_def replay_defs[BENCH_MAX_PROFILES];
+static char replay_names[BENCH_MAX_PROFILES][16];
+static int grab_fds[64];
+static uint32_t ngrabs;
+
+static struct tnk_capture_header *
+load_capture(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) die(path);
+  size_t len = (size_t)st.st_size;
+  if (len < sizeof(struct tnk_capture_header)) {
+    fprintf(stderr, "%s: not a tnk capture\n", path);
+    exit(1);
+  }
+  /* a copy, a tnk capturing into the same file doesn't pull it away under us */
+  uint8_t *buf = malloc(len);
+  if (!buf) die("malloc");
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, buf + got, len - got);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) die(path);
+    got += (size_t)n;
+  }
+  close(fd);
+
+  struct tnk_capture_header *h = (struct tnk_capture_header *)buf;
+  if (h->magic != TNK_CAPTURE_MAGIC || h->version != TNK_CAPTURE_VERSION ||
+      h->size != len - sizeof(*h) || h->size % TNK_CAPTURE_ALIGN || h->tail - h->head > h->size) {
+    fprintf(stderr, "%s: not a tnk capture\n", path);
+    exit(1);
+  }
+  return h;
+}
+
+/* The record at pos, NULL for padding. */
+static const struct tnk_capture_record *
+capture_record(const struct tnk_capture_header *h, uint64_t pos)
+{
+  const struct tnk_capture_record *r = tnk_capture_at(h, pos);
+  if (r && pos % h->size + tnk_capture_size(r->len) > h->size) {
+    fprintf(stderr, "capture: record at %" PRIu64 " runs past the ring\n", pos);
+    exit(1);
+  }
+  return r && r->type != TNK_CAPTURE_PAD ? r : NULL;
+}
+
+/* The device a record replays on, NULL if it isn't replayed. */
+static struct bench_dev *
+replay_dev(const struct tnk_capture_record *r)
+{
+  for (uint32_t i = 0; i < ndevs; i++) {
+    if (devs[i].pair == r->pair && devs[i].gen == r->gen) return &devs[i];
+  }
+  return NULL;
+}
+
+/* A device for every pair that has reports read from it in the capture. A
+ * pair slot only keeps the descriptor of its latest pair, reports of the
+ * ones before are left out. */
+static void
+add_replay_devices(const struct tnk_capture_header *h)
+{
+  for (uint64_t pos = h->head; pos < h->tail; pos = tnk_capture_next(h, pos)) {
+    const struct tnk_capture_record *r = capture_record(h, pos);
+    if (!r || r->type != TNK_CAPTURE_IN || r->pair >= TNK_CAPTURE_DEVICES || replay_dev(r)) continue;
+    const struct tnk_capture_device *cd = &h->devices[r->pair];
+    if (cd->gen != r->gen || cd->desc_len == 0 || cd->desc_len > TNK_CAPTURE_DESC_MAX) continue;
+    if (ndevs == BENCH_MAX_PROFILES) {
+      fprintf(stderr, "capture: more than %d devices\n", BENCH_MAX_PROFILES);
+      exit(1);
+    }
+
+    uint32_t i = ndevs++;
+    snprintf(replay_names[i], sizeof(replay_names[i]), "pair%u", (unsigned)r->pair);
+    replay_defs[i] = (struct bench_profile_def){
+      .name = replay_names[i],
+      .desc = cd->desc,
+      .desc_len = cd->desc_len,
+    };
+    devs[i].def = &replay_defs[i];
+    devs[i].pair = r->pair;
+    devs[i].gen = r->gen;
+    devs[i].uhid_fd = devs[i].host_fd = devs[i].timer_fd = -1;
+  }
+
+  for (uint64_t pos = h->head; pos < h->tail; pos = tnk_capture_next(h, pos)) {
+    const struct tnk_capture_record *r = capture_record(h, pos);
+    struct bench_dev *d = r && r->type == TNK_CAPTURE_OUT ? replay_dev(r) : NULL;
+    if (d) d->captured_out++;
+  }
+}
+
+/* Keeps the replayed input away from the host's input stack: only the
+ * grabbing handle sees what a grabbed event device reports. */
+static void
+grab_host_input(const struct bench_dev *d)
+{
+  char link[64], node[PATH_MAX], pattern[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", d->host_fd);
+  ssize_t n = readlink(link, node, sizeof(node) - 1);
+  if (n <= 0) return;
+  node[n] = '\0';
+  const char *name = strrchr(node, '/');
+  snprintf(pattern, sizeof(pattern), "/sys/class/hidraw/%s/device/input/input*/event*", name ? name + 1 : node);
+
+  glob_t g;
+  if (glob(pattern, 0, NULL, &g) != 0) return;
+  for (size_t i = 0; i < g.gl_pathc && ngrabs < sizeof(grab_fds) / sizeof(grab_fds[0]); i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/dev/input/%s", strrchr(g.gl_pathv[i], '/') + 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) continue;
+    if (ioctl(fd, EVIOCGRAB, 1) == -1) {
+      perror(path);
+      close(fd);
+      continue;
+    }
+    grab_fds[ngrabs++] = fd;
+  }
+  globfree(&g);
+}
+
+static void
+uhid_replay(struct bench_dev *d, const uint8_t *report, uint32_t len)
+{
+  struct uhid_event ev;
+  if (len > UHID_DATA_MAX) return;
+  memset(&ev, 0, sizeof(ev));
+  ev.type = UHID_INPUT2;
+  ev.u.input2.size = (uint16_t)len;
+  memcpy(ev.u.input2.data, report, len);
+  d->sent++;
+  d->inflight++;
+  uhid_write(d->uhid_fd, &ev);
+}
+
+/* Reads whatever reached the host, replayed reports can't be matched up. */
+static uint32_t
+host_count(struct bench_dev *d)
+{
+  uint8_t buf[UHID_DATA_MAX];
+  uint32_t got = 0;
+  while (read(d->host_fd, buf, sizeof(buf)) > 0) {
+    if (d->inflight) d->inflight--;
+    d->received++;
+    got++;
+  }
+  return got;
+}
+
+/* Replays the capture, returns how long sending took. */
+static uint64_t
+phase_replay(const struct tnk_capture_header *h, bool max_speed)
+{
+  struct pollfd pfds[BENCH_MAX_PROFILES * 2];
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < ndevs; i++) {
+    reset_counters(&devs[i]);
+    pfds[n++] = (struct pollfd){ .fd = devs[i].host_fd, .events = POLLIN };
+    pfds[n++] = (struct pollfd){ .fd = devs[i].uhid_fd, .events = POLLIN };
+  }
+
+  uint64_t start = tnk_now_ns();
+  uint64_t first_ns = 0;
+  uint64_t last_progress = start;
+  uint64_t pos = h->head;
+  for (;;) {
+    const struct tnk_capture_record *r = NULL;
+    struct bench_dev *d = NULL;
+    for (; pos < h->tail; pos = tnk_capture_next(h, pos)) {
+      r = capture_record(h, pos);
+      if (r && r->type == TNK_CAPTURE_IN && (d = replay_dev(r))) break;
+    }
+    if (!d) break;
+    if (!first_ns) first_ns = r->ns;
+
+    uint64_t now = tnk_now_ns();
+    uint64_t due = max_speed ? now : start + (r->ns - first_ns);
+    /* as fast as it goes is a few reports in flight per device, like
+     * phase_throughput, in the order they were captured */
+    bool blocked = max_speed && d->inflight >= BENCH_WINDOW;
+    if (now >= due && !blocked) {
+      uhid_replay(d, (const uint8_t *)(r + 1), r->len);
+      pos = tnk_capture_next(h, pos);
+      continue;
+    }
+
+    uint64_t wait = blocked ? 100 * 1000000ULL : due - now;
+    struct timespec ts = { .tv_sec = (time_t)(wait / 1000000000ULL), .tv_nsec = (long)(wait % 1000000000ULL) };
+    if (ppoll(pfds, n, &ts, NULL) == -1 && errno != EINTR) die("ppoll");
+    now = tnk_now_ns();
+    uint32_t got = 0;
+    for (uint32_t i = 0; i < ndevs; i++) {
+      got += host_count(&devs[i]);
+      uhid_service(&devs[i]);
+    }
+    if (got) {
+      last_progress = now;
+    } else if (blocked && now - last_progress > 100 * 1000000ULL) {
+      /* folded or swallowed by a hotkey, nothing more is coming for these */
+      for (uint32_t i = 0; i < ndevs; i++) devs[i].inflight = 0;
+      last_progress = now;
+    }
+  }
+  uint64_t took = tnk_now_ns() - start;
+
+  uint64_t stop_at = tnk_now_ns() + BENCH_DRAIN_NS;
+  while (tnk_now_ns() < stop_at) {
+    if (poll(pfds, n, 10) == -1 && errno != EINTR) die("poll");
+    for (uint32_t i = 0; i < ndevs; i++) {
+      host_count(&devs[i]);
+      uhid_service(&devs[i]);
+    }
+  }
+  return took;
+}
+
+/* Prints the replay's results, 1 if a device got nothing through. */
+static int
+report_replay(uint64_t took)
+{
+  int rc = 0;
+  uint64_t sent = 0;
+  for (uint32_t i = 0; i < ndevs; i++) {
+    const struct bench_dev *d = &devs[i];
+    printf("%s sent %" PRIu64 " received %" PRIu64 " captured_out %" PRIu64 "\n",
+           d->def->name, d->sent, d->received, d->captured_out);
+    sent += d->sent;
+    if (d->received == 0) rc = 1;
+  }
+  printf("replay_ms %.1f reports %" PRIu64 " rate_hz %.0f\n", (double)took / 1e6, sent,
+         took ? (double)sent / ((double)took / 1e9) : 0.0);
+  return rc;
+}
+
+/* ---- resources ---- */
+
+static uint64_t
+status_kb(pid_t pid, const char *key)
+{
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp) return 0;
+  uint64_t kb = 0;
+  size_t klen = strlen(key);
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, key, klen) == 0 && line[klen] == ':') {
+      kb = strtoull(line + klen + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(fp);
+  return kb;
+}
+
+static void
+print_rss(void)
+{
+  char path[64], buf[256];
+  printf("rss_kb root %" PRIu64 " peak %" PRIu64 "\n", status_kb(tnk_pid, "VmRSS"), status_kb(tnk_pid, "VmHWM"));
+
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)tnk_pid, (int)tnk_pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp) return;
+  if (fgets(buf, sizeof(buf), fp)) {
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+      pid_t child = (pid_t)atoi(tok);
+      printf("rss_kb worker %" PRIu64 " peak %" PRIu64 "\n", status_kb(child, "VmRSS"), status_kb(child, "VmHWM"));
+    }
+  }
+  fclose(fp);
+}
+
+static void
+print_tnk_stats(const char *stats)
+{
+  unlink(stats);
+  kill(tnk_pid, SIGUSR1);
+  for (int i = 0; i < 100; i++) {
+    sleep_ns(10 * 1000000ULL);
+    FILE *fp = fopen(stats, "r");
+    if (!fp) continue;
+    char line[512];
+    bool any = false;
+    while (fgets(line, sizeof(line), fp)) {
+      printf("tnk %s", line);
+      any = true;
+    }
+    fclose(fp);
+    if (any) return;
+  }
+  fprintf(stderr, "tnk didn't write %s\n", stats);
+}
+
+static void
+ensure_udc(const char *udc)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/class/udc/%s", udc);
+  if (access(path, F_OK) == 0) return;
+  if (strncmp(udc, "dummy_udc", 9) == 0) {
+    if (system("modprobe dummy_hcd") != 0) {
+      fprintf(stderr, "modprobe dummy_hcd failed\n");
+    }
+  }
+  for (int i = 0; i < 200 && access(path, F_OK) != 0; i++) {
+    sleep_ns(10 * 1000000ULL);
+  }
+  if (access(path, F_OK) != 0) {
+    fprintf(stderr, "no UDC %s\n", udc);
+    exit(1);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *tnk = "/usr/local/sbin/tnk";
+  const char *udc = "dummy_udc.0";
+  const char *stats = "/run/tnk-bench.stats";
+  const char *replay = NULL;
+  uint32_t seconds = 10;
+  double max_p99_us = 0;
+  bool max_speed = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--max-speed") == 0) {
+      max_speed = true;
+      continue;
+    }
+    if (strcmp(arg, "-t") == 0 && val) {
+      tnk = val;
+    } else if (strcmp(arg, "-d") == 0 && val) {
+      seconds = (uint32_t)strtoul(val, NULL, 10);
+    } else if (strcmp(arg, "-p") == 0 && val) {
+      char *list = strdup(val), *save = NULL;
+      for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        add_profile(tok);
+      }
+      free(list);
+    } else if (strcmp(arg, "--udc") == 0 && val) {
+      udc = val;
+    } else if (strcmp(arg, "--stats") == 0 && val) {
+      stats = val;
+    } else if (strcmp(arg, "--max-p99-us") == 0 && val) {
+      max_p99_us = strtod(val, NULL);
+    } else if (strcmp(arg, "--replay") == 0 && val) {
+      replay = val;
+    } else {
+      usage(argv[0]);
+    }
+    i++;
+  }
+  if (replay) {
+    if (ndevs) usage(argv[0]);
+    capture = load_capture(replay);
+    add_replay_devices(capture);
+    if (ndevs == 0) {
+      fprintf(stderr, "%s: no reports read from a device\n", replay);
+      return 1;
+    }
+  } else if (ndevs == 0) {
+    add_profile("keyboard");
+    add_profile("mouse");
+    add_profile("nkro");
+  }
+  if (seconds == 0) usage(argv[0]);
+  if (geteuid() != 0) {
+    fprintf(stderr, "needs root for uhid, configfs and dummy_hcd\n");
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  ensure_udc(udc);
+  for (uint32_t i = 0; i < ndevs; i++) {
+    uhid_create(&devs[i], i);
+  }
+  /* let the hidraw nodes appear before tnk scans for them */
+  sleep_ns(200 * 1000000ULL);
+  for (uint32_t i = 0; i < ndevs; i++) uhid_service(&devs[i]);
+
+  spawn_tnk(tnk, udc, stats);
+  uint64_t startup = phase_startup();
+  printf("startup_ms %.1f\n", (double)startup / 1e6);
+
+  int rc = 0;
+  if (capture) {
+    for (uint32_t i = 0; i < ndevs; i++) grab_host_input(&devs[i]);
+    rc = report_replay(phase_replay(capture, max_speed));
+  } else {
+    phase_latency(seconds);
+    for (uint32_t i = 0; i < ndevs; i++) {
+      phase_throughput(&devs[i], seconds);
+    }
+    for (uint32_t i = 0; i < ndevs; i++) {
+      const struct bench_dev *d = &devs[i];
+      double p99 = (double)tnk_hist_quantile(&d->latency, 0.99) / 1000.0;
+      printf("%s rate_hz %" PRIu32 " sent %" PRIu64 " received %" PRIu64 " lost %" PRIu64 "\n",
+             d->def->name, d->rate_hz, d->sent, d->received, d->lost);
+      printf("%s latency_us mean %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n", d->def->name,
+             d->latency.count ? (double)d->latency.sum / (double)d->latency.count / 1000.0 : 0.0,
+             (double)tnk_hist_quantile(&d->latency, 0.5) / 1000.0, p99,
+             (double)tnk_hist_quantile(&d->latency, 0.999) / 1000.0,
+             (double)d->latency.max / 1000.0);
+      printf("%s max_rate_hz %.0f\n", d->def->name, d->throughput);
+      if (d->received == 0 || (max_p99_us > 0 && p99 > max_p99_us)) {
+        rc = 1;
+      }
+    }
+  }
+  print_rss();
+  print_tnk_stats(stats);
+
+  kill(tnk_pid, SIGTERM);
+  int status;
+  waitpid(tnk_pid, &status, 0);
+  for (uint32_t i = 0; i < ndevs; i++) {
+    close(devs[i].uhid_fd); /* destroys the device */
+    close(devs[i].host_fd);
+  }
+  for (uint32_t i = 0; i < ngrabs; i++) close(grab_fds[i]);
+  if (rc) {
+    fprintf(stderr, "benchmark gate failed\n");
+  }
+  return rc;
+}
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <mruby.h>
+
+#include "arena.h"
+
+#define TNK_ARENA_DEFAULT_MB 16
+#define TNK_ARENA_MIN_SHIFT  5 /* 32 byte blocks, half of it header */
+#define TNK_ARENA_CLASSES    33 /* up to the 4 GiB TNK_USER_MEM_MB allows */
+#define TNK_ARENA_TRIM_SHIFT 18 /* free blocks from 256 KiB give pages back */
+
+/* in front of every block, keeps what follows as aligned as malloc's.
+ * Blocks sit at an offset into the arena that is a multiple of their size,
+ * so the buddy a block was split from or merges with is at offset ^ size. */
+struct tnk_arena_block {
+  uint32_t shift; /* the block is 1 << shift bytes */
+  uint32_t free;  /* on a free list */
+  struct tnk_arena_block *next; /* while on a free list */
+};
+
+_Static_assert(sizeof(struct tnk_arena_block) == 16, "malloc alignment");
+
+static struct {
+  uint8_t *base;
+  uint64_t cap;
+  uint64_t page;
+  struct tnk_arena_block *free[TNK_ARENA_CLASSES];
+  struct tnk_arena_stats stats;
+  /* not a spinlock: with TNK_REALTIME on a single CPU the SCHED_FIFO
+   * forwarder reading the stats would spin forever over a preempted user VM
+   * thread, priority inheritance lets that one finish instead */
+  pthread_mutex_t lock;
+} arena;
+
+static __thread bool entered;
+
+static void
+arena_lock(void)
+{
+  pthread_mutex_lock(&arena.lock);
+}
+
+static void
+arena_unlock(void)
+{
+  pthread_mutex_unlock(&arena.lock);
+}
+
+/* A free block's data is unused, the back link of its list lives there. */
+static struct tnk_arena_block **
+arena_prev(struct tnk_arena_block *b)
+{
+  return (struct tnk_arena_block **)(b + 1);
+}
+
+static void
+arena_push(struct tnk_arena_block *b, uint32_t shift)
+{
+  b->shift = shift;
+  b->free = 1;
+  b->next = arena.free[shift];
+  *arena_prev(b) = NULL;
+  if (b->next) *arena_prev(b->next) = b;
+  arena.free[shift] = b;
+}
+
+static void
+arena_unlink(struct tnk_arena_block *b)
+{
+  struct tnk_arena_block *prev = *arena_prev(b);
+  if (prev) {
+    prev->next = b->next;
+  } else {
+    arena.free[b->shift] = b->next;
+  }
+  if (b->next) *arena_prev(b->next) = prev;
+  b->free = 0;
+}
+
+/* Puts a free block on its list, merged with its buddy for as long as that
+ * is free and whole. */
+static void
+arena_release(struct tnk_arena_block *b, uint32_t shift)
+{
+  while (shift + 1 < TNK_ARENA_CLASSES) {
+    uint64_t buddy_at = (uint64_t)((uint8_t *)b - arena.base) ^ (1ULL << shift);
+    /* not carved yet, or split with a part of it in use */
+    if (buddy_at >= arena.stats.carved) break;
+    struct tnk_arena_block *buddy = (struct tnk_arena_block *)(arena.base + buddy_at);
+    if (!buddy->free || buddy->shift != shift) break;
+    arena_unlink(buddy);
+    if (buddy < b) b = buddy;
+    shift++;
+  }
+  arena_push(b, shift);
+  /* a closed or shrunk user VM leaves large free blocks behind, their pages
+   * go back to the kernel, all but the first with the header and list links.
+   * Locked pages (TNK_REALTIME) stay, madvise refuses them. */
+  if (shift >= TNK_ARENA_TRIM_SHIFT) {
+    madvise((uint8_t *)b + arena.page, (1ULL << shift) - arena.page, MADV_DONTNEED);
+  }
+}
+
+static bool
+arena_owns(const void *p)
+{
+  return arena.base && (const uint8_t *)p >= arena.base && (const uint8_t *)p < arena.base + arena.cap;
+}
+
+static void *
+arena_alloc(size_t size)
+{
+  if (size > arena.cap - sizeof(struct tnk_arena_block)) {
+    arena_lock();
+    arena.stats.failed++;
+    arena_unlock();
+    return NULL;
+  }
+  uint32_t shift = 64 - (uint32_t)__builtin_clzll(size + sizeof(struct tnk_arena_block) - 1);
+  if (shift < TNK_ARENA_MIN_SHIFT) shift = TNK_ARENA_MIN_SHIFT;
+
+  arena_lock();
+  /* the smallest free block that fits, halved down to size */
+  uint32_t k = shift;
+  while (k < TNK_ARENA_CLASSES && !arena.free[k]) k++;
+  struct tnk_arena_block *b;
+  uint64_t block = 1ULL << shift;
+  uint64_t at = (arena.stats.carved + block - 1) & ~(block - 1);
+  if (k < TNK_ARENA_CLASSES) {
+    b = arena.free[k];
+    arena_unlink(b);
+    while (k > shift) {
+      k--;
+      arena_push((struct tnk_arena_block *)((uint8_t *)b + (1ULL << k)), k);
+    }
+  } else if (at + block <= arena.cap) {
+    /* what aligning skips goes on the free lists in the largest pieces
+     * its own alignment allows */
+    while (arena.stats.carved < at) {
+      uint32_t piece = (uint32_t)__builtin_ctzll(arena.stats.carved);
+      struct tnk_arena_block *gap = (struct tnk_arena_block *)(arena.base + arena.stats.carved);
+      arena.stats.carved += 1ULL << piece;
+      arena_release(gap, piece);
+    }
+    b = (struct tnk_arena_block *)(arena.base + at);
+    b->free = 0;
+    arena.stats.carved = at + block;
+  } else {
+    arena.stats.failed++;
+    arena_unlock();
+    return NULL;
+  }
+  b->shift = shift;
+  arena.stats.used += 1ULL << shift;
+  if (arena.stats.used > arena.stats.peak) arena.stats.peak = arena.stats.used;
+  arena.stats.allocs++;
+  arena_unlock();
+  return b + 1;
+}
+
+static void
+arena_free(void *p)
+{
+  struct tnk_arena_block *b = (struct tnk_arena_block *)p - 1;
+  arena_lock();
+  arena.stats.used -= 1ULL << b->shift;
+  arena.stats.frees++;
+  arena_release(b, b->shift);
+  arena_unlock();
+}
+
+/* Replaces mruby's own (src/allocf.c), see arena.h. */
+void *
+mrb_basic_alloc_func(void *p, size_t size)
+{
+  if (p && arena_owns(p)) {
+    if (size == 0) {
+      arena_free(p);
+      return NULL;
+    }
+    struct tnk_arena_block *b = (struct tnk_arena_block *)p - 1;
+    size_t have = (1ULL << b->shift) - sizeof(*b);
+    if (size <= have) return p;
+    void *q = arena_alloc(size);
+    if (!q) return NULL;
+    memcpy(q, p, have);
+    arena_free(p);
+    return q;
+  }
+  if (!p && size && entered) return arena_alloc(size);
+  if (size == 0) {
+    free(p);
+    return NULL;
+  }
+  return realloc(p, size);
+}
+
+bool
+tnk_arena_init(void)
+{
+  const char *mb = getenv("TNK_USER_MEM_MB");
+  long size_mb = mb ? strtol(mb, NULL, 10) : TNK_ARENA_DEFAULT_MB;
+  if (size_mb <= 0 || size_mb > 4096) {
+    fprintf(stderr, "user vm: TNK_USER_MEM_MB must be 1..4096\n");
+    return false;
+  }
+  uint64_t cap = (uint64_t)size_mb << 20;
+  pthread_mutexattr_t attr;
+  int err = pthread_mutexattr_init(&attr);
+  if (!err) {
+    err = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    if (!err) err = pthread_mutex_init(&arena.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+  if (err) {
+    fprintf(stderr, "user vm: pthread_mutex_init(arena): %s\n", strerror(err));
+    return false;
+  }
+  void *p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("user vm: mmap(arena)");
+    pthread_mutex_destroy(&arena.lock);
+    return false;
+  }
+  arena.base = p;
+  arena.cap = cap;
+  arena.page = (uint64_t)sysconf(_SC_PAGESIZE);
+  arena.stats.cap = cap;
+  return true;
+}
+
+void
+tnk_arena_enter(void)
+{
+  entered = arena.base != NULL;
+}
+
+void
+tnk_arena_leave(void)
+{
+  entered = false;
+}
+
+void
+tnk_arena_stats(struct tnk_arena_stats *stats)
+{
+  if (!arena.base) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  arena_lock();
+  *stats = arena.stats;
+  arena_unlock();
+}
@@ -0,0 +1,46 @@
+#ifndef TNK_ARENA_H
+#define TNK_ARENA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Memory of the user VMs.
+ *
+ * Since mruby 3.3 every state allocates through mrb_basic_alloc_func(), there
+ * is no allocator per state any more, so tnk defines that function itself.
+ * On a thread that entered the arena a new block comes from one mapping of
+ * TNK_USER_MEM_MB (16 by default) the worker reserves at startup, on every
+ * other thread from malloc. Resizing and freeing go by the block's address,
+ * so a user VM may be closed from any thread. Once the arena is full an
+ * allocation fails: mruby runs a full GC, tries again and raises
+ * NoMemoryError in the user VM, the forwarder and the root VM never notice.
+ * During a reload the old and the new user VM share the arena.
+ *
+ * Blocks come in power of two sizes with a header in front, freed ones go on
+ * a list per size and merge with their buddy whenever that is free too. A
+ * page of the mapping is only touched once a block on it is handed out, so
+ * what isn't used costs nothing, TNK_REALTIME locks pages only as they are
+ * touched. Free blocks of 256 KiB and more, e.g. what a reload leaves of the
+ * old user VM, hand their pages back.
+ */
+
+struct tnk_arena_stats {
+  uint64_t cap;     /* bytes reserved, 0: no arena */
+  uint64_t used;    /* in blocks handed out, headers included */
+  uint64_t peak;
+  uint64_t carved;  /* of the mapping, free blocks included */
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t failed;  /* allocations refused for want of room */
+};
+
+/* Worker: reserves the arena, false (with the error printed) if it can't,
+ * and the worker gives up rather than run user.rb without a limit. */
+bool tnk_arena_init(void);
+/* From now on new blocks of the calling thread come from the arena. */
+void tnk_arena_enter(void);
+void tnk_arena_leave(void);
+void tnk_arena_stats(struct tnk_arena_stats *stats);
+
+#endif
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "stats.h"
+#include "tnk.h"
+
+_Static_assert(TNK_CAPTURE_DEVICES == TNK_FWD_MAX_PAIRS, "a capture device per pair slot");
+
+#define TNK_CAPTURE_DEFAULT_MB 16
+
+struct tnk_capture_header *tnk_capture;
+static size_t capture_len;
+/* shard threads record too, appending is short enough to spin on */
+static bool capture_lock;
+
+void
+tnk_capture_open(void)
+{
+  const char *path = getenv("TNK_CAPTURE");
+  if (!path || !*path) return;
+  const char *mb = getenv("TNK_CAPTURE_MB");
+  long size_mb = mb ? strtol(mb, NULL, 10) : TNK_CAPTURE_DEFAULT_MB;
+  if (size_mb <= 0 || size_mb > 4096) {
+    fprintf(stderr, "capture: TNK_CAPTURE_MB must be 1..4096\n");
+    return;
+  }
+
+  uint64_t size = (uint64_t)size_mb << 20;
+  size_t len = sizeof(struct tnk_capture_header) + size;
+  /* every keystroke, passwords included: root's eyes only, and a link
+   * planted at path doesn't get to pick what root overwrites */
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd == -1 || fchmod(fd, 0600) == -1) {
+    perror(path);
+    if (fd != -1) close(fd);
+    return;
+  }
+  if (ftruncate(fd, (off_t)len) == -1) {
+    perror(path);
+    close(fd);
+    return;
+  }
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("capture: mmap");
+    return;
+  }
+  /* every page present before forwarding starts, recording never faults */
+  memset(p, 0, len);
+
+  struct tnk_capture_header *h = (struct tnk_capture_header *)p;
+  h->magic = TNK_CAPTURE_MAGIC;
+  h->version = TNK_CAPTURE_VERSION;
+  h->size = size;
+  h->started_ns = tnk_now_ns();
+  tnk_capture = h;
+  capture_len = len;
+}
+
+void
+tnk_capture_close(void)
+{
+  if (!tnk_capture) return;
+  munmap(tnk_capture, capture_len);
+  tnk_capture = NULL;
+}
+
+void
+tnk_capture_device(uint32_t pair, uint32_t gen, const uint8_t *desc, uint32_t len)
+{
+  if (!tnk_capture || pair >= TNK_CAPTURE_DEVICES || len > TNK_CAPTURE_DESC_MAX) return;
+  struct tnk_capture_device *d = &tnk_capture->devices[pair];
+  memcpy(d->desc, desc, len);
+  d->desc_len = (uint16_t)len;
+  __atomic_store_n(&d->gen, gen, __ATOMIC_RELEASE);
+}
+
+void
+tnk_capture_report(enum tnk_capture_type type, uint32_t pair, uint32_t gen, uint8_t report_id,
+                   const uint8_t *report, uint32_t len)
+{
+  struct tnk_capture_header *h = tnk_capture;
+  uint64_t size = tnk_capture_size(len);
+  /* half the ring at most, so padding and the record always fit */
+  if (!h || len > UINT16_MAX || size > h->size / 2) return;
+
+  while (__atomic_test_and_set(&capture_lock, __ATOMIC_ACQUIRE)) {
+  }
+  uint64_t off = h->tail % h->size;
+  uint64_t pad = off + size > h->size ? h->size - off : 0;
+  uint64_t head = h->head;
+  while (h->tail + pad + size - head > h->size) {
+    head = tnk_capture_next(h, head);
+  }
+  __atomic_store_n(&h->head, head, __ATOMIC_RELEASE);
+
+  uint64_t tail = h->tail;
+  if (pad) {
+    struct tnk_capture_record *p = tnk_capture_at(h, tail);
+    if (p) {
+      p->type = TNK_CAPTURE_PAD;
+      p->len = (uint16_t)(pad - sizeof(*p));
+    }
+    tail += pad;
+  }
+  struct tnk_capture_record *r = tnk_capture_at(h, tail);
+  r->ns = tnk_now_ns();
+  r->gen = gen;
+  r->len = (uint16_t)len;
+  r->type = (uint8_t)type;
+  r->pair = (uint8_t)pair;
+  r->report_id = report_id;
+  memcpy(r + 1, report, len);
+  __atomic_store_n(&h->tail, tail + size, __ATOMIC_RELEASE);
+  __atomic_clear(&capture_lock, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,103 @@
+#ifndef TNK_CAPTURE_H
+#define TNK_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Capture of the reports that pass through the forwarder.
+ *
+ * With TNK_CAPTURE set, the root process creates that file before forking:
+ * a header with the report descriptor of every pair, followed by a ring of
+ * records. The worker inherits the shared mapping and appends a record for
+ * every report read from a hidraw node (in) and every report written to a
+ * hidg node (out); once the ring is full the oldest records make room. The
+ * file is a plain memory image, tnk-bench --replay reads it back.
+ *
+ * A record never wraps: when it doesn't fit before the end of the ring the
+ * rest is padding, a pad record if there is room for its header. head and
+ * tail count the bytes ever written, the records between them are valid.
+ */
+
+#define TNK_CAPTURE_MAGIC    0x434B4E54 /* "TNKC" */
+#define TNK_CAPTURE_VERSION  1
+#define TNK_CAPTURE_DEVICES  16   /* TNK_FWD_MAX_PAIRS */
+#define TNK_CAPTURE_DESC_MAX 4096 /* HID_MAX_DESCRIPTOR_SIZE */
+#define TNK_CAPTURE_ALIGN    8
+
+enum tnk_capture_type {
+  TNK_CAPTURE_PAD = 0,
+  TNK_CAPTURE_IN,  /* read from the hidraw node */
+  TNK_CAPTURE_OUT, /* written to the hidg node */
+};
+
+struct tnk_capture_device {
+  uint32_t gen; /* of the pair that last had this slot, 0: never used */
+  uint16_t desc_len;
+  uint16_t reserved;
+  uint8_t desc[TNK_CAPTURE_DESC_MAX];
+};
+
+struct tnk_capture_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size; /* of the record ring */
+  uint64_t head; /* oldest record */
+  uint64_t tail; /* where the next one goes */
+  uint64_t started_ns;
+  struct tnk_capture_device devices[TNK_CAPTURE_DEVICES];
+  /* the record ring follows */
+};
+
+struct tnk_capture_record {
+  uint64_t ns; /* CLOCK_MONOTONIC */
+  uint32_t gen;
+  uint16_t len; /* report bytes that follow */
+  uint8_t type;
+  uint8_t pair;
+  uint8_t report_id; /* first byte on devices with report IDs, else 0 */
+  uint8_t reserved[7];
+};
+
+static inline uint64_t
+tnk_capture_size(uint32_t len)
+{
+  return (sizeof(struct tnk_capture_record) + len + TNK_CAPTURE_ALIGN - 1) & ~(uint64_t)(TNK_CAPTURE_ALIGN - 1);
+}
+
+static inline uint8_t *
+tnk_capture_records(const struct tnk_capture_header *h)
+{
+  return (uint8_t *)(h + 1);
+}
+
+/* The record at pos, NULL where only padding is left before the end. */
+static inline struct tnk_capture_record *
+tnk_capture_at(const struct tnk_capture_header *h, uint64_t pos)
+{
+  uint64_t off = pos % h->size;
+  if (h->size - off < sizeof(struct tnk_capture_record)) return NULL;
+  return (struct tnk_capture_record *)(tnk_capture_records(h) + off);
+}
+
+/* Position of the record after the one at pos. */
+static inline uint64_t
+tnk_capture_next(const struct tnk_capture_header *h, uint64_t pos)
+{
+  const struct tnk_capture_record *r = tnk_capture_at(h, pos);
+  return pos + (r ? tnk_capture_size(r->len) : h->size - pos % h->size);
+}
+
+/* Root process: maps the file named by TNK_CAPTURE, if any, for the worker
+ * to inherit, and keeps the mapping until it exits so a respawned worker
+ * records into the same ring. */
+extern struct tnk_capture_header *tnk_capture;
+void tnk_capture_open(void);
+void tnk_capture_close(void);
+
+/* Worker: a pair came up with this descriptor, a report passed. */
+void tnk_capture_device(uint32_t pair, uint32_t gen, const uint8_t *desc, uint32_t len);
+void tnk_capture_report(enum tnk_capture_type type, uint32_t pair, uint32_t gen, uint8_t report_id,
+                        const uint8_t *report, uint32_t len);
+
+#endif
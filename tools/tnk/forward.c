@@ -0,0 +1,2497 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <liburing.h>
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
+#include <mruby/object.h>
+#include <mruby/presym.h>
+#include <mruby/variable.h>
+#include <tnk/hid_descriptor.h>
+
+#include "arena.h"
+#include "capture.h"
+#include "inject.h"
+#include "realtime.h"
+#include "result_ring.h"
+#include "stats.h"
+#include "tnk.h"
+
+/*
+ * Native hidraw -> hidg forwarding loop.
+ *
+ * Each pair runs in one of three modes:
+ *
+ * multishot  one IORING_OP_READ_MULTISHOT per hidraw node picking buffers out
+ *            of a provided buffer ring; every report costs a single write SQE
+ *            and the read never has to be re-armed between reports.
+ * linked     a read linked to a write of the same buffer (IOSQE_IO_LINK), the
+ *            read CQE is skipped on success so a report costs one submission
+ *            and one completion. Needs fixed length reports, a short read
+ *            breaks the link and is forwarded the slow way.
+ * single     a plain read that is copied into a write slot and re-armed.
+ *
+ * Multishot and single pairs keep at most one write per hidg in flight, hidg
+ * nodes are switched to O_NONBLOCK so a write the host hasn't polled yet
+ * waits on poll inside the ring instead of tying up an io-wq thread. Reports
+ * read in the meantime wait in a short queue, and when the host falls behind
+ * (suspended, a slow BIOS, a 125 Hz host behind a 1000 Hz mouse) the newest
+ * report is folded into the last queued one where the report layout says the
+ * host can't tell: relative axes are summed, absolute axes keep the newer
+ * reading, and any change to buttons or keys is queued as a report of its
+ * own so no press or release goes missing. Only once the queue is full of
+ * transitions does reading stop, and the kernel's hidraw buffer takes over.
+ *
+ * Input devices without a hidraw node (uinput, some Bluetooth stacks) are
+ * read as evdev streams instead: batches of struct input_event update the
+ * device's key, button and axis state, and every SYN_REPORT turns into at
+ * most one keyboard and one mouse report for the gadget's generic keyboard
+ * and mouse functions (the sink pairs). Keys and buttons of all evdev
+ * devices are merged, so a modifier held on one keyboard applies to
+ * another. A sink has one write in flight at a time, like the queue of a
+ * pair, and while the host lags behind keyboard state and mouse motion are
+ * coalesced into the next report instead of queued.
+ *
+ * In all modes the report is written first and only then the hotkeys are
+ * consulted, and never on this thread: the set of keys each device holds,
+ * decoded from its report layout (8 byte boot reports when there is none),
+ * is posted to the user VM thread (see vm.c) whenever it changed, and the
+ * eventfd that wakes it is written from the next submission. What a hotkey
+ * block returns comes back through the result ring and is played
+ * back per pair, one operation at a time so the host sees it in order:
+ * reports are written straight out of the ring, texts are typed key by key
+ * through a single report buffer, each write linked to an IORING_OP_TIMEOUT
+ * when the text asks for pacing, and integers pause the output.
+ *
+ * With TNK_COMPOSITE=1 most pairs share the hidg of one composite function,
+ * each under report IDs of its own (see Tnk::Hidg). Queueing, coalescing and
+ * hotkeys still work on the device's reports, only what goes out to the hidg
+ * is translated: through a per pair staging buffer, the report ID swapped for
+ * the composite one, or one put in front of a device without IDs. Linked
+ * chains write the read buffer as is, such pairs fall back to single.
+ *
+ * Clients of the injection protocol (see inject.h) connect to sockets the
+ * root process opened, their frames are checked and copied into a ring of
+ * their own and queued to the generic keyboard or mouse like hotkey results,
+ * followed by an entry that acks the frame once played back. A frame that
+ * doesn't fit yet leaves its client unread until output drained.
+ *
+ * With TNK_SHARDS=1 the pairs added before Forwarder#run are forwarded on
+ * shard threads instead, one per pair, each with a ring and buffers of its
+ * own, so a 1000 Hz mouse never waits behind a keyboard and the loop work
+ * spreads over the cores. Shards have no VM: they allocate from malloc and a
+ * failure ends the thread with the errno and the call that failed, which the
+ * forwarder raises once the shard eventfd tells it. A shard runs this same
+ * code on a forwarder of its own that holds just its pair, under the slot
+ * number it has here, where the slot only stays reserved. It posts key
+ * changes into the pair's own event ring and the user VM thread sends the
+ * pair's results to the shard's result ring, both single producer, single
+ * consumer. Evdev input, injection, pairs hotplugged later and the control
+ * socket stay on this thread.
+ *
+ * Pairs come and go at runtime: a hidraw node that fails with EIO/ENODEV has
+ * been unplugged and its pair is released once its writes drained, new pairs
+ * arrive from the root process over the control socket (see hotplug.c).
+ *
+ * With TNK_REALTIME set the ring is created with an SQPOLL thread and the
+ * loop runs at SCHED_FIFO with its memory locked (see realtime.h).
+ *
+ * With TNK_CAPTURE set every report read and written is also recorded into
+ * a memory mapped ring file (see capture.h), a copy into pages that are
+ * already present.
+ *
+ * Every pair keeps always-on statistics: the time from handling a read
+ * completion to the completion of its hidg write, the time hotkey blocks
+ * take, report counts and queue depths. The root process asks for them on
+ * SIGUSR1 and hands over the stats file to write them to. Linked chains
+ * skip the read completion, so they only count reports.
+ */
+
+#define TNK_FWD_WRITE_SLOTS  8
+#define TNK_FWD_BUF_RING     16
+#define TNK_FWD_MIN_BUF      64
+#define TNK_FWD_RING_ENTRIES 256
+#define TNK_FWD_OUT_QUEUE    256 /* a full injection frame and its ack */
+#define TNK_FWD_CHAIN_SLOT   0xFF
+#define TNK_FWD_MAX_EVDEV    16
+#define TNK_FWD_EVDEV_BATCH  64
+#define TNK_FWD_EVDEV_KEYS   16
+#define TNK_FWD_MOUSE_LEN    7
+#define TNK_FWD_CLIENTS      8
+
+enum tnk_fwd_op {
+  TNK_FWD_OP_READ = 1,
+  TNK_FWD_OP_WRITE,
+  TNK_FWD_OP_CONTROL,
+  TNK_FWD_OP_OUTPUT,
+  TNK_FWD_OP_EVDEV,
+  TNK_FWD_OP_KICK,    /* eventfd write waking the user VM thread */
+  TNK_FWD_OP_RESULTS, /* eventfd read, the user VM thread committed results */
+  TNK_FWD_OP_ACCEPT,  /* injection listener, pair is its index */
+  TNK_FWD_OP_INJECT,  /* injection client read, pair is the client */
+  TNK_FWD_OP_SHARD,   /* eventfd read, a shard thread failed */
+  TNK_FWD_OP_STOP,    /* shard: eventfd read, time to stop */
+  TNK_FWD_OP_SNAP,    /* shard: eventfd read, copy the statistics */
+  TNK_FWD_OP_UNCHAIN, /* cancel of a linked chain, see tnk_fwd_unchain() */
+};
+
+enum tnk_fwd_mode {
+  TNK_FWD_MODE_SINGLE,
+  TNK_FWD_MODE_LINKED,
+  TNK_FWD_MODE_MULTISHOT,
+  TNK_FWD_MODE_SINK,  /* no hidraw, written from evdev state */
+  TNK_FWD_MODE_SHARD, /* forwarded on a shard thread, the slot is reserved */
+};
+
+#define TNK_FWD_UDATA(op, pair, slot) \
+  (((uint64_t)(op) << 32) | ((uint64_t)(pair) << 8) | (uint64_t)(slot))
+#define TNK_FWD_UDATA_OP(u)   ((uint32_t)((u) >> 32))
+#define TNK_FWD_UDATA_PAIR(u) ((uint32_t)(((u) >> 8) & 0xFFFFFF))
+#define TNK_FWD_UDATA_SLOT(u) ((uint32_t)((u) & 0xFF))
+
+/* hotkey results waiting to be played back to one hidg */
+struct tnk_fwd_output {
+  struct tnk_result *queue[TNK_FWD_OUT_QUEUE];
+  uint32_t qhead, qtail;
+  struct tnk_result *cur; /* entry being played back */
+  uint32_t pos;           /* progress within cur */
+  bool key_down;          /* typing: the last report pressed a key */
+  bool unchaining;        /* linked: the armed chain is being cancelled */
+  uint32_t pending;       /* CQEs still to come for the current step */
+  struct __kernel_timespec ts;
+  uint8_t report[TNK_TYPE_REPORT_LEN];
+};
+
+struct tnk_fwd_stats {
+  uint64_t reports;
+  uint64_t bytes;
+  uint64_t dropped;        /* writes the host didn't take (ESHUTDOWN), unmapped IDs */
+  uint64_t hotkeys;        /* hotkey blocks run */
+  uint64_t coalesced;      /* reports folded into a queued one */
+  uint32_t inflight_max;
+  uint32_t queue_max;
+  uint32_t out_queue_max;
+  uint64_t read_ns[TNK_FWD_BUF_RING]; /* per write slot: read completion */
+  struct tnk_hist forward; /* read completion -> write completion */
+  struct tnk_hist hotkey;  /* tnk_hotkeys_dispatch of a matching report */
+};
+
+struct tnk_fwd_pair {
+  bool used;
+  bool dead;     /* hidraw node is gone, released once inflight drops to 0 */
+  bool owns_fds; /* received over the control socket, not backed by an IO */
+  int hidraw_fd;
+  int hidg_fd;
+  enum tnk_fwd_mode mode;
+  uint32_t buf_len;
+  bool reading;
+  uint32_t inflight; /* writes submitted but not completed */
+  uint8_t *rbuf;
+  uint8_t *wbuf; /* TNK_FWD_WRITE_SLOTS * buf_len */
+  /* reports waiting for the hidg, a ring over the write slots; qhead is being
+   * written while writing is set (sinks: the report in slot 0). Hotkey output
+   * takes turns with them, see tnk_fwd_output_step(). */
+  bool writing;
+  uint32_t qhead, qcount;
+  uint32_t qlen[TNK_FWD_WRITE_SLOTS];
+  /* multishot buffers that didn't fit into the queue, in read order */
+  uint32_t held[TNK_FWD_BUF_RING];
+  uint32_t hhead, hcount;
+  uint32_t held_len[TNK_FWD_BUF_RING]; /* by buffer id */
+  uint64_t held_ns[TNK_FWD_BUF_RING];
+  struct tnk_hid_layout *layout; /* what may be coalesced, NULL: nothing */
+  uint32_t gen;                  /* tells the user VM thread a reused slot apart */
+  uint64_t hotkey_keys[TNK_HOTKEY_WORDS]; /* last posted to the user VM thread */
+  /* composite function: report IDs by the device's own, id_map[0] the one to
+   * put in front of a device without IDs. NULL: the hidg is the device's. */
+  uint8_t *id_map;
+  uint8_t *mbuf; /* 2 * (buf_len + 1): translated queue and output writes */
+  struct io_uring_buf_ring *br;
+  uint8_t *bufs; /* TNK_FWD_BUF_RING * buf_len, owned by br */
+  struct tnk_fwd_output out;
+  struct tnk_fwd_stats stats;
+};
+
+/* one evdev node */
+struct tnk_fwd_evdev {
+  bool used;
+  bool reading;
+  bool syncing; /* events were dropped, ignore them until the next SYN_REPORT */
+  int fd;
+  uint32_t nkeys;
+  uint16_t keys[TNK_FWD_EVDEV_KEYS]; /* pressed keys in press order */
+  uint8_t buttons;
+  int32_t dx, dy, wheel, hwheel; /* motion since the last SYN_REPORT */
+  struct input_event buf[TNK_FWD_EVDEV_BATCH];
+};
+
+/* what the sinks still owe the host */
+struct tnk_fwd_sinks {
+  int keyboard; /* pair index, -1 if none */
+  int mouse;
+  bool keyboard_dirty;
+  uint8_t keyboard_sent[TNK_TYPE_REPORT_LEN];
+  uint8_t buttons_sent;
+  int32_t dx, dy, wheel, hwheel;
+};
+
+/* a connection of the injection protocol */
+struct tnk_fwd_client {
+  bool used;
+  bool reading;
+  bool parked;  /* a frame waits for room in the output */
+  bool closing; /* shut down, freed once its read completes */
+  bool authed;  /* Unix socket, or the token came first (see inject.h) */
+  int fd;
+  uint32_t gen; /* acks of a freed slot don't reach its next client */
+  uint32_t fill;
+  uint8_t buf[sizeof(struct tnk_inject_frame) + TNK_INJECT_PAYLOAD_MAX];
+};
+
+struct tnk_fwd_inject_stats {
+  uint64_t clients;
+  uint64_t frames;
+  uint64_t refused;
+  uint64_t acks;
+};
+
+/* a pair forwarded on a thread of its own */
+struct tnk_fwd_shard {
+  uint32_t idx;
+  uint32_t gen;
+  int hidraw_fd;
+  int hidg_fd;
+  uint32_t report_len;
+  enum tnk_fwd_mode mode;
+  uint8_t *id_map; /* NULL or 256 entries */
+  int cpu;         /* realtime: the one to pin to, -1: any */
+  int stop_fd;     /* eventfd, forwarder -> shard */
+  int fail_fd;     /* the forwarder's shard_fd */
+  int snap_fd;     /* eventfd, forwarder -> shard: take a snapshot */
+  int snapped_fd;  /* eventfd, shard -> forwarder: snapshot taken */
+  bool started;
+  bool stopped;
+  bool stalled;    /* didn't answer a snapshot request */
+  pthread_t thread;
+  uint64_t stop_count;
+  uint64_t snap_count;
+  /* what failed, set before fail_fd is written */
+  int err;
+  const char *what;
+  jmp_buf unwind;
+  /* copies of the shard's counters, only touched by the shard between a
+   * read of snap_fd and its write of snapped_fd */
+  struct tnk_fwd_pair snap_pair;
+  uint64_t snap_wakeups;
+  uint64_t snap_cqes;
+  struct tnk_forwarder *fwd;
+};
+
+struct tnk_forwarder {
+  struct io_uring ring;
+  bool ring_ready;
+  bool has_read_multishot;
+  bool control_armed;
+  uint32_t npairs; /* high water mark of pairs[] */
+  uint64_t started_ns;
+  uint64_t wakeups;
+  uint64_t cqes;
+  struct tnk_fwd_pair pairs[TNK_FWD_MAX_PAIRS];
+  struct tnk_fwd_evdev evdevs[TNK_FWD_MAX_EVDEV];
+  struct tnk_fwd_sinks sinks;
+  uint32_t next_gen;
+  bool vm_running;
+  bool vm_kick; /* events were posted since the last wakeup */
+  int vm_fds[2];
+  uint64_t vm_one;
+  uint64_t vm_count;
+  struct tnk_result_ring results;
+  struct tnk_fwd_client clients[TNK_FWD_CLIENTS];
+  uint32_t next_client_gen;
+  uint32_t parked; /* clients with a frame waiting for room */
+  struct tnk_fwd_inject_stats inject;
+  struct tnk_result_ring injected; /* produced and consumed on this thread */
+  bool sharded; /* TNK_SHARDS=1 */
+  int shard_fd; /* eventfd written by a failing shard, -1 if none */
+  uint64_t shard_count;
+  struct tnk_fwd_shard *shards[TNK_FWD_MAX_PAIRS];
+};
+
+/* the shard of the calling thread, NULL on the forwarder's */
+static __thread struct tnk_fwd_shard *fwd_shard;
+
+/* mrb_sys_fail() for code that runs on shard threads too, where mrb is
+ * NULL: the errno and what failed go to the shard, and the thread unwinds
+ * to tnk_fwd_shard_main(). */
+mrb_noreturn static void
+tnk_fwd_sys_fail(mrb_state *mrb, const char *what)
+{
+  if (mrb) mrb_sys_fail(mrb, what);
+  fwd_shard->err = errno;
+  fwd_shard->what = what;
+  longjmp(fwd_shard->unwind, 1);
+}
+
+static void *
+tnk_fwd_malloc(mrb_state *mrb, size_t size)
+{
+  if (mrb) return mrb_malloc(mrb, size);
+  void *p = malloc(size);
+  if (!p) {
+    errno = ENOMEM;
+    tnk_fwd_sys_fail(mrb, "malloc");
+  }
+  return p;
+}
+
+static void
+tnk_fwd_free(mrb_state *mrb, void *p)
+{
+  if (mrb) {
+    mrb_free(mrb, p);
+  } else {
+    free(p);
+  }
+}
+
+static inline void
+tnk_fwd_inflight_inc(struct tnk_fwd_pair *pair)
+{
+  if (++pair->inflight > pair->stats.inflight_max) {
+    pair->stats.inflight_max = pair->inflight;
+  }
+}
+
+/* Hands an output entry back to the ring it came from. */
+static void
+tnk_fwd_release_result(struct tnk_forwarder *fwd, struct tnk_result *r)
+{
+  const uint8_t *p = (const uint8_t *)r;
+  if (p >= fwd->injected.buf && p < fwd->injected.buf + sizeof(fwd->injected.buf)) {
+    tnk_result_release(&fwd->injected, r);
+  } else {
+    tnk_result_release(&fwd->results, r);
+  }
+}
+
+/* Records a report passing the pair when capturing. */
+static inline void
+tnk_fwd_capture(const struct tnk_fwd_pair *pair, uint32_t idx, enum tnk_capture_type type,
+                const uint8_t *report, uint32_t len)
+{
+  if (!tnk_capture) return;
+  bool ids = (pair->layout && pair->layout->has_report_ids) || (type == TNK_CAPTURE_OUT && pair->id_map);
+  tnk_capture_report(type, idx, pair->gen, ids && len ? report[0] : 0, report, len);
+}
+
+static void
+tnk_fwd_release_pair(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  struct tnk_fwd_output *out = &pair->out;
+  if (out->cur) {
+    tnk_fwd_release_result(fwd, out->cur);
+  }
+  while (out->qhead != out->qtail) {
+    tnk_fwd_release_result(fwd, out->queue[out->qhead++ % TNK_FWD_OUT_QUEUE]);
+  }
+  if (pair->br) {
+    io_uring_free_buf_ring(&fwd->ring, pair->br, TNK_FWD_BUF_RING, (int)idx);
+  }
+  tnk_fwd_free(mrb, pair->bufs);
+  tnk_fwd_free(mrb, pair->layout);
+  tnk_fwd_free(mrb, pair->rbuf);
+  tnk_fwd_free(mrb, pair->wbuf);
+  tnk_fwd_free(mrb, pair->id_map);
+  tnk_fwd_free(mrb, pair->mbuf);
+  if (pair->owns_fds) {
+    close(pair->hidraw_fd);
+    close(pair->hidg_fd);
+  }
+  memset(pair, 0, sizeof(*pair));
+  if (fwd->sinks.keyboard == (int)idx) fwd->sinks.keyboard = -1;
+  if (fwd->sinks.mouse == (int)idx) fwd->sinks.mouse = -1;
+}
+
+/* Stops and joins the shard threads, what they use is freed with the
+ * forwarder. */
+static void
+tnk_fwd_stop_shards(struct tnk_forwarder *fwd)
+{
+  for (uint32_t i = 0; i < TNK_FWD_MAX_PAIRS; i++) {
+    struct tnk_fwd_shard *shard = fwd->shards[i];
+    if (!shard || !shard->started || shard->stopped) continue;
+    uint64_t one = 1;
+    if (write(shard->stop_fd, &one, sizeof(one)) < 0) {
+      perror("forwarder: write(shard eventfd)");
+    }
+    pthread_join(shard->thread, NULL);
+    shard->stopped = true;
+  }
+}
+
+static void
+tnk_forwarder_free(mrb_state *mrb, void *p)
+{
+  struct tnk_forwarder *fwd = (struct tnk_forwarder *)p;
+  if (!fwd) return;
+  tnk_fwd_stop_shards(fwd);
+  for (uint32_t i = 0; i < TNK_FWD_MAX_PAIRS; i++) {
+    struct tnk_fwd_shard *shard = fwd->shards[i];
+    if (!shard) continue;
+    if (shard->fwd) {
+      /* nothing may be routed to its results once they are gone */
+      tnk_vm_route(i, NULL, -1);
+      if (shard->fwd->vm_fds[1] >= 0) close(shard->fwd->vm_fds[1]);
+      tnk_forwarder_free(NULL, shard->fwd);
+    }
+    if (shard->stop_fd >= 0) close(shard->stop_fd);
+    if (shard->snap_fd >= 0) close(shard->snap_fd);
+    if (shard->snapped_fd >= 0) close(shard->snapped_fd);
+    mrb_free(mrb, shard->id_map);
+    mrb_free(mrb, shard);
+  }
+  if (fwd->shard_fd >= 0) {
+    close(fwd->shard_fd);
+  }
+  for (uint32_t i = 0; i < fwd->npairs; i++) {
+    if (fwd->pairs[i].used) {
+      tnk_fwd_release_pair(mrb, fwd, i);
+    }
+  }
+  for (uint32_t i = 0; i < TNK_FWD_MAX_EVDEV; i++) {
+    if (fwd->evdevs[i].used) {
+      close(fwd->evdevs[i].fd);
+    }
+  }
+  for (uint32_t i = 0; i < TNK_FWD_CLIENTS; i++) {
+    if (fwd->clients[i].used) {
+      close(fwd->clients[i].fd);
+    }
+  }
+  if (fwd->ring_ready) {
+    io_uring_queue_exit(&fwd->ring);
+  }
+  tnk_fwd_free(mrb, fwd);
+}
+
+static const struct mrb_data_type tnk_forwarder_type = {
+  "Tnk::Forwarder", tnk_forwarder_free
+};
+
+static int
+tnk_io_fileno(mrb_state *mrb, mrb_value io)
+{
+  return (int)mrb_integer(mrb_type_convert(mrb, io, MRB_TT_INTEGER, MRB_SYM(fileno)));
+}
+
+static struct io_uring_sqe *
+tnk_fwd_get_sqe(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&fwd->ring);
+  if (!sqe) {
+    io_uring_submit(&fwd->ring);
+    /* an SQPOLL thread takes them in its own time */
+    if (fwd->ring.flags & IORING_SETUP_SQPOLL) io_uring_sqring_wait(&fwd->ring);
+    sqe = io_uring_get_sqe(&fwd->ring);
+    if (!sqe) {
+      errno = EBUSY;
+      tnk_fwd_sys_fail(mrb, "io_uring_get_sqe");
+    }
+  }
+  return sqe;
+}
+
+static void
+tnk_fwd_arm_read(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  struct io_uring_sqe *sqe;
+
+  switch (pair->mode) {
+    case TNK_FWD_MODE_MULTISHOT:
+      sqe = tnk_fwd_get_sqe(mrb, fwd);
+      io_uring_prep_read_multishot(sqe, pair->hidraw_fd, 0, (uint64_t)-1, (int)idx);
+      io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_READ, idx, 0));
+      break;
+    case TNK_FWD_MODE_LINKED:
+      /* both SQEs must land in the same submission for the link to hold */
+      if (io_uring_sq_space_left(&fwd->ring) < 2) {
+        io_uring_submit(&fwd->ring);
+      }
+      sqe = tnk_fwd_get_sqe(mrb, fwd);
+      io_uring_prep_read(sqe, pair->hidraw_fd, pair->rbuf, pair->buf_len, (uint64_t)-1);
+      io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+      io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_READ, idx, 0));
+      sqe = tnk_fwd_get_sqe(mrb, fwd);
+      io_uring_prep_write(sqe, pair->hidg_fd, pair->rbuf, pair->buf_len, (uint64_t)-1);
+      io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_WRITE, idx, TNK_FWD_CHAIN_SLOT));
+      tnk_fwd_inflight_inc(pair);
+      break;
+    case TNK_FWD_MODE_SINGLE:
+      sqe = tnk_fwd_get_sqe(mrb, fwd);
+      io_uring_prep_read(sqe, pair->hidraw_fd, pair->rbuf, pair->buf_len, (uint64_t)-1);
+      io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_READ, idx, 0));
+      break;
+    case TNK_FWD_MODE_SINK:
+      return; /* written from evdev state, nothing to read */
+    case TNK_FWD_MODE_SHARD:
+      return; /* read on its shard thread */
+  }
+  pair->reading = true;
+}
+
+static void
+tnk_fwd_recycle_buf(struct tnk_fwd_pair *pair, uint32_t bid)
+{
+  io_uring_buf_ring_add(pair->br, pair->bufs + (size_t)bid * pair->buf_len, pair->buf_len,
+                        (unsigned short)bid, io_uring_buf_ring_mask(TNK_FWD_BUF_RING), 0);
+  io_uring_buf_ring_advance(pair->br, 1);
+}
+
+static bool
+tnk_fwd_is_axis(const struct tnk_hid_layout *layout, const struct tnk_hid_field *field, uint32_t i)
+{
+  uint32_t usage = tnk_hid_field_usage(layout, field, i);
+  switch (TNK_HID_USAGE_PAGE(usage)) {
+    case TNK_HID_PAGE_GENERIC_DESKTOP:
+      /* X, Y, Z, Rx, Ry, Rz, Slider, Dial, Wheel; not the hat switch */
+      return TNK_HID_USAGE_ID(usage) >= 0x30 && TNK_HID_USAGE_ID(usage) <= 0x38;
+    case TNK_HID_PAGE_DIGITIZER:
+      return field->bit_size > 1; /* pressure, tilt and the like, not tip/barrel switches */
+    default:
+      return false;
+  }
+}
+
+/*
+ * Folds report into pending if the host can't tell the difference: relative
+ * axes add up, absolute axes take the newer reading, everything else
+ * (buttons, keys, vendor data) has to be unchanged, or a press or release
+ * would go missing. Deltas that would overflow their field aren't folded.
+ */
+static bool
+tnk_fwd_coalesce(const struct tnk_hid_layout *layout, uint8_t *pending, uint32_t pending_len,
+                 const uint8_t *report, uint32_t len)
+{
+  if (len != pending_len || len == 0) return false;
+  uint32_t off = layout->has_report_ids ? 1 : 0;
+  if (off && pending[0] != report[0]) return false;
+  const struct tnk_hid_report *r = tnk_hid_report_by_id(layout, off ? report[0] : 0);
+  if (!r || tnk_hid_report_len(layout, r, TNK_HID_INPUT) != len) return false;
+
+  const uint8_t *np = report + off;
+  uint8_t *pp = pending + off;
+  size_t plen = len - off;
+
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    for (uint32_t f = r->first_field; f < (uint32_t)r->first_field + r->nfields; f++) {
+      const struct tnk_hid_field *field = &layout->fields[f];
+      if (field->type != TNK_HID_INPUT) continue;
+      bool variable = field->flags & TNK_HID_FIELD_VARIABLE;
+      for (uint32_t i = 0; i < field->count; i++) {
+        if (variable && (field->flags & TNK_HID_FIELD_RELATIVE)) {
+          int64_t sum = (int64_t)tnk_hid_field_value(field, pp, plen, i) +
+                        tnk_hid_field_value(field, np, plen, i);
+          if (pass == 0 && (sum < field->logical_min || sum > field->logical_max)) return false;
+          if (pass == 1) tnk_hid_field_set_raw(field, pp, plen, i, (uint32_t)sum);
+        } else if (variable && tnk_fwd_is_axis(layout, field, i)) {
+          if (pass == 1) tnk_hid_field_set_raw(field, pp, plen, i, tnk_hid_field_raw(field, np, plen, i));
+        } else if (pass == 0 &&
+                   tnk_hid_field_raw(field, pp, plen, i) != tnk_hid_field_raw(field, np, plen, i)) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/* On the composite function, a report with an ID the id map has none for:
+ * the host would take it for a report of some other device, so it is
+ * dropped. */
+static bool
+tnk_fwd_unmapped(const struct tnk_fwd_pair *pair, const uint8_t *report, uint32_t len)
+{
+  return pair->id_map && !pair->id_map[0] && len && !pair->id_map[report[0]];
+}
+
+/* A report as the pair's hidg takes it: on the composite function its
+ * report ID is swapped for the composite one, or one is put in front, in out
+ * (buf_len + 1 bytes). Returns what to write, report itself when the hidg is
+ * the device's own. */
+static const uint8_t *
+tnk_fwd_map_report(const struct tnk_fwd_pair *pair, const uint8_t *report, uint32_t *len, uint8_t *out)
+{
+  if (!pair->id_map) return report;
+  if (pair->id_map[0]) {
+    out[0] = pair->id_map[0];
+    memcpy(out + 1, report, *len);
+    (*len)++;
+  } else if (*len) {
+    memcpy(out, report, *len);
+    out[0] = pair->id_map[report[0]];
+  }
+  return out;
+}
+
+/* Starts writing the head of the queue unless a write is in flight or
+ * hotkey output is playing. */
+static void
+tnk_fwd_write_next(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  if (pair->writing || pair->out.cur || pair->qcount == 0) return;
+
+  uint32_t slot = pair->qhead;
+  uint32_t len = pair->qlen[slot];
+  const uint8_t *buf = tnk_fwd_map_report(pair, pair->wbuf + (size_t)slot * pair->buf_len, &len, pair->mbuf);
+  tnk_fwd_capture(pair, idx, TNK_CAPTURE_OUT, buf, len);
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_write(sqe, pair->hidg_fd, buf, len, (uint64_t)-1);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_WRITE, idx, slot));
+  tnk_fwd_inflight_inc(pair);
+  pair->writing = true;
+}
+
+/* Queues a report for the pair's hidg, folded into the last queued report
+ * when possible. Returns false if the queue is full. */
+static bool
+tnk_fwd_enqueue(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx, const uint8_t *report,
+                uint32_t len, uint64_t read_ns)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  if (tnk_fwd_unmapped(pair, report, len)) {
+    pair->stats.dropped++;
+    return true;
+  }
+
+  /* the head is off limits while it is being written */
+  if (pair->layout && pair->qcount > (pair->writing ? 1u : 0u)) {
+    uint32_t tail = (pair->qhead + pair->qcount - 1) % TNK_FWD_WRITE_SLOTS;
+    if (tnk_fwd_coalesce(pair->layout, pair->wbuf + (size_t)tail * pair->buf_len, pair->qlen[tail],
+                         report, len)) {
+      pair->stats.coalesced++;
+      return true;
+    }
+  }
+  if (pair->qcount == TNK_FWD_WRITE_SLOTS) return false;
+
+  uint32_t slot = (pair->qhead + pair->qcount++) % TNK_FWD_WRITE_SLOTS;
+  memcpy(pair->wbuf + (size_t)slot * pair->buf_len, report, len);
+  pair->qlen[slot] = len;
+  pair->stats.read_ns[slot] = read_ns;
+  if (pair->qcount > pair->stats.queue_max) {
+    pair->stats.queue_max = pair->qcount;
+  }
+  tnk_fwd_write_next(mrb, fwd, idx);
+  return true;
+}
+
+/* Moves held multishot buffers into the queue as far as it takes them. */
+static void
+tnk_fwd_drain_held(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  while (pair->hcount) {
+    uint32_t bid = pair->held[pair->hhead];
+    if (!tnk_fwd_enqueue(mrb, fwd, idx, pair->bufs + (size_t)bid * pair->buf_len, pair->held_len[bid],
+                         pair->held_ns[bid])) {
+      return;
+    }
+    tnk_fwd_recycle_buf(pair, bid);
+    pair->hhead = (pair->hhead + 1) % TNK_FWD_BUF_RING;
+    pair->hcount--;
+  }
+}
+
+/* Reading stops when there would be nowhere to put the next report. */
+static bool
+tnk_fwd_can_read(const struct tnk_fwd_pair *pair)
+{
+  if (pair->reading) return false;
+  switch (pair->mode) {
+    case TNK_FWD_MODE_MULTISHOT:
+      return pair->hcount < TNK_FWD_BUF_RING;
+    case TNK_FWD_MODE_SINGLE:
+      return pair->qcount < TNK_FWD_WRITE_SLOTS;
+    default:
+      return false;
+  }
+}
+
+static bool
+tnk_fwd_read_descriptor(int hidraw_fd, struct hidraw_report_descriptor *desc)
+{
+  int size = 0;
+  if (ioctl(hidraw_fd, HIDIOCGRDESCSIZE, &size) == -1 || size <= 0 || size > HID_MAX_DESCRIPTOR_SIZE) {
+    return false;
+  }
+  desc->size = (uint32_t)size;
+  return ioctl(hidraw_fd, HIDIOCGRDESC, desc) != -1;
+}
+
+/* Descriptor of the hidraw node, compiled, NULL if it doesn't compile. */
+static struct tnk_hid_layout *
+tnk_fwd_load_layout(mrb_state *mrb, const struct hidraw_report_descriptor *desc)
+{
+  struct tnk_hid_layout *layout = (struct tnk_hid_layout *)tnk_fwd_malloc(mrb, sizeof(*layout));
+  const char *err = tnk_hid_compile(desc->value, desc->size, layout);
+  if (err) {
+    fprintf(stderr, "forwarder: not coalescing reports: %s\n", err);
+    tnk_fwd_free(mrb, layout);
+    return NULL;
+  }
+  return layout;
+}
+
+/* Creates the ring of fwd, with an SQPOLL thread on sq_cpu unless that is
+ * -1, and sets up what every forwarder starts with. */
+static void
+tnk_fwd_init_ring(mrb_state *mrb, struct tnk_forwarder *fwd, int sq_cpu)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  if (sq_cpu >= 0) {
+    params.flags = IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF;
+    params.sq_thread_cpu = (uint32_t)sq_cpu;
+    params.sq_thread_idle = tnk_rt.idle_ms;
+  }
+  int ret = io_uring_queue_init_params(TNK_FWD_RING_ENTRIES, &fwd->ring, &params);
+  if (ret < 0 && params.flags) {
+    fprintf(stderr, "forwarder: no SQPOLL (%s), submitting from the loop\n", strerror(-ret));
+    memset(&params, 0, sizeof(params));
+    ret = io_uring_queue_init_params(TNK_FWD_RING_ENTRIES, &fwd->ring, &params);
+  }
+  if (ret < 0) {
+    errno = -ret;
+    tnk_fwd_sys_fail(mrb, "io_uring_queue_init");
+  }
+  fwd->ring_ready = true;
+  fwd->started_ns = tnk_now_ns();
+  fwd->sinks.keyboard = fwd->sinks.mouse = -1;
+  fwd->vm_one = 1;
+
+  struct io_uring_probe *probe = io_uring_get_probe_ring(&fwd->ring);
+  if (probe) {
+    fwd->has_read_multishot = io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT);
+    io_uring_free_probe(probe);
+  }
+}
+
+static mrb_value
+tnk_forwarder_initialize(mrb_state *mrb, mrb_value self)
+{
+  struct tnk_forwarder *fwd = (struct tnk_forwarder *)DATA_PTR(self);
+  if (fwd) {
+    tnk_forwarder_free(mrb, fwd);
+  }
+  mrb_data_init(self, NULL, &tnk_forwarder_type);
+
+  fwd = (struct tnk_forwarder *)mrb_calloc(mrb, 1, sizeof(*fwd));
+  fwd->shard_fd = -1;
+  mrb_data_init(self, fwd, &tnk_forwarder_type);
+
+  tnk_fwd_init_ring(mrb, fwd, tnk_rt.cpu);
+  const char *shards = getenv("TNK_SHARDS");
+  fwd->sharded = shards && strcmp(shards, "1") == 0;
+  mrb_iv_set(mrb, self, MRB_IVSYM(ios), mrb_ary_new(mrb));
+
+  return self;
+}
+
+static enum tnk_fwd_mode
+tnk_fwd_pick_mode(mrb_state *mrb, struct tnk_forwarder *fwd, mrb_sym mode)
+{
+  if (mode == MRB_SYM(auto)) {
+    const char *env = getenv("TNK_FORWARD_MODE");
+    mode = env ? mrb_intern_cstr(mrb, env) : MRB_SYM(multishot);
+  }
+
+  if (mode == MRB_SYM(multishot)) {
+    return fwd->has_read_multishot ? TNK_FWD_MODE_MULTISHOT : TNK_FWD_MODE_SINGLE;
+  } else if (mode == MRB_SYM(linked)) {
+    return (fwd->ring.features & IORING_FEAT_CQE_SKIP) ? TNK_FWD_MODE_LINKED : TNK_FWD_MODE_SINGLE;
+  } else if (mode == MRB_SYM(single)) {
+    return TNK_FWD_MODE_SINGLE;
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown forwarding mode: %S", mrb_symbol_value(mode));
+  return TNK_FWD_MODE_SINGLE;
+}
+
+static void
+tnk_fwd_setup_buf_ring(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  int ret = 0;
+
+  pair->bufs = (uint8_t *)tnk_fwd_malloc(mrb, (size_t)pair->buf_len * TNK_FWD_BUF_RING);
+  pair->br = io_uring_setup_buf_ring(&fwd->ring, TNK_FWD_BUF_RING, (int)idx, 0, &ret);
+  if (!pair->br) {
+    errno = -ret;
+    tnk_fwd_sys_fail(mrb, "io_uring_setup_buf_ring");
+  }
+  for (uint32_t bid = 0; bid < TNK_FWD_BUF_RING; bid++) {
+    tnk_fwd_recycle_buf(pair, bid);
+  }
+
+  /* multishot reads are driven by poll, make sure a spurious wakeup can't
+   * leave a blocking read() stuck inside the ring */
+  int flags = fcntl(pair->hidraw_fd, F_GETFL);
+  if (flags == -1 || fcntl(pair->hidraw_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    tnk_fwd_sys_fail(mrb, "fcntl(hidraw, O_NONBLOCK)");
+  }
+}
+
+static int
+tnk_fwd_free_pair_slot(const struct tnk_forwarder *fwd)
+{
+  for (uint32_t i = 0; i < TNK_FWD_MAX_PAIRS; i++) {
+    if (!fwd->pairs[i].used) return (int)i;
+  }
+  return -1;
+}
+
+/* Claims a free slot under a new generation. */
+static uint32_t
+tnk_fwd_reserve_pair(mrb_state *mrb, struct tnk_forwarder *fwd, mrb_int report_len)
+{
+  int slot = tnk_fwd_free_pair_slot(fwd);
+  if (slot < 0) {
+    mrb_raise(mrb, E_RANGE_ERROR, "too many forwarding pairs");
+  }
+  if (report_len <= 0 || report_len > 4096) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid report length");
+  }
+
+  uint32_t idx = (uint32_t)slot;
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  memset(pair, 0, sizeof(*pair));
+  pair->used = true;
+  pair->gen = ++fwd->next_gen;
+  if (idx >= fwd->npairs) {
+    fwd->npairs = idx + 1;
+  }
+  return idx;
+}
+
+/* Sets up the pair in a reserved slot. */
+static void
+tnk_fwd_setup_pair(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx, int hidraw_fd, int hidg_fd,
+                   uint32_t report_len, enum tnk_fwd_mode mode, bool owns_fds, const uint8_t *id_map)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  pair->hidraw_fd = hidraw_fd;
+  pair->hidg_fd = hidg_fd;
+  pair->mode = mode;
+  if (id_map && pair->mode == TNK_FWD_MODE_LINKED) {
+    pair->mode = TNK_FWD_MODE_SINGLE;
+  }
+  /* hidraw truncates reads to the buffer size, so leave room for descriptors
+   * whose length we misjudged. Linked chains write the whole buffer and need
+   * it to be exactly one report. */
+  if (pair->mode == TNK_FWD_MODE_LINKED) {
+    pair->buf_len = report_len;
+  } else {
+    pair->buf_len = report_len < TNK_FWD_MIN_BUF ? TNK_FWD_MIN_BUF : report_len;
+  }
+  pair->owns_fds = owns_fds;
+  pair->rbuf = (uint8_t *)tnk_fwd_malloc(mrb, pair->buf_len);
+  pair->wbuf = (uint8_t *)tnk_fwd_malloc(mrb, (size_t)pair->buf_len * TNK_FWD_WRITE_SLOTS);
+  if (id_map) {
+    pair->id_map = (uint8_t *)tnk_fwd_malloc(mrb, 256);
+    memcpy(pair->id_map, id_map, 256);
+    pair->mbuf = (uint8_t *)tnk_fwd_malloc(mrb, 2 * ((size_t)pair->buf_len + 1));
+  }
+
+  if (pair->mode == TNK_FWD_MODE_MULTISHOT) {
+    tnk_fwd_setup_buf_ring(mrb, fwd, idx);
+  }
+  /* linked chains write straight from the read buffer, nothing to fold
+   * into. Sinks pass their hidg twice and coalesce on their own. */
+  struct hidraw_report_descriptor desc;
+  if (hidraw_fd != hidg_fd && tnk_fwd_read_descriptor(hidraw_fd, &desc)) {
+    tnk_capture_device(idx, pair->gen, desc.value, desc.size);
+    if (pair->mode != TNK_FWD_MODE_LINKED) {
+      pair->layout = tnk_fwd_load_layout(mrb, &desc);
+    }
+  }
+  int flags = fcntl(hidg_fd, F_GETFL);
+  if (flags == -1 || fcntl(hidg_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    tnk_fwd_sys_fail(mrb, "fcntl(hidg, O_NONBLOCK)");
+  }
+}
+
+static uint32_t
+tnk_fwd_add_pair(mrb_state *mrb, struct tnk_forwarder *fwd, int hidraw_fd, int hidg_fd,
+                 mrb_int report_len, mrb_sym mode, bool owns_fds, const uint8_t *id_map)
+{
+  enum tnk_fwd_mode m = tnk_fwd_pick_mode(mrb, fwd, mode);
+  uint32_t idx = tnk_fwd_reserve_pair(mrb, fwd, report_len);
+  tnk_fwd_setup_pair(mrb, fwd, idx, hidraw_fd, hidg_fd, (uint32_t)report_len, m, owns_fds, id_map);
+  return idx;
+}
+
+/* Reserves a slot for a pair that a shard thread sets up and forwards once
+ * Forwarder#run started it. */
+static void
+tnk_fwd_add_shard(mrb_state *mrb, struct tnk_forwarder *fwd, int hidraw_fd, int hidg_fd,
+                  mrb_int report_len, mrb_sym mode, const uint8_t *id_map)
+{
+  enum tnk_fwd_mode m = tnk_fwd_pick_mode(mrb, fwd, mode);
+  uint32_t idx = tnk_fwd_reserve_pair(mrb, fwd, report_len);
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  pair->mode = TNK_FWD_MODE_SHARD;
+  pair->hidraw_fd = hidraw_fd;
+  pair->hidg_fd = hidg_fd;
+
+  struct tnk_fwd_shard *shard = (struct tnk_fwd_shard *)mrb_calloc(mrb, 1, sizeof(*shard));
+  shard->idx = idx;
+  shard->gen = pair->gen;
+  shard->hidraw_fd = hidraw_fd;
+  shard->hidg_fd = hidg_fd;
+  shard->report_len = (uint32_t)report_len;
+  shard->mode = m;
+  shard->stop_fd = shard->snap_fd = shard->snapped_fd = -1;
+  fwd->shards[idx] = shard;
+  if (id_map) {
+    shard->id_map = (uint8_t *)mrb_malloc(mrb, 256);
+    memcpy(shard->id_map, id_map, 256);
+  }
+}
+
+static mrb_value
+tnk_forwarder_add(mrb_state *mrb, mrb_value self)
+{
+  struct tnk_forwarder *fwd = (struct tnk_forwarder *)mrb_data_get_ptr(mrb, self, &tnk_forwarder_type);
+  mrb_value hidraw, hidg;
+  mrb_int report_len;
+  mrb_sym mode = MRB_SYM(auto);
+  const char *id_map = NULL;
+  mrb_int id_map_len = 0;
+  mrb_get_args(mrb, "ooi|ns!", &hidraw, &hidg, &report_len, &mode, &id_map, &id_map_len);
+  if (id_map && id_map_len != 256) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "id map must have 256 entries");
+  }
+
+  int hidraw_fd = tnk_io_fileno(mrb, hidraw);
+  int hidg_fd = tnk_io_fileno(mrb, hidg);
+  if (fwd->sharded) {
+    tnk_fwd_add_shard(mrb, fwd, hidraw_fd, hidg_fd, report_len, mode, (const uint8_t *)id_map);
+  } else {
+    tnk_fwd_add_pair(mrb, fwd, hidraw_fd, hidg_fd, report_len, mode, false, (const uint8_t *)id_map);
+  }
+
+  /* keep the IO objects alive for as long as we use their descriptors */
+  mrb_value ios = mrb_iv_get(mrb, self, MRB_IVSYM(ios));
+  mrb_ary_push(mrb, ios, hidraw);
+  mrb_ary_push(mrb, ios, hidg);
+
+  return self;
+}
+
+static int
+tnk_fwd_add_evdev(struct tnk_forwarder *fwd, int fd)
+{
+  for (uint32_t i = 0; i < TNK_FWD_MAX_EVDEV; i++) {
+    struct tnk_fwd_evdev *ev = &fwd->evdevs[i];
+    if (ev->used) continue;
+    memset(ev, 0, sizeof(*ev));
+    ev->used = true;
+    ev->fd = fd;
+    return (int)i;
+  }
+  return -1;
+}
+
+static void
+tnk_fwd_arm_evdev(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_evdev *ev = &fwd->evdevs[idx];
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_read(sqe, ev->fd, ev->buf, sizeof(ev->buf), (uint64_t)-1);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_EVDEV, idx, 0));
+  ev->reading = true;
+}
+
+/* Forwarder#evdev_sinks(keyboard_hidg, mouse_hidg): where evdev input goes */
+static mrb_value
+tnk_forwarder_evdev_sinks(mrb_state *mrb, mrb_value self)
+{
+  struct tnk_forwarder *fwd = (struct tnk_forwarder *)mrb_data_get_ptr(mrb, self, &tnk_forwarder_type);
+  mrb_value keyboard, mouse;
+  mrb_get_args(mrb, "oo", &keyboard, &mouse);
+  if (fwd->sinks.keyboard >= 0 || fwd->sinks.mouse >= 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "evdev sinks already set");
+  }
+
+  /* sinks never read, the hidg node stands in for the hidraw one */
+  int kfd = tnk_io_fileno(mrb, keyboard);
+  int mfd = tnk_io_fileno(mrb, mouse);
+  fwd->sinks.keyboard = (int)tnk_fwd_add_pair(mrb, fwd, kfd, kfd, TNK_TYPE_REPORT_LEN, MRB_SYM(single), false, NULL);
+  fwd->pairs[fwd->sinks.keyboard].mode = TNK_FWD_MODE_SINK;
+  fwd->sinks.mouse = (int)tnk_fwd_add_pair(mrb, fwd, mfd, mfd, TNK_FWD_MOUSE_LEN, MRB_SYM(single), false, NULL);
+  fwd->pairs[fwd->sinks.mouse].mode = TNK_FWD_MODE_SINK;
+
+  mrb_value ios = mrb_iv_get(mrb, self, MRB_IVSYM(ios));
+  mrb_ary_push(mrb, ios, keyboard);
+  mrb_ary_push(mrb, ios, mouse);
+  return self;
+}
+
+/* Forwarder#add_evdev(event_io) */
+static mrb_value
+tnk_forwarder_add_evdev(mrb_state *mrb, mrb_value self)
+{
+  struct tnk_forwarder *fwd = (struct tnk_forwarder *)mrb_data_get_ptr(mrb, self, &tnk_forwarder_type);
+  mrb_value io;
+  mrb_get_args(mrb, "o", &io);
+
+  int fd = dup(tnk_io_fileno(mrb, io));
+  if (fd == -1) mrb_sys_fail(mrb, "dup(evdev)");
+  if (tnk_fwd_add_evdev(fwd, fd) < 0) {
+    close(fd);
+    mrb_raise(mrb, E_RANGE_ERROR, "too many input devices");
+  }
+  return self;
+}
+
+static void
+tnk_fwd_pair_gone(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  pair->dead = true;
+  pair->reading = false;
+  if (pair->inflight == 0) {
+    tnk_fwd_release_pair(mrb, fwd, idx);
+  }
+}
+
+static void
+tnk_fwd_arm_control(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_poll_multishot(sqe, tnk_control_fd, POLLIN);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_CONTROL, 0, 0));
+  fwd->control_armed = true;
+}
+
+/* Resident set of the worker, 0 if /proc isn't there. */
+static uint64_t
+tnk_fwd_rss_kb(void)
+{
+  unsigned long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "re");
+  if (f) {
+    if (fscanf(f, "%*u %lu", &pages) != 1) pages = 0;
+    fclose(f);
+  }
+  return (uint64_t)pages * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+static void
+tnk_fwd_print_hist(FILE *fp, const char *name, const struct tnk_hist *h)
+{
+  fprintf(fp, "  %s_us n %" PRIu64 " mean %.1f p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+          name, h->count, h->count ? (double)h->sum / (double)h->count / 1000.0 : 0.0,
+          (double)tnk_hist_quantile(h, 0.5) / 1000.0,
+          (double)tnk_hist_quantile(h, 0.99) / 1000.0,
+          (double)tnk_hist_quantile(h, 0.999) / 1000.0,
+          (double)h->max / 1000.0);
+}
+
+static void
+tnk_fwd_arm_snap(struct tnk_forwarder *fwd)
+{
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(NULL, fwd);
+  io_uring_prep_read(sqe, fwd_shard->snap_fd, &fwd_shard->snap_count, sizeof(fwd_shard->snap_count),
+                     (uint64_t)-1);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_SNAP, 0, 0));
+}
+
+/* Shard: copies the counters for tnk_fwd_dump_stats() on the forwarder's
+ * thread, which waits for them. */
+static void
+tnk_fwd_handle_snap(struct tnk_forwarder *fwd, struct io_uring_cqe *cqe)
+{
+  if (cqe->res < 0 && cqe->res != -EINTR) {
+    errno = -cqe->res;
+    tnk_fwd_sys_fail(NULL, "read(shard eventfd)");
+  }
+  struct tnk_fwd_shard *shard = fwd_shard;
+  if (cqe->res > 0) {
+    shard->snap_pair = fwd->pairs[shard->idx];
+    shard->snap_wakeups = fwd->wakeups;
+    shard->snap_cqes = fwd->cqes;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(shard->snapped_fd, &one, sizeof(one)) < 0) {
+      tnk_fwd_sys_fail(NULL, "write(shard eventfd)");
+    }
+  }
+  tnk_fwd_arm_snap(fwd);
+}
+
+/* Forwarder: has the shard copy its counters into snap_pair and friends,
+ * false if it doesn't within 100 ms. It isn't asked again then, a late
+ * copy would race with the next. */
+static bool
+tnk_fwd_snapshot(struct tnk_fwd_shard *shard)
+{
+  if (shard->stalled) return false;
+  uint64_t one = 1;
+  struct pollfd pfd = { .fd = shard->snapped_fd, .events = POLLIN };
+  if (write(shard->snap_fd, &one, sizeof(one)) < 0 || poll(&pfd, 1, 100) != 1 ||
+      read(shard->snapped_fd, &one, sizeof(one)) < 0) {
+    shard->stalled = true;
+    return false;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return true;
+}
+
+/* Forwarder: the shard eventfd was written, raises what failed. */
+mrb_noreturn static void
+tnk_fwd_shard_failed(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < TNK_FWD_MAX_PAIRS; i++) {
+    const struct tnk_fwd_shard *shard = fwd->shards[i];
+    if (!shard || !shard->started || !shard->what) continue;
+    char what[64];
+    snprintf(what, sizeof(what), "shard %" PRIu32 ": %s", shard->idx, shard->what);
+    errno = shard->err;
+    mrb_sys_fail(mrb, what);
+  }
+  mrb_raise(mrb, E_RUNTIME_ERROR, "a forwarding shard failed");
+}
+
+/* Writes the statistics to fd as "key value" lines and closes it. */
+static void
+tnk_fwd_dump_stats(const struct tnk_forwarder *fwd, int fd)
+{
+  static const char *const mode_names[] = {
+    [TNK_FWD_MODE_SINGLE] = "single",
+    [TNK_FWD_MODE_LINKED] = "linked",
+    [TNK_FWD_MODE_MULTISHOT] = "multishot",
+    [TNK_FWD_MODE_SINK] = "sink",
+    [TNK_FWD_MODE_SHARD] = "shard",
+  };
+  FILE *fp = fdopen(fd, "w");
+  if (!fp) {
+    perror("forwarder: stats");
+    close(fd);
+    return;
+  }
+
+  fprintf(fp, "uptime_s %.3f\n", (double)(tnk_now_ns() - fwd->started_ns) / 1e9);
+  if (tnk_rt.cpu >= 0) {
+    fprintf(fp, "realtime cpu %d pinned %d fifo %d locked %d sqpoll %d\n", tnk_rt.cpu, tnk_rt.pinned,
+            tnk_rt.fifo ? tnk_rt.prio : 0, tnk_rt.locked, (fwd->ring.flags & IORING_SETUP_SQPOLL) != 0);
+  } else {
+    fprintf(fp, "realtime off\n");
+  }
+  struct tnk_vm_stats vs;
+  tnk_vm_stats(&vs);
+  fprintf(fp, "wakeups %" PRIu64 " cqes %" PRIu64 " reloads %" PRIu64 "\n", fwd->wakeups, fwd->cqes,
+          vs.reloads);
+  fprintf(fp, "vm_events %" PRIu64 " vm_events_dropped %" PRIu64 "\n", vs.events, vs.dropped);
+  struct tnk_arena_stats as;
+  tnk_arena_stats(&as);
+  fprintf(fp, "rss_kb %" PRIu64 " user_mem_kb %" PRIu64 " user_mem_peak_kb %" PRIu64 " user_mem_cap_kb %" PRIu64
+          "\n", tnk_fwd_rss_kb(), as.used / 1024, as.peak / 1024, as.cap / 1024);
+  fprintf(fp, "user_objects %" PRIu64 " user_allocs %" PRIu64 " user_frees %" PRIu64 " user_allocs_failed %" PRIu64
+          "\n", vs.objects, as.allocs, as.frees, as.failed);
+  fprintf(fp, "results_used %" PRIu32 " results_dropped %" PRIu32 "\n",
+          __atomic_load_n(&fwd->results.tail, __ATOMIC_RELAXED) - fwd->results.head,
+          __atomic_load_n(&fwd->results.dropped, __ATOMIC_RELAXED));
+  fprintf(fp, "inject_clients %" PRIu64 " inject_frames %" PRIu64 " inject_refused %" PRIu64
+          " inject_acks %" PRIu64 " inject_parked %" PRIu32 "\n", fwd->inject.clients, fwd->inject.frames,
+          fwd->inject.refused, fwd->inject.acks, fwd->parked);
+  for (uint32_t i = 0; i < fwd->npairs; i++) {
+    const struct tnk_fwd_pair *pair = &fwd->pairs[i];
+    struct tnk_fwd_shard *shard = pair->mode == TNK_FWD_MODE_SHARD ? fwd->shards[i] : NULL;
+    if (shard) {
+      if (!shard->started || shard->stopped) continue;
+      if (!tnk_fwd_snapshot(shard)) {
+        fprintf(fp, "pair %" PRIu32 " mode shard stalled\n", i);
+        continue;
+      }
+      pair = &shard->snap_pair;
+    }
+    if (!pair->used) continue;
+    const struct tnk_fwd_stats *st = &pair->stats;
+    fprintf(fp, "pair %" PRIu32 " mode %s%s%s\n", i, mode_names[pair->mode], shard ? " shard" : "",
+            pair->dead ? " dead" : "");
+    if (shard) {
+      fprintf(fp, "  shard_cpu %d shard_wakeups %" PRIu64 " shard_cqes %" PRIu64 "\n", shard->cpu,
+              shard->snap_wakeups, shard->snap_cqes);
+    }
+    fprintf(fp, "  reports %" PRIu64 " bytes %" PRIu64 " dropped %" PRIu64 " hotkeys %" PRIu64 "\n",
+            st->reports, st->bytes, st->dropped, st->hotkeys);
+    fprintf(fp, "  inflight %" PRIu32 " inflight_max %" PRIu32 " out_queue %" PRIu32 " out_queue_max %" PRIu32 "\n",
+            pair->inflight, st->inflight_max, pair->out.qtail - pair->out.qhead, st->out_queue_max);
+    fprintf(fp, "  queue %" PRIu32 " queue_max %" PRIu32 " held %" PRIu32 " coalesced %" PRIu64 "\n",
+            pair->qcount, st->queue_max, pair->hcount, st->coalesced);
+    tnk_fwd_print_hist(fp, "forward", &st->forward);
+    tnk_fwd_print_hist(fp, "hotkey", &st->hotkey);
+  }
+  if (fclose(fp) != 0) {
+    perror("forwarder: stats");
+  }
+}
+
+/* Returns false once the root process hung up. */
+static bool
+tnk_fwd_handle_control(mrb_state *mrb, struct tnk_forwarder *fwd, struct io_uring_cqe *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    fwd->control_armed = false;
+  }
+  if (cqe->res < 0) {
+    errno = -cqe->res;
+    mrb_sys_fail(mrb, "poll(control)");
+  }
+
+  struct tnk_control_msg msg;
+  int fds[2];
+  int ret;
+  while ((ret = tnk_control_recv(tnk_control_fd, &msg, fds)) > 0) {
+    if (msg.type == TNK_CONTROL_DUMP_STATS && fds[0] >= 0) {
+      if (fds[1] >= 0) close(fds[1]);
+      tnk_fwd_dump_stats(fwd, fds[0]);
+      continue;
+    }
+    if (msg.type == TNK_CONTROL_ADD_EVDEV && fds[0] >= 0) {
+      if (fds[1] >= 0) close(fds[1]);
+      int ev = tnk_fwd_add_evdev(fwd, fds[0]);
+      if (ev < 0) {
+        fprintf(stderr, "forwarder: dropping hotplugged input device\n");
+        close(fds[0]);
+      } else {
+        tnk_fwd_arm_evdev(mrb, fwd, (uint32_t)ev);
+      }
+      continue;
+    }
+    if (msg.type != TNK_CONTROL_ADD_PAIR || fds[0] < 0 || fds[1] < 0) {
+      if (fds[0] >= 0) close(fds[0]);
+      if (fds[1] >= 0) close(fds[1]);
+      continue;
+    }
+    if (tnk_fwd_free_pair_slot(fwd) < 0 || msg.report_len == 0 || msg.report_len > 4096) {
+      fprintf(stderr, "forwarder: dropping hotplugged pair\n");
+      close(fds[0]);
+      close(fds[1]);
+      continue;
+    }
+    bool mapped = false;
+    for (uint32_t i = 0; i < sizeof(msg.id_map); i++) {
+      mapped |= msg.id_map[i] != 0;
+    }
+    uint32_t idx = tnk_fwd_add_pair(mrb, fwd, fds[0], fds[1], msg.report_len, MRB_SYM(auto), true,
+                                    mapped ? msg.id_map : NULL);
+    tnk_fwd_arm_read(mrb, fwd, idx);
+  }
+  if (ret < 0) {
+    return false;
+  }
+
+  if (!fwd->control_armed) {
+    tnk_fwd_arm_control(mrb, fwd);
+  }
+  return true;
+}
+
+/* Frees an injection client, or shuts it down for its read to complete. */
+static void
+tnk_fwd_client_close(struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_client *c = &fwd->clients[idx];
+  if (c->reading) {
+    shutdown(c->fd, SHUT_RDWR);
+    c->closing = true;
+    return;
+  }
+  if (c->parked) fwd->parked--;
+  close(c->fd);
+  memset(c, 0, sizeof(*c));
+}
+
+static void
+tnk_fwd_ack(struct tnk_forwarder *fwd, uint32_t idx, uint32_t gen, uint32_t seq, int32_t status)
+{
+  if (idx >= TNK_FWD_CLIENTS) return;
+  struct tnk_fwd_client *c = &fwd->clients[idx];
+  if (!c->used || c->closing || c->gen != gen) return;
+
+  struct tnk_inject_ack ack = { .seq = seq, .status = status };
+  if (send(c->fd, &ack, sizeof(ack), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)sizeof(ack)) {
+    /* gone, or not reading its acks */
+    tnk_fwd_client_close(fwd, idx);
+    return;
+  }
+  fwd->inject.acks++;
+}
+
+/* Returns false if the report was dropped instead, see tnk_fwd_unmapped(). */
+static bool
+tnk_fwd_output_write(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx,
+                     const uint8_t *buf, uint32_t len, uint32_t pace_us)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  struct tnk_fwd_output *out = &pair->out;
+  if (tnk_fwd_unmapped(pair, buf, len)) {
+    pair->stats.dropped++;
+    return false;
+  }
+
+  /* the write and its pause must land in the same submission */
+  if (pace_us && io_uring_sq_space_left(&fwd->ring) < 2) {
+    io_uring_submit(&fwd->ring);
+  }
+  buf = tnk_fwd_map_report(pair, buf, &len, pair->mbuf + pair->buf_len + 1);
+  tnk_fwd_capture(pair, idx, TNK_CAPTURE_OUT, buf, len);
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_write(sqe, pair->hidg_fd, buf, len, (uint64_t)-1);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_OUTPUT, idx, 0));
+  out->pending++;
+  tnk_fwd_inflight_inc(pair);
+
+  if (pace_us) {
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    out->ts.tv_sec = pace_us / 1000000;
+    out->ts.tv_nsec = (long long)(pace_us % 1000000) * 1000;
+    sqe = tnk_fwd_get_sqe(mrb, fwd);
+    io_uring_prep_timeout(sqe, &out->ts, 0, 0);
+    io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_OUTPUT, idx, 0));
+    out->pending++;
+    tnk_fwd_inflight_inc(pair);
+  }
+  return true;
+}
+
+static void
+tnk_fwd_output_pause(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx, uint32_t ms)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  struct tnk_fwd_output *out = &pair->out;
+
+  out->ts.tv_sec = ms / 1000;
+  out->ts.tv_nsec = (long long)(ms % 1000) * 1000000;
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_timeout(sqe, &out->ts, 0, 0);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_OUTPUT, idx, 0));
+  out->pending++;
+  tnk_fwd_inflight_inc(pair);
+}
+
+/* Cancels the armed chain of a linked pair so hotkey output can have its
+ * hidg. The chain's write completes either way and starts the output. */
+static void
+tnk_fwd_unchain(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_output *out = &fwd->pairs[idx].out;
+  if (out->unchaining) return;
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_cancel64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_READ, idx, 0), 0);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_UNCHAIN, idx, 0));
+  out->unchaining = true;
+}
+
+/* Starts the next output operation of a pair, unless one is still running.
+ * Output and forwarded reports take turns on the hidg: an entry only starts
+ * once no forwarded write is in flight, and nothing is forwarded while one
+ * plays, or a report could overtake a retried write on the O_NONBLOCK hidg
+ * or land in the middle of typed text. The pair is idle again once cur is
+ * NULL, see tnk_fwd_writes_resume(). */
+static void
+tnk_fwd_output_step(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  struct tnk_fwd_output *out = &pair->out;
+
+  while (out->pending == 0) {
+    if (!out->cur) {
+      if (out->qhead == out->qtail || pair->writing) return;
+      if (pair->mode == TNK_FWD_MODE_LINKED && pair->reading) {
+        tnk_fwd_unchain(mrb, fwd, idx);
+        return;
+      }
+      out->cur = out->queue[out->qhead++ % TNK_FWD_OUT_QUEUE];
+      out->pos = 0;
+      out->key_down = false;
+    }
+
+    struct tnk_result *r = out->cur;
+    switch (r->type) {
+      case TNK_RESULT_REPORT:
+        if (out->pos++ == 0 && tnk_fwd_output_write(mrb, fwd, idx, r->data, r->len, 0)) {
+          return;
+        }
+        break;
+      case TNK_RESULT_TEXT:
+        if (tnk_type_next(r->data, r->len, &out->pos, &out->key_down, out->report)) {
+          if (tnk_fwd_output_write(mrb, fwd, idx, out->report, sizeof(out->report), (uint32_t)r->value)) {
+            return;
+          }
+          continue;
+        }
+        break;
+      case TNK_RESULT_INTEGER:
+        if (out->pos++ == 0 && r->value > 0) {
+          tnk_fwd_output_pause(mrb, fwd, idx, (uint32_t)r->value);
+          return;
+        }
+        break;
+      case TNK_RESULT_ACK: {
+        uint32_t client[2];
+        memcpy(client, r->data, sizeof(client));
+        tnk_fwd_ack(fwd, client[0], client[1], (uint32_t)r->value, 0);
+      } break;
+      default:
+        break;
+    }
+    tnk_fwd_release_result(fwd, r);
+    out->cur = NULL;
+  }
+}
+
+/* Keyboard usages held down according to report, false if it carries no
+ * keyboard state (a mouse report of a composite device) or signals rollover. */
+static bool
+tnk_fwd_pressed_keys(const struct tnk_hid_layout *layout, const uint8_t *report, size_t len,
+                     uint64_t pressed[TNK_HOTKEY_WORDS])
+{
+  memset(pressed, 0, sizeof(uint64_t) * TNK_HOTKEY_WORDS);
+  if (!layout) {
+    if (len != TNK_TYPE_REPORT_LEN) return false;
+    for (uint32_t bit = 0; bit < 8; bit++) {
+      if (report[0] & (1u << bit)) tnk_hotkey_set(pressed, 0xE0 + bit);
+    }
+    for (uint32_t i = 2; i < TNK_TYPE_REPORT_LEN; i++) {
+      if (report[i] == 0x01) return false;
+      if (report[i] >= 0x04) tnk_hotkey_set(pressed, report[i]);
+    }
+    return true;
+  }
+
+  uint32_t off = layout->has_report_ids ? 1 : 0;
+  if (len <= off) return false;
+  const struct tnk_hid_report *r = tnk_hid_report_by_id(layout, off ? report[0] : 0);
+  if (!r) return false;
+  const uint8_t *payload = report + off;
+  size_t plen = len - off;
+  bool keyboard = false;
+
+  for (uint32_t f = r->first_field; f < (uint32_t)r->first_field + r->nfields; f++) {
+    const struct tnk_hid_field *field = &layout->fields[f];
+    if (field->type != TNK_HID_INPUT) continue;
+    for (uint32_t i = 0; i < field->count; i++) {
+      uint32_t usage;
+      if (field->flags & TNK_HID_FIELD_VARIABLE) {
+        usage = tnk_hid_field_usage(layout, field, i);
+        if (TNK_HID_USAGE_PAGE(usage) != TNK_HID_PAGE_KEYBOARD) continue;
+        keyboard = true;
+        if (!tnk_hid_field_raw(field, payload, plen, i)) continue;
+      } else {
+        /* array: the value picks the usage */
+        int32_t v = tnk_hid_field_value(field, payload, plen, i);
+        if (v < field->logical_min || v > field->logical_max) continue;
+        usage = tnk_hid_field_usage(layout, field, (uint32_t)(v - field->logical_min));
+        if (TNK_HID_USAGE_PAGE(usage) != TNK_HID_PAGE_KEYBOARD) continue;
+        keyboard = true;
+        if (TNK_HID_USAGE_ID(usage) == 0x01) return false; /* ErrorRollOver */
+        if (TNK_HID_USAGE_ID(usage) < 0x04) continue;
+      }
+      tnk_hotkey_set(pressed, TNK_HID_USAGE_ID(usage));
+    }
+  }
+  return keyboard;
+}
+
+/* Posts the keys held according to report to the user VM thread if they
+ * changed. A post that finds the ring full is retried with the next report. */
+static void
+tnk_fwd_dispatch(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx,
+                 const uint8_t *report, size_t len)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  uint64_t pressed[TNK_HOTKEY_WORDS];
+  if (!fwd->vm_running || !tnk_fwd_pressed_keys(pair->layout, report, len, pressed) ||
+      memcmp(pressed, pair->hotkey_keys, sizeof(pressed)) == 0) {
+    return;
+  }
+  if (tnk_vm_post(idx, pair->gen, pressed, (uint32_t)len)) {
+    memcpy(pair->hotkey_keys, pressed, sizeof(pressed));
+    fwd->vm_kick = true;
+  }
+}
+
+static void
+tnk_fwd_arm_results(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_read(sqe, fwd->vm_fds[1], &fwd->vm_count, sizeof(fwd->vm_count), (uint64_t)-1);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_RESULTS, 0, 0));
+}
+
+/* Whether typed text, boot keyboard reports, can go out on the hidg of a
+ * pair: one without report IDs whose input report is laid out like the
+ * boot keyboard's, modifier bits first and a key array from the third byte. */
+static bool
+tnk_fwd_types_text(const struct tnk_forwarder *fwd, uint32_t idx)
+{
+  const struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  if ((int)idx == fwd->sinks.keyboard) return true;
+  if (pair->id_map || pair->mode == TNK_FWD_MODE_SINK) return false;
+  /* linked chains carry no layout, their buffer is exactly one report */
+  if (!pair->layout) return pair->mode == TNK_FWD_MODE_LINKED && pair->buf_len == TNK_TYPE_REPORT_LEN;
+
+  const struct tnk_hid_layout *layout = pair->layout;
+  const struct tnk_hid_report *r = tnk_hid_report_by_id(layout, 0);
+  if (layout->has_report_ids || tnk_hid_report_len(layout, r, TNK_HID_INPUT) != TNK_TYPE_REPORT_LEN) {
+    return false;
+  }
+  bool modifiers = false, keys = false;
+  for (uint32_t f = r->first_field; f < (uint32_t)r->first_field + r->nfields; f++) {
+    const struct tnk_hid_field *field = &layout->fields[f];
+    uint32_t usage = tnk_hid_field_usage(layout, field, 0);
+    if (field->type != TNK_HID_INPUT || TNK_HID_USAGE_PAGE(usage) != TNK_HID_PAGE_KEYBOARD) continue;
+    if (field->bit_offset == 0 && field->bit_size == 1 && field->count == 8 &&
+        (field->flags & TNK_HID_FIELD_VARIABLE) && usage == TNK_HID_USAGE(TNK_HID_PAGE_KEYBOARD, 0xE0)) {
+      modifiers = true;
+    } else if (field->bit_offset == 16 && field->bit_size == 8 && field->count == TNK_TYPE_REPORT_LEN - 2 &&
+               !(field->flags & TNK_HID_FIELD_VARIABLE)) {
+      keys = true;
+    }
+  }
+  return modifiers && keys;
+}
+
+/* Queues what hotkey blocks returned for the hidg of the pair they ran for.
+ * Typed text goes to the evdev keyboard sink if that hidg can't take it. */
+static void
+tnk_fwd_handle_results(mrb_state *mrb, struct tnk_forwarder *fwd, struct io_uring_cqe *cqe)
+{
+  if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+    errno = -cqe->res;
+    tnk_fwd_sys_fail(mrb, "read(user vm eventfd)");
+  }
+
+  struct tnk_result *r;
+  while ((r = tnk_result_next(&fwd->results))) {
+    struct tnk_fwd_pair *pair = &fwd->pairs[r->pair];
+    if (!pair->used || pair->dead || pair->gen != r->gen) {
+      tnk_result_release(&fwd->results, r);
+      continue;
+    }
+    if (r->type == TNK_RESULT_RAN) {
+      uint64_t ns;
+      memcpy(&ns, r->data, sizeof(ns));
+      pair->stats.hotkeys++;
+      tnk_hist_add(&pair->stats.hotkey, ns);
+      tnk_result_release(&fwd->results, r);
+      continue;
+    }
+
+    uint32_t idx = r->pair;
+    if (r->type == TNK_RESULT_TEXT && !tnk_fwd_types_text(fwd, idx)) {
+      if (fwd->sinks.keyboard < 0) {
+        fprintf(stderr, "forwarder: typed text needs a boot keyboard hidg, dropping it\n");
+        tnk_result_release(&fwd->results, r);
+        continue;
+      }
+      idx = (uint32_t)fwd->sinks.keyboard;
+      pair = &fwd->pairs[idx];
+    }
+
+    struct tnk_fwd_output *out = &pair->out;
+    if (out->qtail - out->qhead == TNK_FWD_OUT_QUEUE) {
+      fprintf(stderr, "forwarder: hotkey output queue full, dropping result\n");
+      tnk_result_release(&fwd->results, r);
+      continue;
+    }
+    out->queue[out->qtail++ % TNK_FWD_OUT_QUEUE] = r;
+    if (out->qtail - out->qhead > pair->stats.out_queue_max) {
+      pair->stats.out_queue_max = out->qtail - out->qhead;
+    }
+    tnk_fwd_output_step(mrb, fwd, idx);
+  }
+  tnk_fwd_arm_results(mrb, fwd);
+}
+
+/* ---- injection ---- */
+
+static void
+tnk_fwd_arm_accept(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t listener)
+{
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_accept(sqe, tnk_inject_fds[listener], NULL, NULL, SOCK_CLOEXEC);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_ACCEPT, listener, 0));
+}
+
+static void
+tnk_fwd_arm_inject(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_client *c = &fwd->clients[idx];
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_recv(sqe, c->fd, c->buf + c->fill, sizeof(c->buf) - c->fill, 0);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_INJECT, idx, 0));
+  c->reading = true;
+}
+
+/* Queues a frame to its target, or refuses it. Returns false if it has to
+ * wait for the output to drain. */
+static bool
+tnk_fwd_inject_frame(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx,
+                     const struct tnk_inject_frame *frame, const uint8_t *payload)
+{
+  struct tnk_fwd_client *c = &fwd->clients[idx];
+  int target = -1;
+  uint32_t report_len = 0;
+  if (frame->target == TNK_INJECT_KEYBOARD) {
+    target = fwd->sinks.keyboard;
+    report_len = TNK_TYPE_REPORT_LEN;
+  } else if (frame->target == TNK_INJECT_MOUSE) {
+    target = fwd->sinks.mouse;
+    report_len = TNK_FWD_MOUSE_LEN;
+  }
+  int n = target < 0 ? -ENODEV : tnk_inject_check(payload, frame->len, report_len);
+  if (n < 0) {
+    fwd->inject.refused++;
+    tnk_fwd_ack(fwd, idx, c->gen, frame->seq, n);
+    return true;
+  }
+
+  struct tnk_fwd_pair *pair = &fwd->pairs[target];
+  struct tnk_fwd_output *out = &pair->out;
+  if (TNK_FWD_OUT_QUEUE - (out->qtail - out->qhead) < (uint32_t)n + 1) return false;
+
+  /* a frame always fits into the empty ring, it only waits for entries of
+   * earlier ones to be released */
+  fwd->injected.pair = (uint32_t)target;
+  fwd->injected.gen = pair->gen;
+  uint32_t tail = fwd->injected.tail;
+  if (!tnk_inject_append(payload, frame->len, &fwd->injected)) return false;
+  uint32_t who[2] = { idx, c->gen };
+  struct tnk_result *ack = tnk_result_reserve(&fwd->injected, TNK_RESULT_ACK, sizeof(who));
+  if (!ack) {
+    fwd->injected.tail = tail;
+    return false;
+  }
+  ack->value = (int32_t)frame->seq;
+  memcpy(ack->data, who, sizeof(who));
+  tnk_result_commit(&fwd->injected, ack);
+
+  struct tnk_result *r;
+  while ((r = tnk_result_next(&fwd->injected))) {
+    out->queue[out->qtail++ % TNK_FWD_OUT_QUEUE] = r;
+  }
+  if (out->qtail - out->qhead > pair->stats.out_queue_max) {
+    pair->stats.out_queue_max = out->qtail - out->qhead;
+  }
+  fwd->inject.frames++;
+  tnk_fwd_output_step(mrb, fwd, (uint32_t)target);
+  return true;
+}
+
+/* Queues the complete frames a client sent. Returns false if one has to wait
+ * for room, or the client was dropped. */
+static bool
+tnk_fwd_inject_drain(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_client *c = &fwd->clients[idx];
+  uint32_t off = 0;
+  bool done = true;
+  while (c->fill - off >= sizeof(struct tnk_inject_frame)) {
+    struct tnk_inject_frame frame;
+    memcpy(&frame, c->buf + off, sizeof(frame));
+    if (frame.len > TNK_INJECT_PAYLOAD_MAX) {
+      fprintf(stderr, "forwarder: injection frame too large, dropping client\n");
+      tnk_fwd_client_close(fwd, idx);
+      return false;
+    }
+    if (c->fill - off - sizeof(frame) < frame.len) break;
+    if (!c->authed) {
+      bool ok = frame.target == TNK_INJECT_AUTH && tnk_inject_token_ok(c->buf + off + sizeof(frame), frame.len);
+      tnk_fwd_ack(fwd, idx, c->gen, frame.seq, ok ? 0 : -EACCES);
+      if (!ok) {
+        fwd->inject.refused++;
+        tnk_fwd_client_close(fwd, idx);
+        return false;
+      }
+      if (!c->used || c->closing) return false;
+      c->authed = true;
+      off += (uint32_t)sizeof(frame) + frame.len;
+      continue;
+    }
+    if (!tnk_fwd_inject_frame(mrb, fwd, idx, &frame, c->buf + off + sizeof(frame))) {
+      done = false;
+      break;
+    }
+    if (!c->used || c->closing) return false;
+    off += (uint32_t)sizeof(frame) + frame.len;
+  }
+  memmove(c->buf, c->buf + off, c->fill - off);
+  c->fill -= off;
+  return done;
+}
+
+static void
+tnk_fwd_inject_park(struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_client *c = &fwd->clients[idx];
+  if (c->used && !c->closing && !c->parked) {
+    c->parked = true;
+    fwd->parked++;
+  }
+}
+
+/* Output went out, parked clients may fit their frame now. */
+static void
+tnk_fwd_inject_resume(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  for (uint32_t i = 0; i < TNK_FWD_CLIENTS && fwd->parked; i++) {
+    struct tnk_fwd_client *c = &fwd->clients[i];
+    if (!c->parked) continue;
+    c->parked = false;
+    fwd->parked--;
+    if (tnk_fwd_inject_drain(mrb, fwd, i)) {
+      tnk_fwd_arm_inject(mrb, fwd, i);
+    } else {
+      tnk_fwd_inject_park(fwd, i);
+    }
+  }
+}
+
+static void
+tnk_fwd_handle_accept(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t listener,
+                      struct io_uring_cqe *cqe)
+{
+  if (cqe->res < 0) {
+    if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN) {
+      /* out of fds and the like, retrying right away would spin */
+      fprintf(stderr, "forwarder: accept(inject): %s, no more injection clients\n", strerror(-cqe->res));
+      return;
+    }
+    tnk_fwd_arm_accept(mrb, fwd, listener);
+    return;
+  }
+
+  int fd = cqe->res;
+  uint32_t idx = 0;
+  while (idx < TNK_FWD_CLIENTS && fwd->clients[idx].used) idx++;
+  if (idx == TNK_FWD_CLIENTS) {
+    fprintf(stderr, "forwarder: too many injection clients\n");
+    close(fd);
+  } else {
+    struct tnk_fwd_client *c = &fwd->clients[idx];
+    memset(c, 0, sizeof(*c));
+    c->used = true;
+    c->fd = fd;
+    c->gen = ++fwd->next_client_gen;
+    c->authed = listener == 0;
+    if (listener == 1) {
+      /* acks are tiny and the client waits for them */
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fwd->inject.clients++;
+    tnk_fwd_arm_inject(mrb, fwd, idx);
+  }
+  tnk_fwd_arm_accept(mrb, fwd, listener);
+}
+
+static void
+tnk_fwd_handle_inject(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx,
+                      struct io_uring_cqe *cqe)
+{
+  struct tnk_fwd_client *c = &fwd->clients[idx];
+  c->reading = false;
+  if (c->closing || cqe->res <= 0) {
+    tnk_fwd_client_close(fwd, idx);
+    return;
+  }
+
+  c->fill += (uint32_t)cqe->res;
+  if (tnk_fwd_inject_drain(mrb, fwd, idx)) {
+    tnk_fwd_arm_inject(mrb, fwd, idx);
+  } else {
+    tnk_fwd_inject_park(fwd, idx);
+  }
+}
+
+static void
+tnk_fwd_handle_multishot(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx,
+                         struct io_uring_cqe *cqe)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    pair->reading = false;
+  }
+  if (cqe->res == -ENOBUFS) {
+    /* every buffer is waiting on a write, re-armed once one comes back */
+    return;
+  }
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return;
+  }
+
+  uint32_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  uint32_t len = (uint32_t)cqe->res;
+  const uint8_t *report = pair->bufs + (size_t)bid * pair->buf_len;
+  uint64_t now = tnk_now_ns();
+  tnk_fwd_capture(pair, idx, TNK_CAPTURE_IN, report, len);
+
+  /* held reports go first, or they would end up behind newer ones */
+  bool queued = pair->hcount == 0 && tnk_fwd_enqueue(mrb, fwd, idx, report, len, now);
+  if (!queued) {
+    pair->held[(pair->hhead + pair->hcount++) % TNK_FWD_BUF_RING] = bid;
+    pair->held_len[bid] = len;
+    pair->held_ns[bid] = now;
+  }
+  if (tnk_fwd_can_read(pair)) {
+    tnk_fwd_arm_read(mrb, fwd, idx);
+  }
+  tnk_fwd_dispatch(mrb, fwd, idx, report, len);
+  /* only now, a submission in dispatch may let the kernel refill it */
+  if (queued) {
+    tnk_fwd_recycle_buf(pair, bid);
+  }
+}
+
+static void
+tnk_fwd_handle_read(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx, struct io_uring_cqe *cqe)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+
+  if (cqe->res == -ECANCELED && pair->mode == TNK_FWD_MODE_LINKED) {
+    return; /* unchained for hotkey output, its write completes too */
+  }
+  if (cqe->res == -EIO || cqe->res == -ENODEV || cqe->res == 0) {
+    /* unplugged */
+    tnk_fwd_pair_gone(mrb, fwd, idx);
+    return;
+  }
+  if (cqe->res < 0 && !(cqe->res == -ENOBUFS && pair->mode == TNK_FWD_MODE_MULTISHOT)) {
+    errno = -cqe->res;
+    tnk_fwd_sys_fail(mrb, "read(hidraw)");
+  }
+
+  if (pair->mode == TNK_FWD_MODE_MULTISHOT) {
+    tnk_fwd_handle_multishot(mrb, fwd, idx, cqe);
+    return;
+  }
+
+  /* reads are only armed with room for one more report in the queue */
+  uint32_t len = (uint32_t)cqe->res;
+  tnk_fwd_capture(pair, idx, TNK_CAPTURE_IN, pair->rbuf, len);
+  tnk_fwd_enqueue(mrb, fwd, idx, pair->rbuf, len, tnk_now_ns());
+  tnk_fwd_dispatch(mrb, fwd, idx, pair->rbuf, len);
+  /* rbuf is free again once the re-armed read is submitted */
+  if (pair->mode == TNK_FWD_MODE_SINGLE) {
+    pair->reading = false;
+    if (tnk_fwd_can_read(pair)) {
+      tnk_fwd_arm_read(mrb, fwd, idx);
+    }
+  }
+}
+
+/* ---- evdev ---- */
+
+/* The report buffer of a sink pair, NULL while its write is in flight or
+ * hotkey output plays: a second write could overtake the first one on the
+ * O_NONBLOCK hidg when that one is retried after EAGAIN. */
+static uint8_t *
+tnk_fwd_sink_buf(struct tnk_forwarder *fwd, int idx)
+{
+  if (idx < 0) return NULL;
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  if (!pair->used || pair->dead || pair->writing || pair->out.cur) return NULL;
+  return pair->wbuf;
+}
+
+static void
+tnk_fwd_sink_write(mrb_state *mrb, struct tnk_forwarder *fwd, int idx, uint32_t len)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  tnk_fwd_capture(pair, (uint32_t)idx, TNK_CAPTURE_OUT, pair->wbuf, len);
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+  io_uring_prep_write(sqe, pair->hidg_fd, pair->wbuf, len, (uint64_t)-1);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_WRITE, (uint32_t)idx, 0));
+  pair->stats.read_ns[0] = tnk_now_ns();
+  tnk_fwd_inflight_inc(pair);
+  pair->writing = true;
+}
+
+/* Boot keyboard report of every key held on any evdev device. */
+static void
+tnk_fwd_keyboard_report(const struct tnk_forwarder *fwd, uint8_t report[TNK_TYPE_REPORT_LEN])
+{
+  uint32_t n = 0;
+  memset(report, 0, TNK_TYPE_REPORT_LEN);
+  for (uint32_t i = 0; i < TNK_FWD_MAX_EVDEV; i++) {
+    const struct tnk_fwd_evdev *ev = &fwd->evdevs[i];
+    if (!ev->used) continue;
+    for (uint32_t k = 0; k < ev->nkeys; k++) {
+      uint8_t hid = tnk_keycode_to_hid(ev->keys[k]);
+      if (hid >= 0xE0 && hid <= 0xE7) {
+        report[0] |= (uint8_t)(1u << (hid - 0xE0));
+        continue;
+      }
+      if (hid == 0 || memchr(report + 2, hid, n)) continue;
+      if (n == 6) {
+        /* phantom state, as the boot protocol wants it */
+        memset(report + 2, 0x01, 6);
+        continue;
+      }
+      report[2 + n++] = hid;
+    }
+  }
+}
+
+static int16_t
+tnk_fwd_take16(int32_t *v)
+{
+  int32_t d = *v < -32767 ? -32767 : *v > 32767 ? 32767 : *v;
+  *v -= d;
+  return (int16_t)d;
+}
+
+static int8_t
+tnk_fwd_take8(int32_t *v)
+{
+  int32_t d = *v < -127 ? -127 : *v > 127 ? 127 : *v;
+  *v -= d;
+  return (int8_t)d;
+}
+
+/* Sends what changed since the last reports to the sinks that aren't busy
+ * writing, the others get it once their write completes. */
+static void
+tnk_fwd_sinks_flush(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  struct tnk_fwd_sinks *sk = &fwd->sinks;
+  uint8_t *buf;
+
+  if (sk->keyboard_dirty && (buf = tnk_fwd_sink_buf(fwd, sk->keyboard))) {
+    tnk_fwd_keyboard_report(fwd, buf);
+    sk->keyboard_dirty = false;
+    if (memcmp(buf, sk->keyboard_sent, TNK_TYPE_REPORT_LEN) != 0) {
+      memcpy(sk->keyboard_sent, buf, TNK_TYPE_REPORT_LEN);
+      tnk_fwd_sink_write(mrb, fwd, sk->keyboard, TNK_TYPE_REPORT_LEN);
+      tnk_fwd_dispatch(mrb, fwd, (uint32_t)sk->keyboard, buf, TNK_TYPE_REPORT_LEN);
+    }
+  }
+
+  uint8_t buttons = 0;
+  for (uint32_t i = 0; i < TNK_FWD_MAX_EVDEV; i++) {
+    if (fwd->evdevs[i].used) buttons |= fwd->evdevs[i].buttons;
+  }
+  /* motion beyond what one report holds is left for the next */
+  if ((buttons != sk->buttons_sent || sk->dx || sk->dy || sk->wheel || sk->hwheel) &&
+      (buf = tnk_fwd_sink_buf(fwd, sk->mouse))) {
+    int16_t x = tnk_fwd_take16(&sk->dx);
+    int16_t y = tnk_fwd_take16(&sk->dy);
+    buf[0] = buttons;
+    buf[1] = (uint8_t)(x & 0xFF);
+    buf[2] = (uint8_t)((uint16_t)x >> 8);
+    buf[3] = (uint8_t)(y & 0xFF);
+    buf[4] = (uint8_t)((uint16_t)y >> 8);
+    buf[5] = (uint8_t)tnk_fwd_take8(&sk->wheel);
+    buf[6] = (uint8_t)tnk_fwd_take8(&sk->hwheel);
+    sk->buttons_sent = buttons;
+    tnk_fwd_sink_write(mrb, fwd, sk->mouse, TNK_FWD_MOUSE_LEN);
+  }
+  if (sk->mouse < 0) {
+    sk->dx = sk->dy = sk->wheel = sk->hwheel = 0;
+  }
+}
+
+/* Lets forwarded reports have the hidg again once hotkey output is done. */
+static void
+tnk_fwd_writes_resume(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  switch (pair->mode) {
+    case TNK_FWD_MODE_SINK:
+      tnk_fwd_sinks_flush(mrb, fwd);
+      break;
+    case TNK_FWD_MODE_LINKED:
+      if (!pair->reading) tnk_fwd_arm_read(mrb, fwd, idx);
+      break;
+    default:
+      tnk_fwd_write_next(mrb, fwd, idx);
+      break;
+  }
+}
+
+static void
+tnk_fwd_handle_output(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx,
+                      struct io_uring_cqe *cqe)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+
+  pair->out.pending--;
+  pair->inflight--;
+  if (pair->dead) {
+    if (pair->inflight == 0) {
+      tnk_fwd_release_pair(mrb, fwd, idx);
+    }
+    return;
+  }
+  /* ETIME: a pause ran out. ECANCELED: the pause of a failed write. */
+  if (cqe->res < 0 && cqe->res != -ETIME && cqe->res != -ECANCELED && cqe->res != -ESHUTDOWN) {
+    errno = -cqe->res;
+    tnk_fwd_sys_fail(mrb, "write(hidg)");
+  }
+  if (pair->out.pending == 0) {
+    tnk_fwd_output_step(mrb, fwd, idx);
+    if (!pair->out.cur) tnk_fwd_writes_resume(mrb, fwd, idx);
+  }
+  if (fwd->parked) {
+    tnk_fwd_inject_resume(mrb, fwd);
+  }
+}
+
+static void
+tnk_fwd_evdev_key(struct tnk_fwd_evdev *ev, uint16_t code, int32_t value)
+{
+  if (code >= BTN_LEFT && code <= BTN_EXTRA) {
+    uint8_t bit = (uint8_t)(1u << (code - BTN_LEFT));
+    ev->buttons = value ? (ev->buttons | bit) : (ev->buttons & ~bit);
+    return;
+  }
+  if (code >= BTN_MISC || value == 2) return; /* other buttons, autorepeat */
+
+  uint32_t k = 0;
+  while (k < ev->nkeys && ev->keys[k] != code) k++;
+  if (value && k == ev->nkeys && ev->nkeys < TNK_FWD_EVDEV_KEYS) {
+    ev->keys[ev->nkeys++] = code;
+  } else if (!value && k < ev->nkeys) {
+    memmove(&ev->keys[k], &ev->keys[k + 1], (ev->nkeys - k - 1) * sizeof(ev->keys[0]));
+    ev->nkeys--;
+  }
+}
+
+/* After SYN_DROPPED the kernel's view of held keys is the only truth left. */
+static void
+tnk_fwd_evdev_resync(struct tnk_fwd_evdev *ev)
+{
+  uint8_t bits[KEY_CNT / 8];
+  ev->nkeys = 0;
+  ev->buttons = 0;
+  if (ioctl(ev->fd, EVIOCGKEY(sizeof(bits)), bits) == -1) return;
+  for (uint16_t code = 0; code < KEY_CNT; code++) {
+    if (bits[code / 8] & (1u << (code % 8))) {
+      tnk_fwd_evdev_key(ev, code, 1);
+    }
+  }
+}
+
+static void
+tnk_fwd_evdev_apply(mrb_state *mrb, struct tnk_forwarder *fwd, struct tnk_fwd_evdev *ev,
+                    uint32_t nevents)
+{
+  struct tnk_fwd_sinks *sk = &fwd->sinks;
+
+  for (uint32_t i = 0; i < nevents; i++) {
+    const struct input_event *ie = &ev->buf[i];
+    if (ie->type == EV_SYN && ie->code == SYN_DROPPED) {
+      ev->syncing = true;
+      ev->dx = ev->dy = ev->wheel = ev->hwheel = 0;
+      continue;
+    }
+    if (ie->type == EV_SYN && ie->code == SYN_REPORT) {
+      if (ev->syncing) {
+        ev->syncing = false;
+        tnk_fwd_evdev_resync(ev);
+      }
+      sk->keyboard_dirty = true;
+      sk->dx += ev->dx;
+      sk->dy += ev->dy;
+      sk->wheel += ev->wheel;
+      sk->hwheel += ev->hwheel;
+      ev->dx = ev->dy = ev->wheel = ev->hwheel = 0;
+      tnk_fwd_sinks_flush(mrb, fwd);
+      continue;
+    }
+    if (ev->syncing) continue;
+
+    if (ie->type == EV_KEY) {
+      tnk_fwd_evdev_key(ev, ie->code, ie->value);
+    } else if (ie->type == EV_REL) {
+      switch (ie->code) {
+        case REL_X:      ev->dx += ie->value; break;
+        case REL_Y:      ev->dy += ie->value; break;
+        case REL_WHEEL:  ev->wheel += ie->value; break;
+        case REL_HWHEEL: ev->hwheel += ie->value; break;
+        default: break;
+      }
+    }
+  }
+}
+
+static void
+tnk_fwd_handle_evdev(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx, struct io_uring_cqe *cqe)
+{
+  struct tnk_fwd_evdev *ev = &fwd->evdevs[idx];
+  ev->reading = false;
+  if (!ev->used) return;
+
+  if (cqe->res == -ENODEV || cqe->res == 0) {
+    /* unplugged, release whatever it held */
+    close(ev->fd);
+    memset(ev, 0, sizeof(*ev));
+    fwd->sinks.keyboard_dirty = true;
+    tnk_fwd_sinks_flush(mrb, fwd);
+    return;
+  }
+  if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+    errno = -cqe->res;
+    mrb_sys_fail(mrb, "read(evdev)");
+  }
+
+  if (cqe->res > 0) {
+    tnk_fwd_evdev_apply(mrb, fwd, ev, (uint32_t)cqe->res / sizeof(struct input_event));
+  }
+  tnk_fwd_arm_evdev(mrb, fwd, idx);
+}
+
+static void
+tnk_fwd_handle_write(mrb_state *mrb, struct tnk_forwarder *fwd, uint32_t idx, uint32_t slot,
+                     struct io_uring_cqe *cqe)
+{
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+
+  pair->inflight--;
+  if (pair->dead) {
+    if (pair->inflight == 0) {
+      tnk_fwd_release_pair(mrb, fwd, idx);
+    }
+    return;
+  }
+
+  if (cqe->res == -ECANCELED && slot == TNK_FWD_CHAIN_SLOT) {
+    /* the linked read came up short, failed or was unchained and broke the
+     * chain, it has already been dealt with through its own completion */
+    pair->reading = false;
+    pair->out.unchaining = false;
+    tnk_fwd_output_step(mrb, fwd, idx);
+    if (!pair->out.cur) tnk_fwd_arm_read(mrb, fwd, idx);
+    return;
+  }
+  /* ESHUTDOWN: the host isn't listening, e.g. while the UDC is rebound for
+   * a hotplugged device. The report is lost either way. */
+  if (cqe->res < 0 && cqe->res != -ESHUTDOWN) {
+    errno = -cqe->res;
+    tnk_fwd_sys_fail(mrb, "write(hidg)");
+  }
+
+  struct tnk_fwd_stats *st = &pair->stats;
+  if (cqe->res > 0) {
+    st->reports++;
+    st->bytes += (uint64_t)cqe->res;
+    if (slot != TNK_FWD_CHAIN_SLOT) {
+      tnk_hist_add(&st->forward, tnk_now_ns() - st->read_ns[slot]);
+    }
+  } else {
+    st->dropped++;
+  }
+
+  if (slot == TNK_FWD_CHAIN_SLOT) {
+    /* rbuf isn't reused before the chain is re-armed */
+    pair->reading = false;
+    pair->out.unchaining = false;
+    if (cqe->res > 0) {
+      /* the chain wrote what it read */
+      tnk_fwd_capture(pair, idx, TNK_CAPTURE_IN, pair->rbuf, (uint32_t)cqe->res);
+      tnk_fwd_capture(pair, idx, TNK_CAPTURE_OUT, pair->rbuf, (uint32_t)cqe->res);
+      tnk_fwd_dispatch(mrb, fwd, idx, pair->rbuf, (size_t)cqe->res);
+    }
+    /* output waiting for the hidg goes first */
+    tnk_fwd_output_step(mrb, fwd, idx);
+    if (!pair->out.cur) tnk_fwd_arm_read(mrb, fwd, idx);
+  } else if (pair->mode == TNK_FWD_MODE_SINK) {
+    pair->writing = false;
+    tnk_fwd_output_step(mrb, fwd, idx);
+    if (!pair->out.cur) tnk_fwd_sinks_flush(mrb, fwd);
+  } else {
+    pair->writing = false;
+    pair->qhead = (pair->qhead + 1) % TNK_FWD_WRITE_SLOTS;
+    pair->qcount--;
+    tnk_fwd_output_step(mrb, fwd, idx);
+    tnk_fwd_drain_held(mrb, fwd, idx);
+    tnk_fwd_write_next(mrb, fwd, idx);
+    if (tnk_fwd_can_read(pair)) {
+      tnk_fwd_arm_read(mrb, fwd, idx);
+    }
+  }
+}
+
+static bool
+tnk_fwd_handle_cqe(mrb_state *mrb, struct tnk_forwarder *fwd, struct io_uring_cqe *cqe)
+{
+  uint64_t udata = io_uring_cqe_get_data64(cqe);
+  uint32_t idx = TNK_FWD_UDATA_PAIR(udata);
+
+  switch (TNK_FWD_UDATA_OP(udata)) {
+    case TNK_FWD_OP_READ:
+      if (!fwd->pairs[idx].dead) {
+        tnk_fwd_handle_read(mrb, fwd, idx, cqe);
+      }
+      break;
+    case TNK_FWD_OP_WRITE:
+      tnk_fwd_handle_write(mrb, fwd, idx, TNK_FWD_UDATA_SLOT(udata), cqe);
+      break;
+    case TNK_FWD_OP_OUTPUT:
+      tnk_fwd_handle_output(mrb, fwd, idx, cqe);
+      break;
+    case TNK_FWD_OP_EVDEV:
+      tnk_fwd_handle_evdev(mrb, fwd, idx, cqe);
+      break;
+    case TNK_FWD_OP_CONTROL:
+      return tnk_fwd_handle_control(mrb, fwd, cqe);
+    case TNK_FWD_OP_KICK:
+      break;
+    case TNK_FWD_OP_RESULTS:
+      tnk_fwd_handle_results(mrb, fwd, cqe);
+      break;
+    case TNK_FWD_OP_ACCEPT:
+      tnk_fwd_handle_accept(mrb, fwd, idx, cqe);
+      break;
+    case TNK_FWD_OP_INJECT:
+      tnk_fwd_handle_inject(mrb, fwd, idx, cqe);
+      break;
+    case TNK_FWD_OP_SHARD:
+      tnk_fwd_shard_failed(mrb, fwd);
+    case TNK_FWD_OP_STOP:
+      return false;
+    case TNK_FWD_OP_SNAP:
+      tnk_fwd_handle_snap(fwd, cqe);
+      break;
+    case TNK_FWD_OP_UNCHAIN:
+      break; /* the chain's write completes either way */
+  }
+
+  return true;
+}
+
+/* Runs the ring of fwd until a completion says to stop. */
+static void
+tnk_fwd_loop(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  for (;;) {
+    if (fwd->vm_kick) {
+      struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+      io_uring_prep_write(sqe, fwd->vm_fds[0], &fwd->vm_one, sizeof(fwd->vm_one), (uint64_t)-1);
+      io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_KICK, 0, 0));
+      fwd->vm_kick = false;
+    }
+    int ret = io_uring_submit_and_wait(&fwd->ring, 1);
+    if (ret < 0) {
+      if (ret == -EINTR) continue;
+      errno = -ret;
+      tnk_fwd_sys_fail(mrb, "io_uring_submit_and_wait");
+    }
+
+    fwd->wakeups++;
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&fwd->ring, &cqe) == 0) {
+      fwd->cqes++;
+      bool keep_going = tnk_fwd_handle_cqe(mrb, fwd, cqe);
+      io_uring_cqe_seen(&fwd->ring, cqe);
+      if (!keep_going) {
+        return;
+      }
+    }
+  }
+}
+
+/* ---- shards ---- */
+
+/* Shard thread: sets up the pair on the shard's own forwarder and forwards
+ * it until told to stop. There is no VM, failures unwind to
+ * tnk_fwd_shard_main() through tnk_fwd_sys_fail(). */
+static void
+tnk_fwd_shard_run(struct tnk_fwd_shard *shard)
+{
+  struct tnk_forwarder *fwd = shard->fwd;
+  uint32_t idx = shard->idx;
+
+  if (shard->cpu >= 0) {
+    tnk_rt_pin(shard->cpu);
+  }
+  tnk_fwd_init_ring(NULL, fwd, shard->cpu);
+  struct tnk_fwd_pair *pair = &fwd->pairs[idx];
+  pair->used = true;
+  pair->gen = shard->gen;
+  fwd->npairs = idx + 1;
+  tnk_fwd_setup_pair(NULL, fwd, idx, shard->hidraw_fd, shard->hidg_fd, shard->report_len, shard->mode,
+                     false, shard->id_map);
+
+  tnk_fwd_arm_read(NULL, fwd, idx);
+  if (fwd->vm_running) {
+    tnk_fwd_arm_results(NULL, fwd);
+  }
+  struct io_uring_sqe *sqe = tnk_fwd_get_sqe(NULL, fwd);
+  io_uring_prep_read(sqe, shard->stop_fd, &shard->stop_count, sizeof(shard->stop_count), (uint64_t)-1);
+  io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_STOP, 0, 0));
+  tnk_fwd_arm_snap(fwd);
+  /* like the forwarder, only once the SQPOLL thread exists */
+  if (shard->cpu >= 0) {
+    tnk_rt_fifo();
+  }
+
+  tnk_fwd_loop(NULL, fwd);
+}
+
+static void *
+tnk_fwd_shard_main(void *arg)
+{
+  struct tnk_fwd_shard *shard = (struct tnk_fwd_shard *)arg;
+  fwd_shard = shard;
+  if (setjmp(shard->unwind) == 0) {
+    tnk_fwd_shard_run(shard);
+    return NULL;
+  }
+  fprintf(stderr, "forwarder: shard %" PRIu32 ": %s: %s\n", shard->idx, shard->what, strerror(shard->err));
+  uint64_t one = 1;
+  if (write(shard->fail_fd, &one, sizeof(one)) < 0) {
+    perror("forwarder: write(shard eventfd)");
+  }
+  return NULL;
+}
+
+static void
+tnk_fwd_start_shard(mrb_state *mrb, struct tnk_forwarder *fwd, struct tnk_fwd_shard *shard, uint32_t n)
+{
+  /* freed with tnk_forwarder_free(NULL, ...) like what the shard allocates */
+  struct tnk_forwarder *sfwd = (struct tnk_forwarder *)calloc(1, sizeof(*sfwd));
+  if (!sfwd) {
+    errno = ENOMEM;
+    mrb_sys_fail(mrb, "calloc(shard)");
+  }
+  sfwd->shard_fd = -1;
+  sfwd->vm_running = fwd->vm_running;
+  sfwd->vm_fds[0] = fwd->vm_fds[0];
+  sfwd->vm_fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  shard->fwd = sfwd;
+  shard->stop_fd = eventfd(0, EFD_CLOEXEC);
+  shard->snap_fd = eventfd(0, EFD_CLOEXEC);
+  shard->snapped_fd = eventfd(0, EFD_CLOEXEC);
+  if (sfwd->vm_fds[1] == -1 || shard->stop_fd == -1 || shard->snap_fd == -1 || shard->snapped_fd == -1) {
+    mrb_sys_fail(mrb, "eventfd(shard)");
+  }
+  shard->fail_fd = fwd->shard_fd;
+  shard->cpu = tnk_rt_shard_cpu(n);
+  if (fwd->vm_running) {
+    tnk_vm_route(shard->idx, &sfwd->results, sfwd->vm_fds[1]);
+  }
+
+  /* signals stay with the forwarder thread */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&shard->thread, NULL, tnk_fwd_shard_main, shard);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    errno = err;
+    mrb_sys_fail(mrb, "pthread_create(shard)");
+  }
+  shard->started = true;
+  char name[16];
+  snprintf(name, sizeof(name), "tnk-shard-%" PRIu32, shard->idx);
+  pthread_setname_np(shard->thread, name);
+}
+
+static void
+tnk_fwd_start_shards(mrb_state *mrb, struct tnk_forwarder *fwd)
+{
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < TNK_FWD_MAX_PAIRS; i++) {
+    struct tnk_fwd_shard *shard = fwd->shards[i];
+    if (!shard || shard->started) continue;
+    if (fwd->shard_fd == -1) {
+      fwd->shard_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (fwd->shard_fd == -1) mrb_sys_fail(mrb, "eventfd(shard)");
+      struct io_uring_sqe *sqe = tnk_fwd_get_sqe(mrb, fwd);
+      io_uring_prep_read(sqe, fwd->shard_fd, &fwd->shard_count, sizeof(fwd->shard_count), (uint64_t)-1);
+      io_uring_sqe_set_data64(sqe, TNK_FWD_UDATA(TNK_FWD_OP_SHARD, 0, 0));
+    }
+    tnk_fwd_start_shard(mrb, fwd, shard, n++);
+  }
+}
+
+static mrb_value
+tnk_forwarder_run(mrb_state *mrb, mrb_value self)
+{
+  struct tnk_forwarder *fwd = (struct tnk_forwarder *)mrb_data_get_ptr(mrb, self, &tnk_forwarder_type);
+
+  for (uint32_t i = 0; i < fwd->npairs; i++) {
+    if (fwd->pairs[i].used && !fwd->pairs[i].reading && fwd->pairs[i].mode != TNK_FWD_MODE_SINK) {
+      tnk_fwd_arm_read(mrb, fwd, i);
+    }
+  }
+  for (uint32_t i = 0; i < TNK_FWD_MAX_EVDEV; i++) {
+    if (fwd->evdevs[i].used && !fwd->evdevs[i].reading) {
+      tnk_fwd_arm_evdev(mrb, fwd, i);
+    }
+  }
+  if (tnk_control_fd >= 0 && !fwd->control_armed) {
+    tnk_fwd_arm_control(mrb, fwd);
+  }
+  for (uint32_t i = 0; i < 2; i++) {
+    if (tnk_inject_fds[i] >= 0) {
+      tnk_fwd_arm_accept(mrb, fwd, i);
+    }
+  }
+  if (!fwd->vm_running && mrb->ud) {
+    if (!tnk_vm_start((mrb_state *)mrb->ud, &fwd->results, fwd->vm_fds)) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "can't start the user VM thread");
+    }
+    /* owned by the thread from now on, tnk_vm_stop hands it back */
+    mrb->ud = NULL;
+    fwd->vm_running = true;
+    tnk_fwd_arm_results(mrb, fwd);
+  }
+  /* after the user VM thread, their results are routed to them */
+  tnk_fwd_start_shards(mrb, fwd);
+  tnk_rt_start();
+
+  tnk_fwd_loop(mrb, fwd);
+  tnk_fwd_stop_shards(fwd);
+  return self;
+}
+
+void
+tnk_forwarder_init(mrb_state *mrb, struct RClass *tnk)
+{
+  struct RClass *fwd = mrb_define_class_under_id(mrb, tnk, MRB_SYM(Forwarder), mrb->object_class);
+  MRB_SET_INSTANCE_TT(fwd, MRB_TT_DATA);
+  mrb_define_method_id(mrb, fwd, MRB_SYM(initialize), tnk_forwarder_initialize, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, fwd, MRB_SYM(add), tnk_forwarder_add, MRB_ARGS_ARG(3, 2));
+  mrb_define_method_id(mrb, fwd, MRB_SYM(evdev_sinks), tnk_forwarder_evdev_sinks, MRB_ARGS_REQ(2));
+  mrb_define_method_id(mrb, fwd, MRB_SYM(add_evdev), tnk_forwarder_add_evdev, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, fwd, MRB_SYM(run), tnk_forwarder_run, MRB_ARGS_NONE());
+}
@@ -0,0 +1,17 @@
+# Prelude of the user VM, run before user.rb. mrbgem.rake compiles it to the
+# tnk_hotkeys_prelude irep, so loading it needs no parser.
+class Tnk
+  module Hotkeys
+    def self.on(*keys, trigger: :press, &blk)
+      register_hotkey([keys], trigger, 0, &blk)
+    end
+
+    def self.sequence(*steps, timeout: 0, trigger: :press, &blk)
+      register_hotkey(steps, trigger, timeout, &blk)
+    end
+
+    class Text
+      attr_reader :text, :pace
+    end
+  end
+end
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/presym.h>
+#include <mruby/string.h>
+
+#include "tnk.h"
+
+/*
+ * hidraw and input device hotplug.
+ *
+ * The root process listens on a NETLINK_KOBJECT_UEVENT socket, lets
+ * Tnk.hotplug adjust the gadget and hands the descriptors it returns for a new
+ * hidraw/hidg pair (with its report ID map when the hidg is the composite
+ * function), or for an input device without hidraw node, to the
+ * unprivileged worker over a SOCK_SEQPACKET pair. Removals need no message:
+ * the worker sees EIO/ENODEV on the node and drops it on its own. While a
+ * crashed worker is being replaced there is nobody to tell, devices are only
+ * attached then and the next worker finds them in setup_user. Kernel
+ * uevents come before udev has seen the device, so nothing may rely on the
+ * links udev creates, e.g. /dev/input/by-id.
+ */
+
+#define TNK_UEVENT_BUF 8192
+
+int
+tnk_uevent_open(void)
+{
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd == -1) return -1;
+
+  struct sockaddr_nl addr = {
+    .nl_family = AF_NETLINK,
+    .nl_groups = 1, /* kernel events, not the ones udev rebroadcasts */
+  };
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+int
+tnk_control_send(int sock, const struct tnk_control_msg *msg, const int *fds, size_t nfds)
+{
+  if (nfds > 2) {
+    errno = EINVAL;
+    return -1;
+  }
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * 2)];
+    struct cmsghdr align;
+  } u;
+  struct iovec iov = { .iov_base = (void *)msg, .iov_len = sizeof(*msg) };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = nfds ? u.buf : NULL,
+    .msg_controllen = nfds ? CMSG_SPACE(sizeof(int) * nfds) : 0,
+  };
+  if (nfds) {
+    memset(u.buf, 0, sizeof(u.buf));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+
+  return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)sizeof(*msg) ? 0 : -1;
+}
+
+int
+tnk_control_recv(int sock, struct tnk_control_msg *msg, int fds[2])
+{
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * 2)];
+    struct cmsghdr align;
+  } u;
+  struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = u.buf,
+    .msg_controllen = sizeof(u.buf),
+  };
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  if (n == 0) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  fds[0] = fds[1] = -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len >= CMSG_LEN(sizeof(int)) && cmsg->cmsg_len <= CMSG_LEN(sizeof(int) * 2)) {
+    memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+  }
+  if (n != (ssize_t)sizeof(*msg) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    fds[0] = fds[1] = -1;
+    msg->type = 0;
+  }
+
+  return 1;
+}
+
+static const char *
+uevent_get(const char *buf, size_t len, const char *key)
+{
+  size_t klen = strlen(key);
+  /* the first string is the "action@devpath" summary, key=value pairs follow */
+  for (size_t off = strnlen(buf, len) + 1; off < len; off += strnlen(buf + off, len - off) + 1) {
+    if (strncmp(buf + off, key, klen) == 0 && buf[off + klen] == '=') {
+      return buf + off + klen + 1;
+    }
+  }
+  return NULL;
+}
+
+static void
+tnk_hotplug_event(mrb_state *mrb, const char *action, const char *devname, int control_fd)
+{
+  int ai = mrb_gc_arena_save(mrb);
+  char path[sizeof("/dev/") + NAME_MAX];
+  snprintf(path, sizeof(path), "/dev/%s", devname);
+
+  mrb_value tnk = mrb_obj_value(mrb_class_get_id(mrb, MRB_SYM(Tnk)));
+  mrb_value pair = mrb_funcall_id(mrb, tnk, MRB_SYM(hotplug), 2,
+                                  mrb_str_new_cstr(mrb, action), mrb_str_new_cstr(mrb, path));
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    mrb_clear_error(mrb);
+  } else if (control_fd == -1) {
+    /* no worker right now, the next one is handed the device by setup_user */
+  } else if (mrb_array_p(pair) && RARRAY_LEN(pair) == 1 && mrb_integer_p(RARRAY_PTR(pair)[0])) {
+    int fd = (int)mrb_integer(RARRAY_PTR(pair)[0]);
+    struct tnk_control_msg msg = { .type = TNK_CONTROL_ADD_EVDEV };
+    if (tnk_control_send(control_fd, &msg, &fd, 1) == -1) {
+      perror("hotplug: sendmsg");
+    }
+  } else if (mrb_array_p(pair) && (RARRAY_LEN(pair) == 3 || RARRAY_LEN(pair) == 4) &&
+             mrb_integer_p(RARRAY_PTR(pair)[0]) && mrb_integer_p(RARRAY_PTR(pair)[1]) &&
+             mrb_integer_p(RARRAY_PTR(pair)[2])) {
+    int fds[2] = {
+      (int)mrb_integer(RARRAY_PTR(pair)[0]),
+      (int)mrb_integer(RARRAY_PTR(pair)[1]),
+    };
+    struct tnk_control_msg msg = {
+      .type = TNK_CONTROL_ADD_PAIR,
+      .report_len = (uint32_t)mrb_integer(RARRAY_PTR(pair)[2]),
+    };
+    if (RARRAY_LEN(pair) == 4) {
+      mrb_value id_map = RARRAY_PTR(pair)[3];
+      if (mrb_string_p(id_map) && RSTRING_LEN(id_map) == sizeof(msg.id_map)) {
+        memcpy(msg.id_map, RSTRING_PTR(id_map), sizeof(msg.id_map));
+      }
+    }
+    if (tnk_control_send(control_fd, &msg, fds, 2) == -1) {
+      perror("hotplug: sendmsg");
+    }
+  }
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+void
+tnk_hotplug_dispatch(mrb_state *mrb, int uevent_fd, int control_fd)
+{
+  char buf[TNK_UEVENT_BUF];
+
+  for (;;) {
+    struct sockaddr_nl from;
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) - 1 };
+    struct msghdr mh = {
+      .msg_name = &from,
+      .msg_namelen = sizeof(from),
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+    };
+    ssize_t n = recvmsg(uevent_fd, &mh, MSG_DONTWAIT);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      /* ENOBUFS means we lost events, nothing to recover them from */
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("hotplug: recvmsg");
+      return;
+    }
+    /* only trust the kernel */
+    if (n == 0 || from.nl_pid != 0 || (mh.msg_flags & MSG_TRUNC)) continue;
+    buf[n] = '\0';
+
+    const char *subsystem = uevent_get(buf, (size_t)n, "SUBSYSTEM");
+    const char *action    = uevent_get(buf, (size_t)n, "ACTION");
+    const char *devname   = uevent_get(buf, (size_t)n, "DEVNAME");
+    if (!subsystem || !action || !devname) continue;
+    if (strcmp(action, "add") != 0 && strcmp(action, "remove") != 0) continue;
+    if (strcmp(subsystem, "hidraw") == 0) {
+      if (strchr(devname, '/')) continue;
+    } else if (strcmp(subsystem, "input") == 0) {
+      if (strncmp(devname, "input/event", 11) != 0 || strchr(devname + 6, '/')) continue;
+    } else {
+      continue;
+    }
+
+    tnk_hotplug_event(mrb, action, devname, control_fd);
+  }
+}
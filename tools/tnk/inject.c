@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "inject.h"
+
+/*
+ * Listening sockets of the injection protocol (see inject.h) and the decoding
+ * of its frames. The sockets are opened by the root process, the worker
+ * inherits them and serves them from its io_uring loop (see forward.c).
+ */
+
+/* what Tnk::Hidg names the NCM function, its ifname is picked by the kernel */
+#define TNK_INJECT_NCM_IFNAME "/sys/kernel/config/usb_gadget/tnk/functions/ncm.usb0/ifname"
+#define TNK_INJECT_BACKLOG    8
+
+int tnk_inject_fds[2] = { -1, -1 };
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static uint8_t token[TNK_INJECT_TOKEN_MAX];
+static uint32_t token_len;
+
+int
+tnk_inject_check(const uint8_t *payload, uint32_t len, uint32_t report_len)
+{
+  uint32_t off = 0;
+  int n = 0;
+  while (off < len) {
+    struct tnk_inject_entry e;
+    if (len - off < sizeof(e)) return -EINVAL;
+    memcpy(&e, payload + off, sizeof(e));
+    off += sizeof(e);
+    if (len - off < e.len) return -EINVAL;
+    off += e.len;
+
+    switch (e.type) {
+      case TNK_INJECT_REPORT:
+        if (e.len != report_len) return -EINVAL;
+        break;
+      case TNK_INJECT_TEXT:
+        if (e.len > TNK_RESULT_TEXT_MAX) return -EINVAL;
+        break;
+      case TNK_INJECT_PAUSE:
+        break;
+      default:
+        return -EINVAL;
+    }
+    if (++n > TNK_INJECT_ENTRIES_MAX) return -E2BIG;
+  }
+  return n;
+}
+
+bool
+tnk_inject_append(const uint8_t *payload, uint32_t len, struct tnk_result_ring *ring)
+{
+  /* nothing the consumer can see yet, so backing out is moving tail back */
+  uint32_t tail = ring->tail;
+  uint32_t off = 0;
+  while (off < len) {
+    struct tnk_inject_entry e;
+    memcpy(&e, payload + off, sizeof(e));
+    off += sizeof(e);
+
+    enum tnk_result_type type;
+    int32_t value = 0;
+    switch (e.type) {
+      case TNK_INJECT_REPORT:
+        type = TNK_RESULT_REPORT;
+        break;
+      case TNK_INJECT_TEXT:
+        type = TNK_RESULT_TEXT;
+        value = e.value > INT32_MAX / 1000 ? INT32_MAX : (int32_t)(e.value * 1000);
+        break;
+      default:
+        type = TNK_RESULT_INTEGER;
+        value = e.value > INT32_MAX ? INT32_MAX : (int32_t)e.value;
+        break;
+    }
+    uint32_t data_len = type == TNK_RESULT_INTEGER ? 0 : e.len;
+    struct tnk_result *r = tnk_result_reserve(ring, type, data_len);
+    if (!r) {
+      ring->tail = tail;
+      return false;
+    }
+    r->value = value;
+    memcpy(r->data, payload + off, data_len);
+    tnk_result_commit(ring, r);
+    off += e.len;
+  }
+  return true;
+}
+
+static int
+listen_unix(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "inject: %s: path too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("inject: socket(AF_UNIX)");
+    return -1;
+  }
+  /* left behind by a tnk that didn't get to clean up */
+  unlink(path);
+  mode_t old = umask(0077);
+  int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old);
+  if (ret == -1 || listen(fd, TNK_INJECT_BACKLOG) == -1) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  strcpy(socket_path, path);
+  return fd;
+}
+
+bool
+tnk_inject_token_ok(const uint8_t *payload, uint32_t len)
+{
+  if (token_len == 0 || len != token_len) return false;
+  uint8_t diff = 0;
+  for (uint32_t i = 0; i < len; i++) diff |= payload[i] ^ token[i];
+  return diff == 0;
+}
+
+/* The share directory belongs to the unprivileged user, so the token is
+ * opened without following links and refused if others may read it. */
+static bool
+read_token(const char *share_dir)
+{
+  if (!share_dir) {
+    fprintf(stderr, "inject: no share directory, not listening on TCP\n");
+    return false;
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/inject.token", share_dir);
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "inject: %s: %s, not listening on TCP\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  ssize_t n = -1;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && !(st.st_mode & 077)) {
+    n = read(fd, token, sizeof(token));
+  }
+  close(fd);
+  if (n == (ssize_t)sizeof(token)) n = -1; /* possibly cut short */
+  while (n > 0 && (token[n - 1] == '\n' || token[n - 1] == '\r')) n--;
+  if (n < TNK_INJECT_TOKEN_MIN) {
+    fprintf(stderr, "inject: %s must hold %d to %d bytes and be readable by its owner only, "
+            "not listening on TCP\n", path, TNK_INJECT_TOKEN_MIN, TNK_INJECT_TOKEN_MAX - 1);
+    memset(token, 0, sizeof(token));
+    return false;
+  }
+  token_len = (uint32_t)n;
+  return true;
+}
+
+static int
+listen_tcp(uint16_t port)
+{
+  char ifname[IF_NAMESIZE + 1] = "";
+  FILE *f = fopen(TNK_INJECT_NCM_IFNAME, "re");
+  if (f) {
+    if (!fgets(ifname, sizeof(ifname), f)) ifname[0] = '\0';
+    fclose(f);
+  }
+  ifname[strcspn(ifname, "\n")] = '\0';
+  unsigned int ifindex = ifname[0] ? if_nametoindex(ifname) : 0;
+  if (ifindex == 0) {
+    fprintf(stderr, "inject: no NCM interface, not listening on TCP\n");
+    return -1;
+  }
+
+  struct sockaddr_in6 addr = {
+    .sin6_family = AF_INET6,
+    .sin6_port = htons(port),
+    .sin6_scope_id = ifindex,
+  };
+  inet_pton(AF_INET6, "fe80::1", &addr.sin6_addr);
+
+  int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("inject: socket(AF_INET6)");
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  /* the address may still be tentative while the link comes up */
+  setsockopt(fd, SOL_IP, IP_FREEBIND, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, TNK_INJECT_BACKLOG) == -1) {
+    perror("inject: [fe80::1]");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void
+tnk_inject_listen(const char *share_dir)
+{
+  const char *path = getenv("TNK_INJECT_SOCKET");
+  if (!path) path = "/run/tnk.sock";
+  if (*path) {
+    tnk_inject_fds[0] = listen_unix(path);
+  }
+
+  /* TCP is opt-in, see inject.h */
+  const char *port = getenv("TNK_INJECT_PORT");
+  long p = port ? strtol(port, NULL, 10) : 0;
+  if (p > 0 && p <= 65535 && read_token(share_dir)) {
+    tnk_inject_fds[1] = listen_tcp((uint16_t)p);
+  }
+}
+
+void
+tnk_inject_close(void)
+{
+  for (int i = 0; i < 2; i++) {
+    if (tnk_inject_fds[i] != -1) close(tnk_inject_fds[i]);
+    tnk_inject_fds[i] = -1;
+  }
+}
+
+void
+tnk_inject_unlink(void)
+{
+  if (socket_path[0]) unlink(socket_path);
+  socket_path[0] = '\0';
+}
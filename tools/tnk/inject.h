@@ -0,0 +1,97 @@
+#ifndef TNK_INJECT_H
+#define TNK_INJECT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "result_ring.h"
+
+/*
+ * Report injection protocol.
+ *
+ * Clients connect to the Unix socket (TNK_INJECT_SOCKET, /run/tnk.sock by
+ * default, root only) or, if TNK_INJECT_PORT is set, to that TCP port on
+ * fe80::1 of the gadget's NCM interface and send frames: a header followed
+ * by len bytes of entries, each entry a header followed by its len bytes of
+ * data. Everything is little endian. A frame is played back to the gadget's
+ * generic keyboard or mouse as a whole and in order, and once its last entry
+ * went out to the host the client gets an ack with the frame's sequence
+ * number and status 0. A frame that is refused is acked right away with a
+ * negative errno:
+ *
+ *   EINVAL  malformed entries, or a report that isn't 8 (keyboard) or 7
+ *           (mouse) bytes long
+ *   ENODEV  the gadget has no such target
+ *   EACCES  the first frame on TCP doesn't carry the token
+ *   E2BIG   more entries than a frame may carry
+ *
+ * Whatever reaches the TCP port types on the host, as whoever is logged in
+ * there, so a TCP client has to prove it knows the shared secret in
+ * inject.token of the share directory first: its first frame targets
+ * TNK_INJECT_AUTH and carries the file's content (without a trailing newline)
+ * as payload. It is acked with 0, or with EACCES and the connection is
+ * closed, as it is for any other first frame. Without a token file of
+ * TNK_INJECT_TOKEN_MIN bytes or more that only its owner may read, tnk
+ * doesn't listen on TCP at all.
+ *
+ * Frames over TNK_INJECT_PAYLOAD_MAX end the connection. A client that sends
+ * faster than the host takes reports isn't read from until there is room
+ * again, nothing it sends is dropped. Acks are sent without waiting, a client
+ * has to keep reading them or it is disconnected.
+ */
+
+#define TNK_INJECT_PAYLOAD_MAX    32768
+#define TNK_INJECT_ENTRIES_MAX    255
+#define TNK_INJECT_TOKEN_MIN      16
+#define TNK_INJECT_TOKEN_MAX      256
+
+enum tnk_inject_target {
+  TNK_INJECT_KEYBOARD = 0,
+  TNK_INJECT_MOUSE = 1,
+  TNK_INJECT_AUTH = 255, /* first frame on TCP, the token as payload */
+};
+
+enum tnk_inject_type {
+  TNK_INJECT_REPORT = 1, /* a raw report */
+  TNK_INJECT_TEXT = 2,   /* UTF-8 typed key by key, value is the pace in ms */
+  TNK_INJECT_PAUSE = 3,  /* value ms of nothing, no data */
+};
+
+struct tnk_inject_frame {
+  uint32_t len; /* of the entries that follow */
+  uint32_t seq; /* echoed in the ack */
+  uint8_t target;
+  uint8_t reserved[3];
+};
+
+struct tnk_inject_entry {
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t len; /* of the data that follows */
+  uint32_t value;
+};
+
+struct tnk_inject_ack {
+  uint32_t seq;
+  int32_t status;
+};
+
+/* Number of entries in a frame's payload, -EINVAL if it is malformed or
+ * carries a report that isn't report_len long. */
+int tnk_inject_check(const uint8_t *payload, uint32_t len, uint32_t report_len);
+/* Appends the entries of a checked payload to ring as results, false if it
+ * has no room for all of them (nothing is appended then). */
+bool tnk_inject_append(const uint8_t *payload, uint32_t len, struct tnk_result_ring *ring);
+
+/* Whether payload is the token, in constant time. */
+bool tnk_inject_token_ok(const uint8_t *payload, uint32_t len);
+
+/* Root process: opens the listening sockets into tnk_inject_fds, which the
+ * worker inherits, and takes them down again. The token is read from
+ * share_dir (NULL: not found, no TCP) along with them. */
+extern int tnk_inject_fds[2]; /* Unix, TCP; -1 if not listening */
+void tnk_inject_listen(const char *share_dir);
+void tnk_inject_close(void);
+void tnk_inject_unlink(void);
+
+#endif
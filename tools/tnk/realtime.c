@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "realtime.h"
+
+#define TNK_RT_DEFAULT_PRIO    50
+#define TNK_RT_DEFAULT_IDLE_MS 100
+
+struct tnk_realtime tnk_rt = { .cpu = -1 };
+/* what the worker started with, less the pinned CPU */
+static cpu_set_t other_cpus;
+
+static long
+env_long(const char *name, long def, long min, long max)
+{
+  const char *s = getenv(name);
+  if (!s || !*s) return def;
+  char *end;
+  long v = strtol(s, &end, 10);
+  if (*end || v < min || v > max) {
+    fprintf(stderr, "realtime: %s must be %ld..%ld\n", name, min, max);
+    return def;
+  }
+  return v;
+}
+
+void
+tnk_rt_setup(void)
+{
+  tnk_rt.cpu = (int)env_long("TNK_REALTIME", -1, 0, CPU_SETSIZE - 1);
+  if (tnk_rt.cpu < 0) return;
+  tnk_rt.prio = (int)env_long("TNK_REALTIME_PRIO", TNK_RT_DEFAULT_PRIO, 1, 99);
+  tnk_rt.idle_ms = (uint32_t)env_long("TNK_REALTIME_IDLE_MS", TNK_RT_DEFAULT_IDLE_MS, 1, 60000);
+
+  CPU_ZERO(&other_cpus);
+  if (sched_getaffinity(0, sizeof(other_cpus), &other_cpus) == 0) {
+    CPU_CLR(tnk_rt.cpu, &other_cpus);
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(tnk_rt.cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    perror("realtime: sched_setaffinity");
+  } else {
+    tnk_rt.pinned = true;
+  }
+
+  /* both stay with the worker after it dropped to its user */
+  struct rlimit rtprio = { (rlim_t)tnk_rt.prio, (rlim_t)tnk_rt.prio };
+  if (setrlimit(RLIMIT_RTPRIO, &rtprio) == -1) {
+    perror("realtime: setrlimit(RLIMIT_RTPRIO)");
+  }
+  struct rlimit memlock = { RLIM_INFINITY, RLIM_INFINITY };
+  if (setrlimit(RLIMIT_MEMLOCK, &memlock) == -1) {
+    perror("realtime: setrlimit(RLIMIT_MEMLOCK)");
+  }
+}
+
+bool
+tnk_rt_fifo(void)
+{
+  struct sched_param sp = { .sched_priority = tnk_rt.prio };
+  if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
+    perror("realtime: sched_setscheduler(SCHED_FIFO)");
+    return false;
+  }
+  return true;
+}
+
+void
+tnk_rt_start(void)
+{
+  if (tnk_rt.cpu < 0) return;
+  if (!tnk_rt.fifo) {
+    tnk_rt.fifo = tnk_rt_fifo();
+  }
+  if (!tnk_rt.locked) {
+    /* MCL_ONFAULT: pages are locked as they are touched, mapped but unused
+     * ones like most of the user VM's arena stay unbacked. Kernels before
+     * 4.4 lack it and lock everything. */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == -1 &&
+        (errno != EINVAL || mlockall(MCL_CURRENT | MCL_FUTURE) == -1)) {
+      perror("realtime: mlockall");
+    } else {
+      tnk_rt.locked = true;
+    }
+  }
+}
+
+int
+tnk_rt_shard_cpu(uint32_t n)
+{
+  if (tnk_rt.cpu < 0) return -1;
+  int count = CPU_COUNT(&other_cpus);
+  if (count == 0) return tnk_rt.cpu;
+  int k = (int)(n % (uint32_t)count);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &other_cpus) && k-- == 0) return cpu;
+  }
+  return tnk_rt.cpu;
+}
+
+void
+tnk_rt_pin(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    perror("realtime: sched_setaffinity");
+  }
+}
+
+void
+tnk_rt_thread_attr(pthread_attr_t *attr)
+{
+  if (tnk_rt.cpu < 0) return;
+  struct sched_param sp = { .sched_priority = 0 };
+  pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+  pthread_attr_setschedparam(attr, &sp);
+  /* a single CPU machine has nowhere else to go */
+  if (tnk_rt.pinned && CPU_COUNT(&other_cpus) > 0) {
+    pthread_attr_setaffinity_np(attr, sizeof(other_cpus), &other_cpus);
+  }
+}
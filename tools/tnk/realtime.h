@@ -0,0 +1,50 @@
+#ifndef TNK_REALTIME_H
+#define TNK_REALTIME_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Opt-in realtime forwarding, TNK_REALTIME=<cpu>.
+ *
+ * The worker pins itself to that CPU, ideally one kept free of everything
+ * else (isolcpus=, nohz_full=), and lifts the limits it needs while still
+ * root. The forwarder creates its io_uring with an SQPOLL thread on the same
+ * CPU: while reports flow, submitting them takes no syscall, and after
+ * TNK_REALTIME_IDLE_MS (100 by default) without any the kernel thread goes to
+ * sleep until the next submission wakes it. Waiting for completions blocks
+ * as always, so an idle keyboard costs no power. Once forwarding is set up
+ * the forwarder thread switches to SCHED_FIFO at TNK_REALTIME_PRIO (50 by
+ * default), after the SQPOLL thread was created so that one stays
+ * SCHED_OTHER and can't starve it, and locks its memory so a page, once
+ * touched, is never paged out under a report.
+ *
+ * Threads that don't forward (the user VM thread) are started SCHED_OTHER
+ * on the CPUs the worker had besides the pinned one. Shard threads take
+ * those CPUs in turn and go through the same steps as the forwarder.
+ */
+
+struct tnk_realtime {
+  int cpu; /* -1: off */
+  int prio;
+  uint32_t idle_ms;
+  bool pinned, fifo, locked; /* what took */
+};
+
+extern struct tnk_realtime tnk_rt;
+
+/* Worker, before dropping privileges: reads the settings, pins the calling
+ * thread and raises RLIMIT_RTPRIO and RLIMIT_MEMLOCK for tnk_rt_start. */
+void tnk_rt_setup(void);
+/* Forwarder thread, once set up: SCHED_FIFO and locked memory. */
+void tnk_rt_start(void);
+/* Shard threads: the CPU of the nth (-1 when off), pinning the calling
+ * thread to it, and SCHED_FIFO for it. */
+int tnk_rt_shard_cpu(uint32_t n);
+void tnk_rt_pin(int cpu);
+bool tnk_rt_fifo(void);
+/* Sets up attr for a thread that doesn't forward. */
+void tnk_rt_thread_attr(pthread_attr_t *attr);
+
+#endif
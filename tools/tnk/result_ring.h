@@ -0,0 +1,170 @@
+#ifndef TNK_RESULT_RING_H
+#define TNK_RESULT_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Typed results of hotkey blocks, handed from the user VM to the forwarder.
+ *
+ * A preallocated byte ring of variable sized entries. The user VM side copies
+ * report and text bytes straight out of its strings into the ring, the
+ * forwarder plays them back straight out of the ring and releases an entry
+ * once it is done with it. Entries may complete out of order, head only moves
+ * over the ones that are done. An entry never wraps: if it doesn't fit before
+ * the end of the buffer the rest is padded and it starts over at offset 0.
+ * The padding is a pad entry if there is room for its header, a remainder
+ * shorter than that is skipped by both sides without one.
+ *
+ * The producer is the user VM thread and the consumer the forwarder: tail is
+ * only written by the producer, head and read only by the consumer, and each
+ * side publishes its index with a release store the other side acquires.
+ * Every entry is stamped with the pair it was produced for. The forwarder
+ * keeps a second ring for injected frames (see inject.h) that it produces
+ * and consumes itself.
+ */
+
+#define TNK_RESULT_RING_SIZE 65536
+#define TNK_RESULT_TEXT_MAX  16384
+#define TNK_RESULT_ALIGN     8
+
+enum tnk_result_type {
+  TNK_RESULT_PAD = 0,
+  TNK_RESULT_REPORT,  /* len bytes of report data follow the header */
+  TNK_RESULT_INTEGER, /* value; the forwarder pauses that many ms */
+  TNK_RESULT_TRUE,
+  TNK_RESULT_FALSE,
+  TNK_RESULT_TEXT,    /* len bytes of UTF-8 follow, value is the pace in us */
+  TNK_RESULT_RAN,     /* hotkeys ran, a uint64_t of the time they took in ns follows */
+  TNK_RESULT_ACK,     /* an injected frame played back: value is its sequence number,
+                       * the client slot and generation (uint32_t each) follow */
+};
+
+#define TNK_RESULT_F_DONE 0x01
+
+struct tnk_result {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t len;
+  int32_t value;
+  uint32_t pair;
+  uint32_t gen; /* of the pair, a released slot may have been reused */
+  uint8_t data[];
+};
+
+struct tnk_result_ring {
+  uint32_t head; /* oldest entry still in use */
+  uint32_t read; /* next entry the consumer hasn't seen */
+  uint32_t tail; /* where the producer writes next */
+  uint32_t dropped;
+  uint32_t pair, gen; /* producer: stamped on the entries reserved next */
+  _Alignas(TNK_RESULT_ALIGN) uint8_t buf[TNK_RESULT_RING_SIZE];
+};
+
+static inline uint32_t
+tnk_result_size(uint32_t len)
+{
+  return (uint32_t)((sizeof(struct tnk_result) + len + TNK_RESULT_ALIGN - 1) & ~(TNK_RESULT_ALIGN - 1));
+}
+
+static inline struct tnk_result *
+tnk_result_at(struct tnk_result_ring *ring, uint32_t pos)
+{
+  return (struct tnk_result *)(ring->buf + (pos % TNK_RESULT_RING_SIZE));
+}
+
+/* The rest of the buffer from pos if it is too short for a header, that is
+ * padding without a pad entry; 0 otherwise. */
+static inline uint32_t
+tnk_result_gap(uint32_t pos)
+{
+  uint32_t left = TNK_RESULT_RING_SIZE - pos % TNK_RESULT_RING_SIZE;
+  return left < sizeof(struct tnk_result) ? left : 0;
+}
+
+/* Producer: room for an entry with len payload bytes, NULL if full. */
+static inline struct tnk_result *
+tnk_result_reserve(struct tnk_result_ring *ring, enum tnk_result_type type, uint32_t len)
+{
+  uint32_t size = tnk_result_size(len);
+  uint32_t off = ring->tail % TNK_RESULT_RING_SIZE;
+  uint32_t pad = (off + size > TNK_RESULT_RING_SIZE) ? TNK_RESULT_RING_SIZE - off : 0;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  if (len > UINT16_MAX || (ring->tail - head) + pad + size > TNK_RESULT_RING_SIZE) {
+    ring->dropped++;
+    return NULL;
+  }
+  if (pad) {
+    if (pad >= sizeof(struct tnk_result)) {
+      struct tnk_result *p = tnk_result_at(ring, ring->tail);
+      p->type = TNK_RESULT_PAD;
+      p->flags = TNK_RESULT_F_DONE;
+      p->len = (uint16_t)(pad - sizeof(struct tnk_result));
+    }
+    __atomic_store_n(&ring->tail, ring->tail + pad, __ATOMIC_RELEASE);
+  }
+
+  struct tnk_result *r = tnk_result_at(ring, ring->tail);
+  r->type = (uint8_t)type;
+  r->flags = 0;
+  r->len = (uint16_t)len;
+  r->value = 0;
+  r->pair = ring->pair;
+  r->gen = ring->gen;
+  return r;
+}
+
+static inline void
+tnk_result_commit(struct tnk_result_ring *ring, struct tnk_result *r)
+{
+  __atomic_store_n(&ring->tail, ring->tail + tnk_result_size(r->len), __ATOMIC_RELEASE);
+}
+
+/* Consumer: next unseen entry or NULL. Pads are skipped. */
+static inline struct tnk_result *
+tnk_result_next(struct tnk_result_ring *ring)
+{
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  while (ring->read != tail) {
+    uint32_t gap = tnk_result_gap(ring->read);
+    if (gap) {
+      ring->read += gap;
+      continue;
+    }
+    struct tnk_result *r = tnk_result_at(ring, ring->read);
+    ring->read += tnk_result_size(r->len);
+    if (r->type != TNK_RESULT_PAD) return r;
+  }
+  return NULL;
+}
+
+static inline uint32_t
+tnk_result_offset(const struct tnk_result_ring *ring, const struct tnk_result *r)
+{
+  return (uint32_t)((const uint8_t *)r - ring->buf);
+}
+
+/* Consumer: r is no longer needed, reclaims everything done up to the oldest
+ * entry still in use. */
+static inline void
+tnk_result_release(struct tnk_result_ring *ring, struct tnk_result *r)
+{
+  r->flags |= TNK_RESULT_F_DONE;
+  uint32_t head = ring->head;
+  while (head != ring->read) {
+    uint32_t gap = tnk_result_gap(head);
+    if (gap) {
+      head += gap;
+      continue;
+    }
+    struct tnk_result *h = tnk_result_at(ring, head);
+    if (!(h->flags & TNK_RESULT_F_DONE)) break;
+    head += tnk_result_size(h->len);
+  }
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef TNK_STATS_H
+#define TNK_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Latency histograms of the forwarding loop.
+ *
+ * Log-linear buckets: every power of two is split into TNK_HIST_SUB linear
+ * sub-buckets, so a recorded value is off by at most 1/TNK_HIST_SUB and
+ * recording is a count-leading-zeros plus an increment. Values are in
+ * nanoseconds, anything above 2^TNK_HIST_MAX_BITS ns (~18 minutes) lands in
+ * the last bucket. Only the forwarder thread records and reads them.
+ */
+
+#define TNK_HIST_SUB_BITS 3
+#define TNK_HIST_SUB      (1u << TNK_HIST_SUB_BITS)
+#define TNK_HIST_MAX_BITS 40
+#define TNK_HIST_BUCKETS  ((TNK_HIST_MAX_BITS - TNK_HIST_SUB_BITS + 1) * TNK_HIST_SUB)
+
+struct tnk_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint32_t buckets[TNK_HIST_BUCKETS];
+};
+
+static inline uint64_t
+tnk_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint32_t
+tnk_hist_bucket(uint64_t v)
+{
+  if (v < TNK_HIST_SUB) return (uint32_t)v;
+  if (v >> TNK_HIST_MAX_BITS) return TNK_HIST_BUCKETS - 1;
+  uint32_t e = 63u - (uint32_t)__builtin_clzll(v);
+  return (e - TNK_HIST_SUB_BITS + 1) * TNK_HIST_SUB +
+         (uint32_t)((v >> (e - TNK_HIST_SUB_BITS)) & (TNK_HIST_SUB - 1));
+}
+
+/* Smallest value that lands in bucket b. */
+static inline uint64_t
+tnk_hist_bucket_low(uint32_t b)
+{
+  if (b < TNK_HIST_SUB) return b;
+  uint32_t e = b / TNK_HIST_SUB + TNK_HIST_SUB_BITS - 1;
+  return (uint64_t)(TNK_HIST_SUB + b % TNK_HIST_SUB) << (e - TNK_HIST_SUB_BITS);
+}
+
+static inline void
+tnk_hist_add(struct tnk_hist *h, uint64_t v)
+{
+  h->buckets[tnk_hist_bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max) h->max = v;
+}
+
+/* Upper bound of the value at quantile q (0..1), 0 if empty. */
+static inline uint64_t
+tnk_hist_quantile(const struct tnk_hist *h, double q)
+{
+  if (h->count == 0) return 0;
+  uint64_t rank = (uint64_t)(q * (double)(h->count - 1)) + 1;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < TNK_HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank) {
+      if (b + 1 == TNK_HIST_BUCKETS) return h->max;
+      uint64_t high = tnk_hist_bucket_low(b + 1) - 1;
+      return high < h->max ? high : h->max;
+    }
+  }
+  return h->max;
+}
+
+#endif
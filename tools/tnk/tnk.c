@@ -1,18 +1,26 @@
 #define _XOPEN_SOURCE 700
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ftw.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -20,12 +28,24 @@
 #include <mruby.h>
 #include <mruby/array.h>
 #include <mruby/compile.h>
+#include <mruby/dump.h>
 #include <mruby/error.h>
 #include <mruby/hash.h>
-#include <mruby/msgpack.h>
+#include <mruby/irep.h>
+#include <mruby/object.h>
 #include <mruby/presym.h>
+#include <mruby/proc.h>
 #include <mruby/string.h>
 #include <mruby/variable.h>
+#include <mruby/version.h>
+
+#include "arena.h"
+#include "capture.h"
+#include "inject.h"
+#include "realtime.h"
+#include "result_ring.h"
+#include "stats.h"
+#include "tnk.h"
 
 #ifdef MRB_NO_PRESYM
 #error "tnk cannot be build without presym"
@@ -72,6 +92,8 @@ resolve_tnk_path(mrb_state *mrb, const char *rel_path, int mode)
   return buf_str;
 }
 
+int tnk_control_fd = -1;
+
 static uid_t target_uid;
 static gid_t target_gid;
 
@@ -130,26 +152,130 @@ drop_privileges(mrb_state *mrb, const char *username)
   }
 }
 
-static unsigned short plain_map[NR_KEYS];
+/* Linux keycode to HID usage (keyboard page) */
+static const uint8_t scancode_to_hid[NR_KEYS] = {
+    [1] = 0x29,  [2] = 0x1E,  [3] = 0x1F,  [4] = 0x20,  [5] = 0x21,
+    [6] = 0x22,  [7] = 0x23,  [8] = 0x24,  [9] = 0x25,  [10] = 0x26,
+    [11] = 0x27, [12] = 0x2D, [13] = 0x2E, [14] = 0x2A, [15] = 0x2B,
+    [16] = 0x14, [17] = 0x1A, [18] = 0x08, [19] = 0x15, [20] = 0x17,
+    [21] = 0x1C, [22] = 0x18, [23] = 0x0C, [24] = 0x12, [25] = 0x13,
+    [26] = 0x2F, [27] = 0x30, [28] = 0x28, [29] = 0xE0, [30] = 0x04,
+    [31] = 0x16, [32] = 0x07, [33] = 0x09, [34] = 0x0A, [35] = 0x0B,
+    [36] = 0x0D, [37] = 0x0E, [38] = 0x0F, [39] = 0x33, [40] = 0x34,
+    [41] = 0x35, [42] = 0xE1, [43] = 0x31, [44] = 0x1D, [45] = 0x1B,
+    [46] = 0x06, [47] = 0x19, [48] = 0x05, [49] = 0x11, [50] = 0x10,
+    [51] = 0x36, [52] = 0x37, [53] = 0x38, [54] = 0xE5, [55] = 0x55,
+    [56] = 0xE2, [57] = 0x2C, [58] = 0x39, [59] = 0x3A, [60] = 0x3B,
+    [61] = 0x3C, [62] = 0x3D, [63] = 0x3E, [64] = 0x3F, [65] = 0x40,
+    [66] = 0x41, [67] = 0x42, [68] = 0x43, [69] = 0x53, [70] = 0x47,
+    [71] = 0x5F, [72] = 0x60, [73] = 0x61, [74] = 0x56, [75] = 0x5C,
+    [76] = 0x5D, [77] = 0x5E, [78] = 0x57, [79] = 0x59, [80] = 0x5A,
+    [81] = 0x5B, [82] = 0x62, [83] = 0x63, [85] = 0x94, [86] = 0x64,
+    [87] = 0x44, [88] = 0x45, [89] = 0x87, [96] = 0x58, [97] = 0xE4,
+    [98] = 0x54, [99] = 0x46, [100] = 0xE6, [102] = 0x4A, [103] = 0x52,
+    [104] = 0x4B, [105] = 0x50, [106] = 0x4F, [107] = 0x4D, [108] = 0x51,
+    [109] = 0x4E, [110] = 0x49, [111] = 0x4C, [117] = 0x67, [119] = 0x48,
+    [124] = 0x89, [125] = 0xE3, [126] = 0xE7, [127] = 0x65};
+
+uint8_t
+tnk_keycode_to_hid(uint32_t code)
+{
+  return code < NR_KEYS ? scancode_to_hid[code] : 0;
+}
+
+#define TNK_HID_MOD_LSHIFT 0x02
+#define TNK_HID_MOD_RALT   0x40
+
+/*
+ * Compiled keymap tables. They either live in keymap_storage, freshly built
+ * by the ckbcomp | loadkeys pipeline, or point into a mapped cache file.
+ *
+ * Codepoint lookup is a two level table: dir maps the upper bits of a
+ * codepoint to one of the pages, the page holds (modifiers << 8 | HID usage)
+ * for its 256 codepoints, 0 if the layout can't produce it. Page 0 stays
+ * empty and backs every unused dir entry, so a lookup is two loads without
+ * branches. A layout spans a handful of pages (latin-1, latin extended, the
+ * euro sign), TNK_KEYMAP_PAGES leaves plenty of room.
+ */
+#define TNK_KEYMAP_MAX_CP 0x10FFFF
+#define TNK_KEYMAP_DIR    ((TNK_KEYMAP_MAX_CP >> 8) + 1)
+#define TNK_KEYMAP_PAGES  32
+
+struct tnk_keymap_tables {
+  uint16_t npages;
+  uint16_t dir[TNK_KEYMAP_DIR];
+  uint16_t pages[TNK_KEYMAP_PAGES][256];
+};
+
+static struct tnk_keymap_tables keymap_storage;
+static const struct tnk_keymap_tables *keymap = &keymap_storage;
+
+/* the modifier levels we type with, in order of preference */
+enum tnk_keymap_level {
+  TNK_KEYMAP_PLAIN,
+  TNK_KEYMAP_SHIFT,
+  TNK_KEYMAP_ALTGR,
+  TNK_KEYMAP_SHIFT_ALTGR,
+  TNK_KEYMAP_LEVELS
+};
+
+static const struct {
+  const char *name;
+  uint8_t mods;
+} keymap_levels[TNK_KEYMAP_LEVELS] = {
+  [TNK_KEYMAP_PLAIN]       = {"plain", 0},
+  [TNK_KEYMAP_SHIFT]       = {"shift", TNK_HID_MOD_LSHIFT},
+  [TNK_KEYMAP_ALTGR]       = {"altgr", TNK_HID_MOD_RALT},
+  [TNK_KEYMAP_SHIFT_ALTGR] = {"shift_altgr", TNK_HID_MOD_LSHIFT | TNK_HID_MOD_RALT},
+};
+
+/* loadkeys output, only needed while building the tables */
+static unsigned short keymap_maps[TNK_KEYMAP_LEVELS][NR_KEYS];
+static bool keymap_maps_present[TNK_KEYMAP_LEVELS];
+
+static int
+keymap_level_from_line(const char *line)
+{
+  const char *end = strstr(line, "_map[NR_KEYS] = {");
+  if (!end) return -2;
+  const char *name = strstr(line, "short ");
+  if (!name || name > end) return -2;
+  name += strlen("short ");
+
+  for (int i = 0; i < TNK_KEYMAP_LEVELS; i++) {
+    size_t len = strlen(keymap_levels[i].name);
+    if ((size_t)(end - name) == len && strncmp(name, keymap_levels[i].name, len) == 0)
+      return i;
+  }
+  return -1;
+}
 
+/* Parses the plain, shift, altgr and shift_altgr maps of loadkeys --mktable.
+ * Only the plain map is mandatory, a layout may lack the others. */
 static bool
-parse_plain_map_stream(FILE *fp)
+parse_keymap_stream(FILE *fp)
 {
   char buf[4096];
-  int found = 0;
+  int level = -2; /* -2: between maps, -1: in a map we skip */
   int idx = 0;
 
+  memset(keymap_maps, 0, sizeof(keymap_maps));
+  memset(keymap_maps_present, 0, sizeof(keymap_maps_present));
   while (fgets(buf, sizeof(buf), fp)) {
-    if (!found) {
-      if (strstr(buf, "unsigned short plain_map[NR_KEYS] = {")) {
-        found = 1;
-      }
+    if (level == -2) {
+      level = keymap_level_from_line(buf);
+      idx = 0;
       continue;
     }
 
     if (strchr(buf, '}')) {
-      break;
+      if (level >= 0 && idx == NR_KEYS)
+        keymap_maps_present[level] = true;
+      level = -2;
+      continue;
     }
+    if (level == -1)
+      continue;
 
     char *p = buf;
     while (*p) {
@@ -160,26 +286,199 @@ parse_plain_map_stream(FILE *fp)
 
       char *end;
       unsigned long val = strtoul(p, &end, 0);
-      if (p != end && idx < NR_KEYS) {
-        plain_map[idx++] = (unsigned short)val;
+      if (p == end)
+        break;
+      if (idx < NR_KEYS) {
+        keymap_maps[level][idx++] = (unsigned short)val;
       }
       p = end;
     }
   }
 
-  return (idx == NR_KEYS);
+  return keymap_maps_present[TNK_KEYMAP_PLAIN];
 }
 
-static int char_to_scancode[NR_KEYS];
+/* Codepoint a keysym types, 0 for dead keys, function keys, modifiers etc. */
+static uint32_t
+keysym_to_cp(unsigned short v)
+{
+  if ((v & 0xF000) != 0xF000) {
+    return v ^ 0xF000; /* unicode keysym */
+  }
+  if (KTYP(v) == (0xF0 | KT_LATIN) || KTYP(v) == (0xF0 | KT_LETTER)) {
+    return KVAL(v); /* latin-1 */
+  }
+  return 0;
+}
 
 static void rebuild_char_lookup(void) {
-    // Default to "not found"
-    memset(char_to_scancode, 0xFF, sizeof(char_to_scancode));
+    memset(&keymap_storage, 0, sizeof(keymap_storage));
+    keymap_storage.npages = 1; // page 0 is the empty one
+
+    // Fewer modifiers first, and the main block before the keypad, so the
+    // first key found for a codepoint is the one we type it with.
+    for (int level = 0; level < TNK_KEYMAP_LEVELS; level++) {
+        if (!keymap_maps_present[level])
+            continue;
+        for (int sc = 0; sc < NR_KEYS; sc++) {
+            uint32_t cp = keysym_to_cp(keymap_maps[level][sc]);
+            if (cp == 0 || cp > TNK_KEYMAP_MAX_CP || scancode_to_hid[sc] == 0)
+                continue;
+
+            uint16_t *page_idx = &keymap_storage.dir[cp >> 8];
+            if (*page_idx == 0) {
+                if (keymap_storage.npages == TNK_KEYMAP_PAGES) {
+                    fprintf(stderr, "keymap: out of pages, U+%04X not typeable\n", (unsigned)cp);
+                    continue;
+                }
+                *page_idx = keymap_storage.npages++;
+            }
+            uint16_t *e = &keymap_storage.pages[*page_idx][cp & 0xFF];
+            if (*e == 0)
+                *e = (uint16_t)(keymap_levels[level].mods << 8 | scancode_to_hid[sc]);
+        }
+    }
+}
+
+/*
+ * Keymap cache, one file per distinct /etc/default/keyboard setting:
+ *
+ *   struct tnk_keymap_cache_header
+ *   key bytes ("model\nlayout\nvariant\noptions"), padded to 8 bytes
+ *   struct tnk_keymap_tables
+ *
+ * The file is mapped read only and used in place, so a restart with an
+ * unchanged keyboard setting never forks the pipeline.
+ */
+#define TNK_KEYMAP_CACHE_MAGIC   0x4B4B4E54 /* "TNKK" */
+#define TNK_KEYMAP_CACHE_VERSION 3
+
+struct tnk_keymap_cache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t key_len;
+  uint32_t tables_offset;
+};
+
+static void *keymap_map = NULL;
+static size_t keymap_map_len = 0;
+
+static uint64_t
+tnk_fnv1a64(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
 
-    for (int i = 0; i < NR_KEYS; i++) {
-        unsigned char ch = plain_map[i] & 0xFF;
-        char_to_scancode[ch] = i;
+static mrb_value
+keymap_cache_path(mrb_state *mrb, mrb_value key)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/keymap-%016" PRIx64 ".bin",
+           tnk_fnv1a64(RSTRING_PTR(key), RSTRING_LEN(key)));
+  mrb_value path = resolve_tnk_path(mrb, "../share/totally-normal-keyboard", F_OK);
+  return mrb_str_cat_cstr(mrb, path, name);
+}
+
+static size_t
+keymap_cache_tables_offset(size_t key_len)
+{
+  return (sizeof(struct tnk_keymap_cache_header) + key_len + 7) & ~(size_t)7;
+}
+
+/* The cache sits in a directory the worker can write to, a lookup must not
+ * be led outside the tables by whatever is in it. */
+static bool
+keymap_tables_valid(const struct tnk_keymap_tables *tables)
+{
+  if (tables->npages == 0 || tables->npages > TNK_KEYMAP_PAGES) return false;
+  for (size_t i = 0; i < TNK_KEYMAP_DIR; i++) {
+    if (tables->dir[i] >= tables->npages) return false;
+  }
+  return true;
+}
+
+static bool
+keymap_cache_load(const char *path, mrb_value key)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  size_t key_len = (size_t)RSTRING_LEN(key);
+  size_t offset = keymap_cache_tables_offset(key_len);
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size != offset + sizeof(struct tnk_keymap_tables)) {
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const struct tnk_keymap_cache_header *hdr = (const struct tnk_keymap_cache_header *)map;
+  if (hdr->magic != TNK_KEYMAP_CACHE_MAGIC || hdr->version != TNK_KEYMAP_CACHE_VERSION ||
+      hdr->key_len != key_len || hdr->tables_offset != offset ||
+      memcmp((const char *)map + sizeof(*hdr), RSTRING_PTR(key), key_len) != 0 ||
+      !keymap_tables_valid((const struct tnk_keymap_tables *)((const char *)map + offset))) {
+    munmap(map, (size_t)st.st_size);
+    return false;
+  }
+
+  if (keymap_map) {
+    munmap(keymap_map, keymap_map_len);
+  }
+  keymap_map = map;
+  keymap_map_len = (size_t)st.st_size;
+  keymap = (const struct tnk_keymap_tables *)((const char *)map + offset);
+  return true;
+}
+
+static void
+keymap_cache_store(mrb_state *mrb, const char *path, mrb_value key)
+{
+  size_t key_len = (size_t)RSTRING_LEN(key);
+  size_t offset = keymap_cache_tables_offset(key_len);
+  struct tnk_keymap_cache_header hdr = {
+    TNK_KEYMAP_CACHE_MAGIC, TNK_KEYMAP_CACHE_VERSION, (uint32_t)key_len, (uint32_t)offset
+  };
+
+  mrb_value buf = mrb_str_new_capa(mrb, offset + sizeof(keymap_storage));
+  buf = mrb_str_cat(mrb, buf, (const char *)&hdr, sizeof(hdr));
+  buf = mrb_str_cat(mrb, buf, RSTRING_PTR(key), key_len);
+  buf = mrb_str_resize(mrb, buf, (mrb_int)offset);
+  memset(RSTRING_PTR(buf) + sizeof(hdr) + key_len, 0, offset - sizeof(hdr) - key_len);
+  buf = mrb_str_cat(mrb, buf, (const char *)&keymap_storage, sizeof(keymap_storage));
+
+  /* write to a temporary file and rename, so a reader never maps a torn file */
+  mrb_value tmp = mrb_str_cat_lit(mrb, mrb_str_new_cstr(mrb, path), ".tmp");
+  int fd = open(RSTRING_CSTR(mrb, tmp), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) return;
+  const char *p = RSTRING_PTR(buf);
+  size_t left = (size_t)RSTRING_LEN(buf);
+  while (left > 0) {
+    ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
     }
+    p += n;
+    left -= (size_t)n;
+  }
+  if (left != 0 || fsync(fd) != 0) {
+    close(fd);
+    unlink(RSTRING_CSTR(mrb, tmp));
+    return;
+  }
+  close(fd);
+  if (rename(RSTRING_CSTR(mrb, tmp), path) != 0) {
+    unlink(RSTRING_CSTR(mrb, tmp));
+  }
 }
 
 static mrb_value
@@ -231,6 +530,19 @@ gen_keymap(mrb_state *mrb, mrb_value self)
     fclose(kf);
   }
 
+  mrb_value key = mrb_str_dup(mrb, xkbmodel);
+  key = mrb_str_cat_lit(mrb, key, "\n");
+  key = mrb_str_cat_str(mrb, key, xkblayout);
+  key = mrb_str_cat_lit(mrb, key, "\n");
+  key = mrb_str_cat_str(mrb, key, xkbvariant);
+  key = mrb_str_cat_lit(mrb, key, "\n");
+  key = mrb_str_cat_str(mrb, key, xkboptions);
+  mrb_value cache_path = keymap_cache_path(mrb, key);
+
+  if (keymap_cache_load(RSTRING_CSTR(mrb, cache_path), key)) {
+    return mrb_true_value();
+  }
+
   /* Pipe: ckbcomp -> loadkeys */
   int pipefd[2];
   if (pipe(pipefd) == -1) mrb_sys_fail(mrb, "pipe(pipefd)");
@@ -319,9 +631,9 @@ gen_keymap(mrb_state *mrb, mrb_value self)
   FILE *fp = fdopen(pipefd[0], "r");
   if (!fp) mrb_sys_fail(mrb, "fdopen(pipefd[0], r)");
 
-  bool parse_plain_success = parse_plain_map_stream(fp);
+  bool parse_success = parse_keymap_stream(fp);
   fclose(fp);
-  if (!parse_plain_success) { mrb_raise(mrb, E_RUNTIME_ERROR, "invalid keymap"); }
+  if (!parse_success) { mrb_raise(mrb, E_RUNTIME_ERROR, "invalid keymap"); }
 
   int status;
   waitpid(pid, &status, 0);
@@ -331,88 +643,116 @@ gen_keymap(mrb_state *mrb, mrb_value self)
   }
 
   rebuild_char_lookup();
+  if (keymap_map) {
+    munmap(keymap_map, keymap_map_len);
+    keymap_map = NULL;
+  }
+  keymap = &keymap_storage;
+  keymap_cache_store(mrb, RSTRING_CSTR(mrb, cache_path), key);
   return mrb_true_value();
 }
 
-static bool
+/* Decodes the codepoint at s, returns its length in bytes or 0 if invalid. */
+static size_t
 utf8_next_cp(const char *s, size_t len, uint32_t *cp)
 {
-  if (len == 0) return false;
+  if (len == 0) return 0;
   const unsigned char c0 = (unsigned char)s[0];
 
   if (c0 < 0x80) { // 1-byte ASCII
     *cp = c0;
-    return true;
+    return 1;
   }
 
   if ((c0 & 0xE0) == 0xC0) { // 2-byte
-    if (len < 2) return false;
+    if (len < 2) return 0;
     const unsigned char c1 = (unsigned char)s[1];
-    if ((c1 & 0xC0) != 0x80) return false;
+    if ((c1 & 0xC0) != 0x80) return 0;
     uint32_t v = ((c0 & 0x1F) << 6) | (c1 & 0x3F);
-    if (v < 0x80) return false; // overlong
+    if (v < 0x80) return 0; // overlong
     *cp = v;
-    return true;
+    return 2;
   }
 
   if ((c0 & 0xF0) == 0xE0) { // 3-byte
-    if (len < 3) return false;
+    if (len < 3) return 0;
     const unsigned char c1 = (unsigned char)s[1];
     const unsigned char c2 = (unsigned char)s[2];
-    if ((c1 & 0xC0) != 0x80 || (c2 & 0xC0) != 0x80) return false;
+    if ((c1 & 0xC0) != 0x80 || (c2 & 0xC0) != 0x80) return 0;
     uint32_t v = ((c0 & 0x0F) << 12) | ((c1 & 0x3F) << 6) | (c2 & 0x3F);
     // Overlong and surrogate checks
-    if (v < 0x800) return false;
-    if (v >= 0xD800 && v <= 0xDFFF) return false;
+    if (v < 0x800) return 0;
+    if (v >= 0xD800 && v <= 0xDFFF) return 0;
     *cp = v;
-    return true;
+    return 3;
   }
 
   if ((c0 & 0xF8) == 0xF0) { // 4-byte
-    if (len < 4) return false;
+    if (len < 4) return 0;
     const unsigned char c1 = (unsigned char)s[1];
     const unsigned char c2 = (unsigned char)s[2];
     const unsigned char c3 = (unsigned char)s[3];
-    if ((c1 & 0xC0) != 0x80 || (c2 & 0xC0) != 0x80 || (c3 & 0xC0) != 0x80) return false;
+    if ((c1 & 0xC0) != 0x80 || (c2 & 0xC0) != 0x80 || (c3 & 0xC0) != 0x80) return 0;
     uint32_t v = ((c0 & 0x07) << 18) | ((c1 & 0x3F) << 12) |
                  ((c2 & 0x3F) << 6) | (c3 & 0x3F);
     // Overlong or out-of-range
-    if (v < 0x10000 || v > 0x10FFFF) return false;
+    if (v < 0x10000 || v > 0x10FFFF) return 0;
     *cp = v;
-    return true;
+    return 4;
   }
 
-  return false; // invalid leading byte
+  return 0; // invalid leading byte
 }
 
-static const uint8_t scancode_to_hid[NR_KEYS] = {
-    [1] = 0x29,  [2] = 0x1E,  [3] = 0x1F,  [4] = 0x20,  [5] = 0x21,
-    [6] = 0x22,  [7] = 0x23,  [8] = 0x24,  [9] = 0x25,  [10] = 0x26,
-    [11] = 0x27, [12] = 0x2D, [13] = 0x2E, [14] = 0x2A, [15] = 0x2B,
-    [16] = 0x14, [17] = 0x1A, [18] = 0x08, [19] = 0x15, [20] = 0x17,
-    [21] = 0x1C, [22] = 0x18, [23] = 0x0C, [24] = 0x12, [25] = 0x13,
-    [26] = 0x2F, [27] = 0x30, [28] = 0x28, [29] = 0x04, [30] = 0x16,
-    [31] = 0x07, [32] = 0x09, [33] = 0x0A, [34] = 0x0B, [35] = 0x0D,
-    [36] = 0x0E, [37] = 0x0F, [38] = 0x33, [39] = 0x34, [40] = 0x35,
-    [41] = 0xE1, [42] = 0x1D, [43] = 0x1B, [44] = 0x06, [45] = 0x19,
-    [46] = 0x05, [47] = 0x11, [48] = 0x10, [49] = 0x36, [50] = 0x37,
-    [51] = 0x38, [52] = 0xE5, [53] = 0x55, [54] = 0xE0, [55] = 0x2C,
-    [56] = 0x39, [57] = 0x3A, [58] = 0x3B, [59] = 0x3C, [60] = 0x3D,
-    [61] = 0x3E, [62] = 0x3F, [63] = 0x40, [64] = 0x41, [65] = 0x42,
-    [66] = 0x43, [67] = 0x53, [68] = 0x47, [69] = 0x5F, [70] = 0x60,
-    [71] = 0x61, [72] = 0x56, [73] = 0x5C, [74] = 0x5D, [75] = 0x5E,
-    [76] = 0x57, [77] = 0x59, [78] = 0x5A, [79] = 0x5B, [80] = 0x62,
-    [81] = 0x63};
+/* Key and modifiers that type cp with the current keymap. */
+static bool
+tnk_keymap_lookup(uint32_t cp, uint8_t *hid, uint8_t *mods)
+{
+  *mods = 0;
+  switch (cp) {
+    case '\n': *hid = 0x28; return true;
+    case '\t': *hid = 0x2B; return true;
+    default: break;
+  }
+  if (cp > TNK_KEYMAP_MAX_CP) return false;
 
-static mrb_value
-mrb_generate_hid_report(mrb_state *mrb, mrb_value self)
+  uint16_t e = keymap->pages[keymap->dir[cp >> 8]][cp & 0xFF];
+  if (e == 0) return false;
+  *hid = (uint8_t)(e & 0xFF);
+  *mods = (uint8_t)(e >> 8);
+  return true;
+}
+
+bool
+tnk_type_next(const uint8_t *text, uint32_t len, uint32_t *pos, bool *key_down,
+              uint8_t report[TNK_TYPE_REPORT_LEN])
 {
-  mrb_value *argv;
-  mrb_int argc;
-  mrb_get_args(mrb, "*", &argv, &argc);
+  memset(report, 0, TNK_TYPE_REPORT_LEN);
+  if (*key_down) {
+    uint32_t cp;
+    size_t n = utf8_next_cp((const char *)text + *pos, len - *pos, &cp);
+    *pos += n ? (uint32_t)n : 1;
+    *key_down = false;
+    return true;
+  }
+  while (*pos < len) {
+    uint32_t cp;
+    size_t n = utf8_next_cp((const char *)text + *pos, len - *pos, &cp);
+    if (n && tnk_keymap_lookup(cp, &report[2], &report[0])) {
+      *key_down = true;
+      return true;
+    }
+    *pos += n ? (uint32_t)n : 1;
+  }
+  return false;
+}
 
-  uint8_t report[8] = {0};
+/* Boot keyboard report holding the keys named by argv (symbols or characters). */
+static void
+tnk_keys_to_report(mrb_state *mrb, const mrb_value *argv, mrb_int argc, uint8_t report[8])
+{
   uint8_t modifier = 0;
+  memset(report, 0, 8);
   int key_slot = 0;
 
   for (int i = 0; i < argc && key_slot < 6; i++) {
@@ -485,14 +825,11 @@ mrb_generate_hid_report(mrb_state *mrb, mrb_value self)
       if (!utf8_next_cp(s, len, &cp))
         mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid UTF-8 sequence");
 
-      int sc = char_to_scancode[(unsigned char)cp];
-      if (sc < 0)
+      uint8_t hid, mods;
+      if (!tnk_keymap_lookup(cp, &hid, &mods))
         mrb_raise(mrb, E_ARGUMENT_ERROR, "character not in keymap");
 
-      uint8_t hid = scancode_to_hid[sc];
-      if (hid == 0x00)
-        mrb_raise(mrb, E_ARGUMENT_ERROR, "character has no HID mapping");
-
+      modifier |= mods;
       report[2 + key_slot++] = hid;
     } else {
       mrb_raisef(mrb, E_ARGUMENT_ERROR,
@@ -501,10 +838,265 @@ mrb_generate_hid_report(mrb_state *mrb, mrb_value self)
   }
 
   report[0] = modifier;
+}
+
+static mrb_value
+mrb_generate_hid_report(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *argv;
+  mrb_int argc;
+  mrb_get_args(mrb, "*", &argv, &argc);
+
+  uint8_t report[8];
+  tnk_keys_to_report(mrb, argv, argc, report);
   return mrb_str_new(mrb, (const char *)report, sizeof(report));
 }
 
 
+/*
+ * Hotkey automaton of a user VM, hung off user_mrb->ud.
+ *
+ * Hotkeys match on the set of keyboard usages held down, not on report
+ * bytes, so the order keys went down in and the array slot they landed in
+ * don't matter. Every registration is a path of steps: a plain hotkey is
+ * one step from node 0, a sequence (leader key, then more chords within
+ * a timeout) goes through nodes of its own. Steps are edges in one open
+ * addressed table keyed on (node, chord), and chords are hashed by XORing
+ * a per-usage constant, so a device's hash follows its pressed set key by
+ * key. A report costs one or two probes per key that changed, however many
+ * hotkeys there are.
+ *
+ * When a key goes down the whole pressed set is tried first, then just the
+ * held modifiers plus that key, so a stray non-modifier key doesn't block
+ * Shift+Z while a stray Ctrl does.
+ */
+#define TNK_HOTKEY_SLOTS       512
+#define TNK_HOTKEY_MAX_STEPS   8
+#define TNK_HOTKEY_TIMEOUT_MS  1000
+#define TNK_HOTKEY_MOD_WORD    3 /* usages 0xE0..0xE7 */
+#define TNK_HOTKEY_MOD_MASK    (0xFFULL << (0xE0 % 64))
+#define TNK_HOTKEY_BUDGET_MS   100  /* per block */
+#define TNK_USER_BUDGET_MS     5000 /* for running user.rb itself */
+#define TNK_BUDGET_CHECK_OPS   1024 /* instructions between clock reads */
+
+struct tnk_hotkey_edge {
+  uint64_t chord[TNK_HOTKEY_WORDS];
+  uint16_t from;       /* node the step leaves, 0: no sequence in progress */
+  uint16_t to;         /* node the step leads to, 0: ends here */
+  uint16_t press;      /* block index + 1 run once the chord is complete, 0: none */
+  uint16_t release;    /* block index + 1 run when a key of it goes up, 0: none */
+  uint32_t timeout_ms; /* how long `to` waits for the next step */
+};
+
+struct tnk_hotkeys {
+  uint32_t count;
+  uint16_t nodes; /* node ids handed out, 0 is the start */
+  mrb_value blocks;
+  struct RClass *text_class; /* Tnk::Hotkeys::Text */
+  uint64_t keys[TNK_HOTKEY_SLOTS];
+  uint8_t used[TNK_HOTKEY_SLOTS];
+  struct tnk_hotkey_edge edges[TNK_HOTKEY_SLOTS];
+  uint64_t deadline_ns; /* of the user code running now, 0: no budget */
+  uint32_t ops;
+  bool overrun;
+};
+
+static inline uint64_t
+tnk_hotkey_usage_hash(uint32_t usage)
+{
+  /* splitmix64 */
+  uint64_t z = (uint64_t)usage * 0x9E3779B97F4A7C15ULL + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static uint64_t
+tnk_hotkey_chord_hash(const uint64_t chord[TNK_HOTKEY_WORDS])
+{
+  uint64_t h = 0;
+  for (uint32_t w = 0; w < TNK_HOTKEY_WORDS; w++) {
+    for (uint64_t bits = chord[w]; bits; bits &= bits - 1) {
+      h ^= tnk_hotkey_usage_hash(w * 64 + (uint32_t)__builtin_ctzll(bits));
+    }
+  }
+  return h;
+}
+
+static inline uint32_t
+tnk_hotkey_slot(uint64_t key)
+{
+  return (uint32_t)(key >> 32) & (TNK_HOTKEY_SLOTS - 1);
+}
+
+static inline uint64_t
+tnk_hotkey_key(uint16_t from, uint64_t chord_hash)
+{
+  return chord_hash ^ tnk_hotkey_usage_hash(0x10000u + from);
+}
+
+static int
+tnk_hotkeys_find(const struct tnk_hotkeys *hk, uint16_t from, const uint64_t chord[TNK_HOTKEY_WORDS],
+                 uint64_t chord_hash)
+{
+  uint64_t key = tnk_hotkey_key(from, chord_hash);
+  for (uint32_t i = tnk_hotkey_slot(key);; i = (i + 1) & (TNK_HOTKEY_SLOTS - 1)) {
+    if (!hk->used[i]) return -1;
+    const struct tnk_hotkey_edge *e = &hk->edges[i];
+    if (hk->keys[i] == key && e->from == from && memcmp(e->chord, chord, sizeof(e->chord)) == 0) {
+      return (int)i;
+    }
+  }
+}
+
+/* Edge for a step, added if it isn't there yet. */
+static struct tnk_hotkey_edge *
+tnk_hotkeys_edge(mrb_state *mrb, struct tnk_hotkeys *hk, uint16_t from, const uint64_t chord[TNK_HOTKEY_WORDS])
+{
+  uint64_t hash = tnk_hotkey_chord_hash(chord);
+  int found = tnk_hotkeys_find(hk, from, chord, hash);
+  if (found >= 0) return &hk->edges[found];
+
+  /* keep the table at most half full so misses stay short */
+  if (hk->count >= TNK_HOTKEY_SLOTS / 2) {
+    mrb_raise(mrb, E_RANGE_ERROR, "too many hotkeys");
+  }
+  uint64_t key = tnk_hotkey_key(from, hash);
+  uint32_t i = tnk_hotkey_slot(key);
+  while (hk->used[i]) {
+    i = (i + 1) & (TNK_HOTKEY_SLOTS - 1);
+  }
+  hk->used[i] = 1;
+  hk->keys[i] = key;
+  hk->count++;
+  struct tnk_hotkey_edge *e = &hk->edges[i];
+  memset(e, 0, sizeof(*e));
+  memcpy(e->chord, chord, sizeof(e->chord));
+  e->from = from;
+  return e;
+}
+
+/* Keys named by a step: one key or an array of them. */
+static void
+tnk_hotkey_step_chord(mrb_state *mrb, mrb_value step, uint64_t chord[TNK_HOTKEY_WORDS])
+{
+  uint8_t report[8];
+  if (mrb_array_p(step)) {
+    tnk_keys_to_report(mrb, RARRAY_PTR(step), RARRAY_LEN(step), report);
+  } else {
+    tnk_keys_to_report(mrb, &step, 1, report);
+  }
+
+  memset(chord, 0, sizeof(uint64_t) * TNK_HOTKEY_WORDS);
+  for (uint32_t bit = 0; bit < 8; bit++) {
+    if (report[0] & (1u << bit)) tnk_hotkey_set(chord, 0xE0 + bit);
+  }
+  for (uint32_t i = 2; i < 8; i++) {
+    if (report[i]) tnk_hotkey_set(chord, report[i]);
+  }
+  if (!chord[0] && !chord[1] && !chord[2] && !chord[3]) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "hotkey step without keys");
+  }
+}
+
+/*
+ * register_hotkey(steps, trigger, timeout_ms, &blk): steps is an array of
+ * chords, each a key or an array of keys, trigger :press or :release.
+ */
+static mrb_value
+mrb_tnk_register_hotkey(mrb_state *mrb, mrb_value self)
+{
+  mrb_value steps, blk;
+  mrb_sym trigger;
+  mrb_int timeout_ms;
+  mrb_get_args(mrb, "Ani&", &steps, &trigger, &timeout_ms, &blk);
+  if (mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  if (RARRAY_LEN(steps) < 1 || RARRAY_LEN(steps) > TNK_HOTKEY_MAX_STEPS) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "a hotkey takes 1 to %d steps", TNK_HOTKEY_MAX_STEPS);
+  }
+  if (trigger != MRB_SYM(press) && trigger != MRB_SYM(release)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "trigger must be :press or :release");
+  }
+  if (timeout_ms <= 0 || timeout_ms > UINT32_MAX) {
+    timeout_ms = TNK_HOTKEY_TIMEOUT_MS;
+  }
+
+  struct tnk_hotkeys *hk = (struct tnk_hotkeys *)mrb->ud;
+  uint16_t node = 0;
+  uint64_t chord[TNK_HOTKEY_WORDS];
+  mrb_int last = RARRAY_LEN(steps) - 1;
+  for (mrb_int i = 0; i < last; i++) {
+    tnk_hotkey_step_chord(mrb, RARRAY_PTR(steps)[i], chord);
+    struct tnk_hotkey_edge *e = tnk_hotkeys_edge(mrb, hk, node, chord);
+    if (!e->to) {
+      if (hk->nodes == UINT16_MAX) {
+        mrb_raise(mrb, E_RANGE_ERROR, "too many hotkey sequences");
+      }
+      e->to = ++hk->nodes;
+    }
+    e->timeout_ms = (uint32_t)timeout_ms;
+    node = e->to;
+  }
+  tnk_hotkey_step_chord(mrb, RARRAY_PTR(steps)[last], chord);
+  struct tnk_hotkey_edge *e = tnk_hotkeys_edge(mrb, hk, node, chord);
+
+  uint16_t *block = trigger == MRB_SYM(press) ? &e->press : &e->release;
+  if (*block) {
+    mrb_ary_set(mrb, hk->blocks, *block - 1, blk);
+  } else {
+    if (RARRAY_LEN(hk->blocks) >= UINT16_MAX) {
+      mrb_raise(mrb, E_RANGE_ERROR, "too many hotkeys");
+    }
+    *block = (uint16_t)(RARRAY_LEN(hk->blocks) + 1);
+    mrb_ary_push(mrb, hk->blocks, blk);
+  }
+
+  return blk;
+}
+
+#define TNK_TYPE_MAX_PACE_MS 10000
+
+/*
+ * Tnk::Hotkeys.type(text, pace_ms = 0): a Text for a hotkey block to return,
+ * the forwarder types it on the host key by key. Every character is checked
+ * against the keymap here, so a typo in user.rb fails at the call site instead
+ * of silently dropping characters later.
+ */
+static mrb_value
+mrb_tnk_type(mrb_state *mrb, mrb_value self)
+{
+  mrb_value text;
+  mrb_int pace_ms = 0;
+  mrb_get_args(mrb, "S|i", &text, &pace_ms);
+
+  const char *s = RSTRING_PTR(text);
+  size_t len = (size_t)RSTRING_LEN(text);
+  if (len > TNK_RESULT_TEXT_MAX) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "text longer than %d bytes", TNK_RESULT_TEXT_MAX);
+  }
+  if (pace_ms < 0 || pace_ms > TNK_TYPE_MAX_PACE_MS) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "pace must be between 0 and %d ms", TNK_TYPE_MAX_PACE_MS);
+  }
+  for (size_t i = 0; i < len;) {
+    uint32_t cp;
+    uint8_t hid, mods;
+    size_t n = utf8_next_cp(s + i, len - i, &cp);
+    if (!n)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid UTF-8 sequence");
+    if (!tnk_keymap_lookup(cp, &hid, &mods))
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "U+%04x has no key in the keymap", (mrb_int)cp);
+    i += n;
+  }
+
+  const struct tnk_hotkeys *hk = (const struct tnk_hotkeys *)mrb->ud;
+  mrb_value t = mrb_obj_new(mrb, hk->text_class, 0, NULL);
+  mrb_iv_set(mrb, t, MRB_IVSYM(text), mrb_str_dup(mrb, text));
+  mrb_iv_set(mrb, t, MRB_IVSYM(pace), mrb_int_value(mrb, pace_ms));
+  return t;
+}
+
 static bool
 mrb_totally_normal_keyboard_user_init(mrb_state *user_mrb)
 {
@@ -515,87 +1107,490 @@ mrb_totally_normal_keyboard_user_init(mrb_state *user_mrb)
   struct RClass *hotkeys = mrb_define_module_under_id(user_mrb, tnk, MRB_SYM_2(user_mrb, Hotkeys));
   mrb_define_module_function_id(user_mrb, hotkeys, MRB_SYM_2(user_mbr, generate_hid_report),
                                 mrb_generate_hid_report, MRB_ARGS_ANY());
+  mrb_define_module_function_id(user_mrb, hotkeys, MRB_SYM_2(user_mrb, register_hotkey),
+                                mrb_tnk_register_hotkey, MRB_ARGS_REQ(3) | MRB_ARGS_BLOCK());
+  mrb_define_module_function_id(user_mrb, hotkeys, MRB_SYM_2(user_mrb, type),
+                                mrb_tnk_type, MRB_ARGS_ARG(1, 1));
+  struct tnk_hotkeys *hk = (struct tnk_hotkeys *)user_mrb->ud;
+  hk->text_class = mrb_define_class_under_id(user_mrb, hotkeys, MRB_SYM_2(user_mrb, Text),
+                                             user_mrb->object_class);
   return !user_mrb->exc;
 }
 
+/* tools/tnk/hotkeys.rb, compiled by mrbgem.rake */
+extern const uint8_t tnk_hotkeys_prelude[];
+
 static bool
 mrb_tnk_load_hotkeys(mrb_state *user_mrb)
 {
-  static const char hotkeys_rb[] = "class Tnk\n"
-                                   "  module Hotkeys\n"
-                                   "    @@hotkeys = {}\n"
-                                   "    def self.on(*args, &blk)\n"
-                                   "      raise \"no block given\" unless blk\n"
-                                   "      report = generate_hid_report(*args)\n"
-                                   "      @@hotkeys[report] = blk\n"
-                                   "    end\n"
-                                   "  end\n"
-                                   "end\n";
-  mrb_load_nstring(user_mrb, hotkeys_rb, sizeof(hotkeys_rb) - 1);
+  mrb_load_irep(user_mrb, tnk_hotkeys_prelude);
   return !user_mrb->exc;
 }
 
+static void
+mrb_tnk_user_mrb_close(mrb_state *user_mrb)
+{
+  struct tnk_hotkeys *hk = (struct tnk_hotkeys *)user_mrb->ud;
+  user_mrb->ud = NULL;
+  mrb_close(user_mrb);
+  free(hk);
+}
+
+#ifdef MRB_USE_DEBUG_HOOK
+/*
+ * Time budget of user code, checked every TNK_BUDGET_CHECK_OPS instructions.
+ * Once it ran out every further instruction raises, so a rescue in the
+ * block only gets as far as its first instruction.
+ */
+static void
+tnk_budget_hook(mrb_state *mrb, const struct mrb_irep *irep, const mrb_code *pc, mrb_value *regs)
+{
+  struct tnk_hotkeys *hk = (struct tnk_hotkeys *)mrb->ud;
+  if (!hk || !hk->deadline_ns) return;
+  if (!hk->overrun) {
+    if (++hk->ops % TNK_BUDGET_CHECK_OPS != 0 || tnk_now_ns() < hk->deadline_ns) return;
+    hk->overrun = true;
+  }
+  mrb_raise(mrb, E_RUNTIME_ERROR, "user code ran out of its time budget");
+}
+#endif
+
+static void
+tnk_budget_start(mrb_state *user_mrb, uint32_t ms)
+{
+  struct tnk_hotkeys *hk = (struct tnk_hotkeys *)user_mrb->ud;
+  hk->deadline_ns = tnk_now_ns() + (uint64_t)ms * 1000000ULL;
+  hk->ops = 0;
+  hk->overrun = false;
+}
+
+static void
+tnk_budget_stop(mrb_state *user_mrb)
+{
+  ((struct tnk_hotkeys *)user_mrb->ud)->deadline_ns = 0;
+}
+
 static mrb_state *
-mrb_tnk_user_mrb_init(mrb_state *mrb)
+mrb_tnk_user_mrb_new(void)
 {
   mrb_state *user_mrb = mrb_open_core();
   if (!user_mrb) {
     perror("mrb_open_core()");
     return NULL;
   }
-  if (!mrb_totally_normal_keyboard_user_init(user_mrb)) {
+  struct tnk_hotkeys *hk = (struct tnk_hotkeys *)calloc(1, sizeof(*hk));
+  if (!hk) {
+    perror("calloc(tnk_hotkeys)");
     mrb_close(user_mrb);
     return NULL;
   }
+  hk->blocks = mrb_ary_new(user_mrb);
+  mrb_gc_register(user_mrb, hk->blocks);
+  user_mrb->ud = hk;
+#ifdef MRB_USE_DEBUG_HOOK
+  user_mrb->code_fetch_hook = tnk_budget_hook;
+#endif
+
+  if (!mrb_totally_normal_keyboard_user_init(user_mrb)) {
+    mrb_tnk_user_mrb_close(user_mrb);
+    return NULL;
+  }
   if (!mrb_tnk_load_hotkeys(user_mrb)) {
-    mrb_close(user_mrb);
+    mrb_tnk_user_mrb_close(user_mrb);
     return NULL;
   }
-  mrb->ud = user_mrb;
   return user_mrb;
 }
 
-static mrb_value tnk_yield_block_protected(mrb_state *vm, void *block) {
-  return mrb_yield_argv(vm, *(mrb_value *)block, 0, NULL);
+static char user_rb_path[PATH_MAX];
+
+/*
+ * Bytecode cache of user.rb. The compiled irep is kept next to user.rb as
+ * user-<hash>.mrb, the hash covering the source and the build of tnk, so a
+ * start with an unchanged user.rb runs the cached bytecode and never parses.
+ * A snapshot of mruby may change its bytecode without a new release number,
+ * so the build is told apart by the release date and the size and mtime of
+ * the tnk binary as well. Storing a new one removes the others, editing
+ * user.rb leaves a single stale file at most.
+ */
+static void
+user_cache_path(char *path, size_t size, uint64_t hash)
+{
+  char dir[PATH_MAX];
+  memcpy(dir, user_rb_path, sizeof(dir));
+  snprintf(path, size, "%s/user-%016" PRIx64 ".mrb", dirname(dir), hash);
 }
 
-static mrb_value
-tnk_handle_hid_report_bridge(mrb_state *mrb, mrb_value self)
+static uint64_t
+user_cache_build(void)
 {
-  mrb_value buf;
-  mrb_get_args(mrb, "S", &buf);
+  char build[128];
+  struct stat st;
+  if (stat("/proc/self/exe", &st) != 0) memset(&st, 0, sizeof(st));
+  int n = snprintf(build, sizeof(build), "%d %s %lld %lld.%09ld", MRUBY_RELEASE_NO, MRUBY_RELEASE_DATE,
+                   (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+  return tnk_fnv1a64(build, (size_t)n);
+}
 
-  mrb_state *user_mrb = (mrb_state *)mrb->ud;
+static uint8_t *
+read_whole_file(const char *path, size_t *len)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return NULL;
+  struct stat st;
+  uint8_t *buf = NULL;
+  if (fstat(fd, &st) == 0 && (buf = (uint8_t *)malloc((size_t)st.st_size + 1))) {
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+      ssize_t n = read(fd, buf + got, (size_t)st.st_size - got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += (size_t)n;
+    }
+    if (got != (size_t)st.st_size) {
+      free(buf);
+      buf = NULL;
+    } else {
+      buf[got] = '\0';
+      *len = got;
+    }
+  }
+  close(fd);
+  return buf;
+}
 
-  struct RClass *tnk_h      = mrb_class_get_id(user_mrb, MRB_SYM_2(user_mrb, Tnk));
-  struct RClass *hotkeys_h  = mrb_module_get_under_id(user_mrb, tnk_h, MRB_SYM_2(user_mrb, Hotkeys));
-  mrb_value hotkeys_hash    = mrb_cv_get(user_mrb, mrb_obj_value(hotkeys_h), MRB_CVSYM_2(user_mrb, hotkeys));
-  if (!mrb_hash_p(hotkeys_hash)) {
-    mrb_raise(mrb, E_TYPE_ERROR, "not a hash");
+static void
+user_cache_store(const char *path, const uint8_t *bin, size_t len)
+{
+  char tmp[PATH_MAX + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) return;
+  while (len > 0) {
+    ssize_t n = write(fd, bin, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    bin += n;
+    len -= (size_t)n;
+  }
+  if (len != 0 || fsync(fd) != 0) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  close(fd);
+  if (rename(tmp, path) != 0) {
+    unlink(tmp);
+    return;
   }
 
-  mrb_value key_h = mrb_str_new(user_mrb, RSTRING_PTR(buf), RSTRING_LEN(buf));
-  mrb_value blk   = mrb_hash_get(user_mrb, hotkeys_hash, key_h);
-  if (mrb_type(blk) != MRB_TT_PROC) {
-    mrb_gc_arena_restore(user_mrb, 0);
-    return mrb_nil_value();
+  char dir[PATH_MAX];
+  memcpy(dir, path, sizeof(dir));
+  const char *name = strrchr(path, '/') + 1;
+  DIR *d = opendir(dirname(dir));
+  if (!d) return;
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    size_t n = strlen(e->d_name);
+    if (strncmp(e->d_name, "user-", 5) == 0 && n > 4 && strcmp(e->d_name + n - 4, ".mrb") == 0 &&
+        strcmp(e->d_name, name) != 0) {
+      unlinkat(dirfd(d), e->d_name, 0);
+    }
   }
+  closedir(d);
+}
+
+/* Runs user.rb in user_mrb, from the cache if it holds it. */
+static bool
+mrb_tnk_user_mrb_run(mrb_state *user_mrb)
+{
+  size_t src_len;
+  uint8_t *src = read_whole_file(user_rb_path, &src_len);
+  if (!src) {
+    perror("user.rb");
+    return false;
+  }
+  uint64_t hash = tnk_fnv1a64(src, src_len) ^ user_cache_build();
+  char cache[PATH_MAX + 32];
+  user_cache_path(cache, sizeof(cache), hash);
+
+  size_t bin_len;
+  uint8_t *bin = read_whole_file(cache, &bin_len);
+  mrb_irep *irep = bin ? mrb_read_irep_buf(user_mrb, bin, bin_len) : NULL;
+  free(bin);
+  struct RProc *proc;
+  if (irep) {
+    proc = mrb_proc_new(user_mrb, irep);
+    mrb_irep_decref(user_mrb, irep);
+  } else {
+    mrbc_context *cxt = mrbc_context_new(user_mrb);
+    mrbc_filename(user_mrb, cxt, "user.rb");
+    cxt->no_exec = TRUE;
+    mrb_value v = mrb_load_nstring_cxt(user_mrb, (const char *)src, src_len, cxt);
+    mrbc_context_free(user_mrb, cxt);
+    if (user_mrb->exc) {
+      free(src);
+      return false;
+    }
+    proc = mrb_proc_ptr(v);
+    uint8_t *dump;
+    if (mrb_dump_irep(user_mrb, proc->body.irep, MRB_DUMP_DEBUG_INFO, &dump, &bin_len) == MRB_DUMP_OK) {
+      user_cache_store(cache, dump, bin_len);
+      mrb_free(user_mrb, dump);
+    }
+  }
+  free(src);
+  mrb_top_run(user_mrb, proc, mrb_top_self(user_mrb), 0);
+  return !user_mrb->exc;
+}
+
+/* A fresh user VM running user.rb, NULL with the error printed if it fails. */
+static mrb_state *
+mrb_tnk_user_mrb_load(void)
+{
+  mrb_state *user_mrb = mrb_tnk_user_mrb_new();
+  if (!user_mrb) return NULL;
+
+  tnk_budget_start(user_mrb, TNK_USER_BUDGET_MS);
+  bool ok = mrb_tnk_user_mrb_run(user_mrb);
+  tnk_budget_stop(user_mrb);
+  if (!ok) {
+    if (user_mrb->exc) mrb_print_error(user_mrb);
+    mrb_tnk_user_mrb_close(user_mrb);
+    return NULL;
+  }
+  mrb_gc_arena_restore(user_mrb, 0);
+  return user_mrb;
+}
+
+/*
+ * Hot reload of user.rb. Its directory is watched rather than the file, as
+ * editors tend to save by renaming a new file over the old one. The user VM
+ * thread swaps VMs between two hotkey events, forwarding doesn't pause at
+ * all, and a user.rb that doesn't load leaves the running hotkeys alone.
+ */
+int
+tnk_user_watch(void)
+{
+  char dir[PATH_MAX];
+  memcpy(dir, user_rb_path, sizeof(dir));
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1 || inotify_add_watch(fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    perror("user.rb hot reload disabled");
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool
+tnk_user_changed(const uint8_t *events, size_t len)
+{
+  const char *name = strrchr(user_rb_path, '/') + 1;
+  for (size_t off = 0; off + sizeof(struct inotify_event) <= len;) {
+    struct inotify_event ev;
+    memcpy(&ev, events + off, sizeof(ev));
+    if (ev.len && off + sizeof(ev) + ev.len <= len &&
+        strncmp((const char *)events + off + sizeof(ev), name, ev.len) == 0) {
+      return true;
+    }
+    off += sizeof(ev) + ev.len;
+  }
+  return false;
+}
+
+bool
+tnk_user_reload(mrb_state **user_mrb)
+{
+  mrb_state *fresh = mrb_tnk_user_mrb_load();
+  if (!fresh) {
+    fprintf(stderr, "user.rb: keeping the hotkeys loaded before\n");
+    return false;
+  }
+  mrb_state *old = *user_mrb;
+  *user_mrb = fresh;
+  mrb_tnk_user_mrb_close(old);
+  fprintf(stderr, "user.rb reloaded\n");
+  return true;
+}
+
+static mrb_value tnk_yield_block_protected(mrb_state *vm, void *block) {
+  return mrb_yield_argv(vm, *(mrb_value *)block, 0, NULL);
+}
+
+/* Runs a hotkey block in the user VM under its time budget, nil if it
+ * failed. The caller restores the arena. */
+static mrb_value
+tnk_hotkeys_invoke(mrb_state *user_mrb, uint16_t block)
+{
+  const struct tnk_hotkeys *hk = (const struct tnk_hotkeys *)user_mrb->ud;
+  mrb_value blk = mrb_ary_entry(hk->blocks, block - 1);
 
   mrb_bool err  = FALSE;
+  tnk_budget_start(user_mrb, TNK_HOTKEY_BUDGET_MS);
   mrb_value ret = mrb_protect_error(user_mrb, tnk_yield_block_protected, &blk, &err);
+  tnk_budget_stop(user_mrb);
   if (user_mrb->exc || err) {
+    if (err) user_mrb->exc = mrb_obj_ptr(ret);
     mrb_print_error(user_mrb);
     mrb_clear_error(user_mrb);
-    mrb_gc_arena_restore(user_mrb, 0);
-    mrb_raise(mrb, E_RUNTIME_ERROR, "user mode vm error");
-    return mrb_false_value();
+    return mrb_nil_value();
   }
 
-  ret = mrb_msgpack_unpack(mrb, mrb_msgpack_pack(user_mrb, ret));
-  mrb_gc_arena_restore(user_mrb, 0);
   return ret;
 }
 
+#define TNK_RESULT_MAX_DEPTH 4
+
+/*
+ * Copies what a hotkey block returned into the result ring: strings of the
+ * trigger's report length become reports, Texts are kept for typing, arrays
+ * are flattened, integers and booleans are kept as immediates. Anything else,
+ * including strings of another length, is not meant for the host and ignored.
+ */
+static void
+tnk_results_push(mrb_state *user_mrb, struct tnk_result_ring *ring, mrb_value v,
+                 size_t report_len, int depth)
+{
+  const struct tnk_hotkeys *hk = (const struct tnk_hotkeys *)user_mrb->ud;
+  struct tnk_result *r;
+
+  switch (mrb_type(v)) {
+    case MRB_TT_OBJECT: {
+      if (mrb_obj_class(user_mrb, v) != hk->text_class) return;
+      mrb_value text = mrb_iv_get(user_mrb, v, MRB_IVSYM(text));
+      mrb_value pace = mrb_iv_get(user_mrb, v, MRB_IVSYM(pace));
+      if (!mrb_string_p(text) || !mrb_integer_p(pace)) return;
+      if (RSTRING_LEN(text) == 0 || RSTRING_LEN(text) > TNK_RESULT_TEXT_MAX) return;
+      r = tnk_result_reserve(ring, TNK_RESULT_TEXT, (uint32_t)RSTRING_LEN(text));
+      if (!r) return;
+      memcpy(r->data, RSTRING_PTR(text), RSTRING_LEN(text));
+      r->value = (int32_t)(mrb_integer(pace) * 1000);
+      break;
+    }
+    case MRB_TT_STRING:
+      if ((size_t)RSTRING_LEN(v) != report_len) return;
+      r = tnk_result_reserve(ring, TNK_RESULT_REPORT, (uint32_t)report_len);
+      if (!r) return;
+      memcpy(r->data, RSTRING_PTR(v), report_len);
+      break;
+    case MRB_TT_ARRAY:
+      if (depth >= TNK_RESULT_MAX_DEPTH) return;
+      for (mrb_int i = 0; i < RARRAY_LEN(v); i++) {
+        tnk_results_push(user_mrb, ring, RARRAY_PTR(v)[i], report_len, depth + 1);
+      }
+      return;
+    case MRB_TT_INTEGER:
+      if (mrb_integer(v) < INT32_MIN || mrb_integer(v) > INT32_MAX) return;
+      r = tnk_result_reserve(ring, TNK_RESULT_INTEGER, 0);
+      if (!r) return;
+      r->value = (int32_t)mrb_integer(v);
+      break;
+    case MRB_TT_TRUE:
+      r = tnk_result_reserve(ring, TNK_RESULT_TRUE, 0);
+      if (!r) return;
+      break;
+    case MRB_TT_FALSE:
+      if (mrb_nil_p(v)) return;
+      r = tnk_result_reserve(ring, TNK_RESULT_FALSE, 0);
+      if (!r) return;
+      break;
+    default:
+      return;
+  }
+  tnk_result_commit(ring, r);
+}
+
+static void
+tnk_hotkeys_fire(mrb_state *user_mrb, uint16_t block, size_t report_len, struct tnk_result_ring *results)
+{
+  mrb_value ret = tnk_hotkeys_invoke(user_mrb, block);
+  uint32_t dropped = results->dropped;
+  tnk_results_push(user_mrb, results, ret, report_len, 0);
+  if (results->dropped != dropped) {
+    fprintf(stderr, "hotkey results dropped, ring full\n");
+  }
+  mrb_gc_arena_restore(user_mrb, 0);
+}
+
+/* The step a key going down completes from the device's node, -1 if none. */
+static int
+tnk_hotkeys_step(const struct tnk_hotkeys *hk, const struct tnk_hotkey_state *st, uint16_t node,
+                 uint32_t usage)
+{
+  int e = tnk_hotkeys_find(hk, node, st->pressed, st->hash);
+  if (e >= 0) return e;
+
+  uint64_t chord[TNK_HOTKEY_WORDS] = {0};
+  chord[TNK_HOTKEY_MOD_WORD] = st->pressed[TNK_HOTKEY_MOD_WORD] & TNK_HOTKEY_MOD_MASK;
+  tnk_hotkey_set(chord, usage);
+  if (memcmp(chord, st->pressed, sizeof(chord)) == 0) return -1;
+  return tnk_hotkeys_find(hk, node, chord, tnk_hotkey_chord_hash(chord));
+}
+
+bool
+tnk_hotkeys_dispatch(mrb_state *user_mrb, struct tnk_hotkey_state *st, const uint64_t pressed[TNK_HOTKEY_WORDS],
+                     size_t report_len, struct tnk_result_ring *results)
+{
+  const struct tnk_hotkeys *hk = (const struct tnk_hotkeys *)user_mrb->ud;
+  bool fired = false;
+  uint64_t now = 0;
+
+  for (uint32_t w = 0; w < TNK_HOTKEY_WORDS; w++) {
+    for (uint64_t changed = st->pressed[w] ^ pressed[w]; changed; changed &= changed - 1) {
+      uint32_t usage = w * 64 + (uint32_t)__builtin_ctzll(changed);
+      uint64_t bit = 1ULL << (usage % 64);
+      st->pressed[w] ^= bit;
+      st->hash ^= tnk_hotkey_usage_hash(usage);
+      if (hk->count == 0) continue;
+
+      if (!(pressed[w] & bit)) {
+        if (st->armed && (hk->edges[st->armed - 1].chord[w] & bit)) {
+          uint16_t block = hk->edges[st->armed - 1].release;
+          st->armed = 0;
+          tnk_hotkeys_fire(user_mrb, block, report_len, results);
+          fired = true;
+        }
+        continue;
+      }
+
+      if (st->node) {
+        if (!now) now = tnk_now_ns();
+        if (now > st->deadline_ns) st->node = 0;
+      }
+      int e = tnk_hotkeys_step(hk, st, (uint16_t)st->node, usage);
+      if (e < 0 && st->node) {
+        /* off the sequence, the key may start something else */
+        st->node = 0;
+        e = tnk_hotkeys_step(hk, st, 0, usage);
+      }
+      if (e < 0) continue;
+
+      const struct tnk_hotkey_edge *edge = &hk->edges[e];
+      st->node = edge->to;
+      if (edge->to) {
+        if (!now) now = tnk_now_ns();
+        st->deadline_ns = now + (uint64_t)edge->timeout_ms * 1000000ULL;
+      }
+      if (edge->release) {
+        st->armed = (uint32_t)e + 1;
+      }
+      if (edge->press) {
+        tnk_hotkeys_fire(user_mrb, edge->press, report_len, results);
+        fired = true;
+      }
+    }
+  }
+  return fired;
+}
+
+#define TNK_WORKER_STABLE_MS 10000 /* a worker that ran this long didn't crash on startup */
+#define TNK_RESPAWN_MIN_MS   10
+#define TNK_RESPAWN_MAX_MS   5000
+#define TNK_RESPAWN_MAX      10   /* early exits in a row before giving up */
+
 static void
 block_signals(sigset_t *mask)
 {
@@ -603,12 +1598,168 @@ block_signals(sigset_t *mask)
   sigaddset(mask, SIGINT);
   sigaddset(mask, SIGTERM);
   sigaddset(mask, SIGCHLD);
+  sigaddset(mask, SIGUSR1);
   if (sigprocmask(SIG_BLOCK, mask, NULL) == -1) {
     perror("sigprocmask");
     exit(1);
   }
 }
 
+/*
+ * Asks the worker to write its forwarding statistics. The file is opened here,
+ * the worker may not be allowed to create it after dropping privileges.
+ */
+static void
+request_stats(int control_fd)
+{
+  const char *path = getenv("TNK_STATS_FILE");
+  if (!path) path = "/run/tnk.stats";
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror(path);
+    return;
+  }
+  struct tnk_control_msg msg = { .type = TNK_CONTROL_DUMP_STATS };
+  if (tnk_control_send(control_fd, &msg, &fd, 1) == -1) {
+    perror("stats: sendmsg");
+  }
+  close(fd);
+}
+
+/*
+ * The worker: drops privileges, builds the forwarder and the user VM from
+ * what setup_root left in mrb and forwards until told to stop. Never returns.
+ */
+static void
+run_worker(mrb_state *mrb, const sigset_t *mask, int uevent_fd, int control[2])
+{
+  int rc = 0;
+  mrb_state *user_mrb = NULL;
+  struct RClass *tnk_cls = mrb_class_get_id(mrb, MRB_SYM(Tnk));
+  mrb_value tnk = mrb_obj_value(tnk_cls);
+  /* stats requests reach us through the control socket */
+  signal(SIGUSR1, SIG_IGN);
+  sigprocmask(SIG_UNBLOCK, mask, NULL);
+  if (uevent_fd != -1) close(uevent_fd);
+  close(control[0]);
+  tnk_control_fd = control[1];
+
+  tnk_rt_setup();
+  const char *drop_user = getenv("TNK_DROP_USER");
+  if (!drop_user) drop_user = "nobody";
+  drop_privileges(mrb, drop_user);
+  if (mrb->exc) {
+    rc = 1;
+    goto cleanup;
+  }
+  mrb_gv_set(mrb, MRB_GVSYM(USER_MRB), mrb_true_value());
+  mrb_define_module_function_id(mrb, tnk_cls, MRB_SYM(gen_keymap), gen_keymap,
+                                MRB_ARGS_NONE());
+  tnk_forwarder_init(mrb, tnk_cls);
+  mrb_funcall_id(mrb, tnk, MRB_SYM(setup_user), 0);
+  if (mrb->exc) {
+    rc = 1;
+    goto cleanup;
+  }
+  mrb_gc_arena_restore(mrb, 0);
+  mrb_value path = resolve_tnk_path(mrb, "../share/totally-normal-keyboard/user.rb", R_OK);
+  if (mrb->exc) {
+    rc = 1;
+    goto cleanup;
+  }
+  if ((size_t)RSTRING_LEN(path) >= sizeof(user_rb_path)) {
+    fprintf(stderr, "user.rb: path too long\n");
+    rc = 1;
+    goto cleanup;
+  }
+  memcpy(user_rb_path, RSTRING_PTR(path), (size_t)RSTRING_LEN(path));
+  if (!tnk_arena_init()) {
+    rc = 1;
+    goto cleanup;
+  }
+  tnk_arena_enter();
+  user_mrb = mrb_tnk_user_mrb_load();
+  tnk_arena_leave();
+  if (user_mrb == NULL) {
+    rc = 1;
+    goto cleanup;
+  }
+  mrb->ud = user_mrb;
+  mrb_gc_arena_restore(mrb, 0);
+  mrb_funcall_id(mrb, tnk, MRB_SYM(run), 0);
+
+cleanup:
+  if (mrb->exc && errno != EINTR) {
+    rc = 1;
+    mrb_print_error(mrb);
+  }
+  mrb_clear_error(mrb);
+  /* the user VM thread may have swapped in a reloaded one */
+  mrb_state *ran = tnk_vm_stop();
+  user_mrb = ran ? ran : (mrb_state *)mrb->ud;
+  mrb_close(mrb);
+  mrb = NULL;
+  if (user_mrb) {
+    if (user_mrb->exc) {
+      mrb_print_error(user_mrb);
+      mrb_clear_error(user_mrb);
+    }
+    mrb_tnk_user_mrb_close(user_mrb);
+    user_mrb = NULL;
+  }
+  _Exit(rc);
+}
+
+/*
+ * Forks a worker with a control socket of its own, the root end goes to
+ * *control_fd. The gadget, the hidraw/hidg fds, the injection sockets and the
+ * capture mapping stay with the root process, so a worker that died can be
+ * replaced without the host seeing the device go away.
+ */
+static pid_t
+spawn_worker(mrb_state *mrb, const sigset_t *mask, int uevent_fd, int *control_fd)
+{
+  int control[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) == -1) {
+    perror("socketpair");
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(control[0]);
+    close(control[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    run_worker(mrb, mask, uevent_fd, control);
+  }
+  close(control[1]);
+  *control_fd = control[0];
+  return pid;
+}
+
+/*
+ * How long to wait before replacing a worker that exited on its own. One that
+ * ran for a while is replaced right away, one that keeps dying right after
+ * starting waits twice as long each time. -1: give up and leave it to the
+ * service manager.
+ */
+static int64_t
+respawn_delay_ms(uint64_t ran_ns, uint32_t *quick_exits)
+{
+  if (ran_ns >= (uint64_t)TNK_WORKER_STABLE_MS * 1000000ULL) {
+    *quick_exits = 0;
+    return 0;
+  }
+  uint32_t n = (*quick_exits)++;
+  if (n >= TNK_RESPAWN_MAX) return -1;
+  if (n == 0) return 0;
+  int64_t ms = (int64_t)TNK_RESPAWN_MIN_MS << (n - 1);
+  return ms > TNK_RESPAWN_MAX_MS ? TNK_RESPAWN_MAX_MS : ms;
+}
+
 int main(int argc, char *argv[])
 {
   sigset_t mask;
@@ -638,6 +1789,12 @@ int main(int argc, char *argv[])
 
   struct RClass *tnk_cls = mrb_class_get_id(mrb, MRB_SYM(Tnk));
   mrb_value tnk = mrb_obj_value(tnk_cls);
+
+  /* subscribe before the gadget is built so no device slips through */
+  int uevent_fd = tnk_uevent_open();
+  if (uevent_fd == -1) {
+    perror("hotplug disabled: uevent socket");
+  }
   mrb_funcall_id(mrb, tnk, MRB_SYM(setup_root), 0);
   if (mrb->exc) {
     mrb_print_error(mrb);
@@ -647,91 +1804,60 @@ int main(int argc, char *argv[])
     return 1;
   }
   mrb_gc_arena_restore(mrb, 0);
-
-  pid_t pid = fork();
+  /* opened here, the worker may not bind them after dropping privileges */
+  mrb_value share_dir = resolve_tnk_path(mrb, "../share/totally-normal-keyboard", F_OK);
+  tnk_inject_listen(mrb->exc ? NULL : RSTRING_CSTR(mrb, share_dir));
+  mrb_clear_error(mrb);
+  tnk_capture_open();
+
+  int control_fd = -1;
+  pid_t pid = spawn_worker(mrb, &mask, uevent_fd, &control_fd);
   if (pid < 0) {
-    perror("fork");
+    tnk_inject_close();
+    tnk_inject_unlink();
+    tnk_capture_close();
     close(sfd);
     mrb_close(mrb);
     mrb = NULL;
     return 1;
   }
+  uint64_t started_ns = tnk_now_ns();
+  uint64_t respawn_ns = 0; /* when to fork the next worker, 0: one is running */
+  uint32_t quick_exits = 0;
+  bool stopping = false;
 
-  if (pid == 0) {
-    int rc = 0;
-    mrb_state *user_mrb = NULL;
-    sigprocmask(SIG_UNBLOCK, &mask, NULL);
-
-    const char *drop_user = getenv("TNK_DROP_USER");
-    if (!drop_user) drop_user = "nobody";
-    drop_privileges(mrb, drop_user);
-    if (mrb->exc) {
-      rc = 1;
-      goto child_cleanup;
-    }
-    mrb_gv_set(mrb, MRB_GVSYM(USER_MRB), mrb_true_value());
-    struct RClass *hotkeys = mrb_define_module_under_id(mrb, tnk_cls, MRB_SYM(Hotkeys));
-    mrb_define_module_function_id(mrb, hotkeys, MRB_SYM(handle_hid_report),
-                                  tnk_handle_hid_report_bridge,
-                                  MRB_ARGS_REQ(1));
-    mrb_define_module_function_id(mrb, tnk_cls, MRB_SYM(gen_keymap), gen_keymap,
-                                  MRB_ARGS_NONE());
-    mrb_funcall_id(mrb, tnk, MRB_SYM(setup_user), 0);
-    if (mrb->exc) {
-      rc = 1;
-      goto child_cleanup;
-    }
-    user_mrb = mrb_tnk_user_mrb_init(mrb);
-    if (user_mrb == NULL) {
-      rc = 1;
-      goto child_cleanup;
-    }
-
-    mrb_value path = resolve_tnk_path(mrb, "../share/totally-normal-keyboard/user.rb", R_OK);
-    if (mrb->exc) {
-      rc = 1;
-      goto child_cleanup;
-    }
+  int exit_code = 0;
+  struct pollfd pfds[2] = {
+    { .fd = sfd,       .events = POLLIN },
+    { .fd = uevent_fd, .events = POLLIN },
+  };
 
-    FILE *fp = fopen(RSTRING_CSTR(mrb, path), "r");
-    if (!fp) {
-      perror("user.rb");
-      rc = 1;
-      goto child_cleanup;
-    }
-    mrb_load_file(user_mrb, fp);
-    fclose(fp);
-    if (user_mrb->exc) {
-      rc = 1;
-      goto child_cleanup;
+  for (;;) {
+    int timeout = -1;
+    if (respawn_ns) {
+      uint64_t now = tnk_now_ns();
+      timeout = now >= respawn_ns ? 0 : (int)((respawn_ns - now + 999999) / 1000000);
     }
-    mrb_gc_arena_restore(user_mrb, 0);
-    mrb_gc_arena_restore(mrb, 0);
-    mrb_funcall_id(mrb, tnk, MRB_SYM(run), 0);
-
-  child_cleanup:
-    if (mrb->exc && errno != EINTR) {
-      rc = 1;
-      mrb_print_error(mrb);
+    if (poll(pfds, 2, timeout) == -1) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      exit_code = 1;
+      break;
     }
-    mrb_clear_error(mrb);
-    mrb_close(mrb);
-    mrb = NULL;
-    if (user_mrb) {
-      if (user_mrb->exc) {
-        mrb_print_error(user_mrb);
-        mrb_clear_error(user_mrb);
+    if (respawn_ns && tnk_now_ns() >= respawn_ns) {
+      pid = spawn_worker(mrb, &mask, uevent_fd, &control_fd);
+      if (pid < 0) {
+        exit_code = 1;
+        break;
       }
-      mrb_close(user_mrb);
-      user_mrb = NULL;
+      started_ns = tnk_now_ns();
+      respawn_ns = 0;
     }
-    _Exit(rc);
-  }
-
-  int child_exited = 0;
-  int exit_code = 0;
+    if (pfds[1].revents & POLLIN) {
+      tnk_hotplug_dispatch(mrb, uevent_fd, control_fd);
+    }
+    if (!(pfds[0].revents & POLLIN)) continue;
 
-  for (;;) {
     struct signalfd_siginfo si;
     ssize_t res = read(sfd, &si, sizeof(si));
     if (res != sizeof(si)) {
@@ -744,23 +1870,50 @@ int main(int argc, char *argv[])
     if (si.ssi_signo == SIGCHLD) {
       int status;
       pid_t wpid;
+      bool exited = false;
       while ((wpid = waitpid(-1, &status, WNOHANG)) > 0) {
         if (wpid == pid) {
-          child_exited = 1;
+          exited = true;
           if (WIFEXITED(status))
             exit_code = WEXITSTATUS(status);
           else if (WIFSIGNALED(status))
             exit_code = 128 + WTERMSIG(status);
         }
       }
+      if (!exited) continue;
+      pid = -1;
+      close(control_fd);
+      control_fd = -1;
+      if (stopping) break;
+
+      int64_t delay = respawn_delay_ms(tnk_now_ns() - started_ns, &quick_exits);
+      if (delay < 0) {
+        fprintf(stderr, "worker failed %" PRIu32 " times right after starting, giving up\n",
+                quick_exits);
+        break;
+      }
+      fprintf(stderr, "worker exited (%d), replacing it in %" PRId64 " ms\n", exit_code, delay);
+      mrb_funcall_id(mrb, tnk, MRB_SYM(release), 0);
+      if (mrb->exc) {
+        mrb_print_error(mrb);
+        mrb_clear_error(mrb);
+      }
+      mrb_gc_arena_restore(mrb, 0);
+      respawn_ns = tnk_now_ns() + (uint64_t)delay * 1000000ULL;
     } else if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) {
+      stopping = true;
+      if (pid < 0) break;
       kill(pid, si.ssi_signo);
+    } else if (si.ssi_signo == SIGUSR1 && control_fd != -1) {
+      request_stats(control_fd);
     }
-
-    if (child_exited)
-      break;
   }
 
+  if (control_fd != -1) close(control_fd);
+  if (uevent_fd != -1) close(uevent_fd);
+  tnk_inject_close();
+  tnk_inject_unlink();
+  tnk_capture_close();
   mrb_close(mrb);
   mrb = NULL;
 
@@ -0,0 +1,109 @@
+#ifndef TNK_H
+#define TNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <mruby.h>
+
+/* messages from the root process to the worker, fds travel as SCM_RIGHTS */
+enum tnk_control_type {
+  TNK_CONTROL_ADD_PAIR = 1,   /* fds: hidraw, hidg */
+  TNK_CONTROL_DUMP_STATS = 2, /* fds: stats file to write and close */
+  TNK_CONTROL_ADD_EVDEV = 3,  /* fds: input event device */
+};
+
+struct tnk_control_msg {
+  uint32_t type;
+  uint32_t report_len;
+  /* ADD_PAIR onto the composite function: report IDs by the device's own
+   * (see Tnk::Hidg), all zero for a function of the device's own */
+  uint8_t id_map[256];
+};
+
+struct tnk_result_ring;
+
+#define TNK_HOTKEY_WORDS 4 /* bitmap of the 256 keyboard page usages */
+
+/* Hotkey matching state of one input device, zero is a device with nothing
+ * held down. */
+struct tnk_hotkey_state {
+  uint64_t pressed[TNK_HOTKEY_WORDS];
+  uint64_t hash;        /* of pressed, see tnk.c */
+  uint64_t deadline_ns; /* for the next step of a sequence */
+  uint32_t node;        /* sequence position, 0: none */
+  uint32_t armed;       /* edge + 1 whose block runs on release, 0: none */
+};
+
+static inline void
+tnk_hotkey_set(uint64_t pressed[TNK_HOTKEY_WORDS], uint32_t usage)
+{
+  if (usage < TNK_HOTKEY_WORDS * 64) pressed[usage / 64] |= 1ULL << (usage % 64);
+}
+
+#define TNK_FWD_MAX_PAIRS 16
+
+/* tnk.c */
+extern int tnk_control_fd; /* worker end of the control socket, -1 if none */
+/* Moves a device to the keys now held in pressed, running the hotkeys that
+ * completes and appending what their blocks returned to results. Returns
+ * whether any ran. report_len is what returned reports must measure. A
+ * block that fails or runs out of its time budget has its error printed
+ * and returns nothing. */
+bool tnk_hotkeys_dispatch(mrb_state *user_mrb, struct tnk_hotkey_state *state,
+                          const uint64_t pressed[TNK_HOTKEY_WORDS], size_t report_len,
+                          struct tnk_result_ring *results);
+
+/* HID keyboard usage of a Linux keycode, 0 if it has none */
+uint8_t tnk_keycode_to_hid(uint32_t code);
+
+/* user.rb hot reload: an inotify fd watching its directory (-1 if that
+ * fails), whether a batch of events read from it touches user.rb, and the
+ * swap of *user_mrb for a fresh VM running the new file. A file that
+ * doesn't load keeps the old VM, reload returns false then. */
+int tnk_user_watch(void);
+bool tnk_user_changed(const uint8_t *events, size_t len);
+bool tnk_user_reload(mrb_state **user_mrb);
+
+#define TNK_TYPE_REPORT_LEN 8
+/* Fills report with the next boot keyboard report for typing text: a press
+ * for the character at *pos, then the release, which advances *pos.
+ * Characters without a key are skipped. Returns false once text is done. */
+bool tnk_type_next(const uint8_t *text, uint32_t len, uint32_t *pos, bool *key_down,
+                   uint8_t report[TNK_TYPE_REPORT_LEN]);
+
+/* vm.c */
+struct tnk_vm_stats {
+  uint64_t events;  /* key changes posted */
+  uint64_t dropped; /* posts that found the event ring full */
+  uint64_t reloads;
+  uint64_t objects; /* live in the user VM after the last events */
+};
+/* Hands user_mrb over to the user VM thread, which runs the hotkeys from
+ * then on. fds[0] is the eventfd to write to after posting, fds[1] becomes
+ * readable once results were committed. */
+bool tnk_vm_start(mrb_state *user_mrb, struct tnk_result_ring *results, int fds[2]);
+/* Forwarder: the keys a pair holds changed. false if the pair's ring is
+ * full. Only the thread forwarding the pair posts for it. */
+bool tnk_vm_post(uint32_t pair, uint32_t gen, const uint64_t pressed[TNK_HOTKEY_WORDS],
+                 uint32_t report_len);
+/* Sends the results of a pair to a ring of its own and wakes result_fd once
+ * they are committed, results NULL sends them back to the forwarder's. Must
+ * happen before anything is posted for the pair. */
+void tnk_vm_route(uint32_t pair, struct tnk_result_ring *results, int result_fd);
+void tnk_vm_stats(struct tnk_vm_stats *stats);
+/* Joins the thread, returning the user VM it ran last, NULL if none ran. */
+mrb_state *tnk_vm_stop(void);
+
+/* forward.c */
+void tnk_forwarder_init(mrb_state *mrb, struct RClass *tnk);
+
+/* hotplug.c */
+int tnk_uevent_open(void);
+void tnk_hotplug_dispatch(mrb_state *mrb, int uevent_fd, int control_fd);
+int tnk_control_send(int sock, const struct tnk_control_msg *msg, const int *fds, size_t nfds);
+/* 1: got a message (type 0 if malformed), 0: nothing queued, -1: error/hangup.
+ * Up to two fds are passed, missing ones are -1. */
+int tnk_control_recv(int sock, struct tnk_control_msg *msg, int fds[2]);
+
+#endif
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <mruby.h>
+
+#include "arena.h"
+#include "realtime.h"
+#include "result_ring.h"
+#include "stats.h"
+#include "tnk.h"
+
+/*
+ * The user VM thread.
+ *
+ * Hotkey blocks are user code: they may loop, grind or simply be slow, and
+ * none of that may show up in forwarding latency. So the worker hands its
+ * user VM to a thread of its own before forwarding starts. The forwarder
+ * posts the set of keys a pair holds whenever it changes into an event ring
+ * and carries on; this thread matches the sets against the hotkeys, runs the
+ * blocks and commits what they return to the result ring, then wakes the
+ * forwarder through an eventfd the forwarder keeps a read armed on. Blocks
+ * run under a time budget (see tnk_budget_hook in tnk.c), one that runs out
+ * of it is aborted like a block that raised.
+ *
+ * Every pair slot has an event ring of its own, so a pair forwarded on a
+ * shard thread (see forward.c) posts without a lock: each ring has a single
+ * producer and a single consumer, and so does every result ring. A full
+ * event ring drops the event, the next one carries the whole key set again.
+ * Pairs are numbered per forwarder slot, the generation tells a reused slot
+ * apart so its matching state starts over. Results go to the forwarder's
+ * ring unless the slot was routed to a shard's.
+ *
+ * user.rb reloads happen here as well, parsing a large one doesn't hold up
+ * forwarding either. Everything mruby allocates on this thread comes from
+ * the user VM arena (see arena.h).
+ */
+
+#define TNK_VM_EVENTS 32 /* per pair */
+
+struct tnk_vm_event {
+  uint32_t pair;
+  uint32_t gen;
+  uint32_t report_len;
+  uint64_t pressed[TNK_HOTKEY_WORDS];
+};
+
+struct tnk_vm_queue {
+  uint32_t head, tail;
+  struct tnk_vm_event events[TNK_VM_EVENTS];
+};
+
+/* where the results of a pair go, ring NULL: the forwarder's */
+struct tnk_vm_route {
+  struct tnk_result_ring *results;
+  int result_fd;
+};
+
+struct tnk_vm {
+  bool running;
+  bool stop;
+  pthread_t thread;
+  int wake_fd;   /* forwarder -> thread */
+  int result_fd; /* thread -> forwarder */
+  int watch_fd;  /* user.rb directory, -1 if not watched */
+  mrb_state *user_mrb;
+  struct tnk_result_ring *results;
+  struct tnk_vm_queue queues[TNK_FWD_MAX_PAIRS];
+  struct tnk_vm_route routes[TNK_FWD_MAX_PAIRS];
+  uint32_t gens[TNK_FWD_MAX_PAIRS];
+  struct tnk_hotkey_state states[TNK_FWD_MAX_PAIRS];
+  struct tnk_vm_stats stats;
+  uint8_t watch_buf[4096] __attribute__((aligned(8)));
+};
+
+static struct tnk_vm vm = { .wake_fd = -1, .result_fd = -1, .watch_fd = -1 };
+
+/* Returns whether the event left results. */
+static bool
+tnk_vm_handle_event(const struct tnk_vm_event *ev, struct tnk_result_ring *results)
+{
+  struct tnk_hotkey_state *st = &vm.states[ev->pair];
+  if (vm.gens[ev->pair] != ev->gen) {
+    memset(st, 0, sizeof(*st));
+    vm.gens[ev->pair] = ev->gen;
+  }
+  results->pair = ev->pair;
+  results->gen = ev->gen;
+
+  uint64_t start = tnk_now_ns();
+  if (!tnk_hotkeys_dispatch(vm.user_mrb, st, ev->pressed, ev->report_len, results)) {
+    return false;
+  }
+  struct tnk_result *r = tnk_result_reserve(results, TNK_RESULT_RAN, sizeof(uint64_t));
+  if (r) {
+    uint64_t ns = tnk_now_ns() - start;
+    memcpy(r->data, &ns, sizeof(ns));
+    tnk_result_commit(results, r);
+  }
+  return true;
+}
+
+static void
+tnk_vm_wake(int fd)
+{
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("user vm: write(eventfd)");
+  }
+}
+
+static void
+tnk_vm_handle_watch(void)
+{
+  ssize_t n = read(vm.watch_fd, vm.watch_buf, sizeof(vm.watch_buf));
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    perror("user vm: user.rb watch");
+    close(vm.watch_fd);
+    vm.watch_fd = -1;
+    return;
+  }
+  if (n > 0 && tnk_user_changed(vm.watch_buf, (size_t)n) && tnk_user_reload(&vm.user_mrb)) {
+    __atomic_add_fetch(&vm.stats.reloads, 1, __ATOMIC_RELAXED);
+    /* node and edge numbers belong to the old VM */
+    for (uint32_t i = 0; i < TNK_FWD_MAX_PAIRS; i++) {
+      vm.states[i].node = 0;
+      vm.states[i].armed = 0;
+    }
+  }
+}
+
+static void *
+tnk_vm_main(void *arg)
+{
+  struct pollfd pfds[2] = {
+    { .fd = vm.wake_fd,  .events = POLLIN },
+    { .fd = vm.watch_fd, .events = POLLIN },
+  };
+  /* a reloaded user VM goes into the arena as well */
+  tnk_arena_enter();
+
+  while (!__atomic_load_n(&vm.stop, __ATOMIC_ACQUIRE)) {
+    pfds[1].fd = vm.watch_fd;
+    if (poll(pfds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("user vm: poll");
+      break;
+    }
+
+    uint64_t count;
+    if (pfds[0].revents & POLLIN) {
+      if (read(vm.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("user vm: read(eventfd)");
+      }
+    }
+
+    bool wake = false;
+    uint32_t wake_routes = 0;
+    for (uint32_t i = 0; i < TNK_FWD_MAX_PAIRS; i++) {
+      struct tnk_vm_queue *q = &vm.queues[i];
+      uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+      /* routed before the shard posted anything, see tnk_vm_route */
+      struct tnk_result_ring *routed = __atomic_load_n(&vm.routes[i].results, __ATOMIC_ACQUIRE);
+      while (q->head != tail) {
+        if (tnk_vm_handle_event(&q->events[q->head % TNK_VM_EVENTS], routed ? routed : vm.results)) {
+          if (routed) {
+            wake_routes |= 1u << i;
+          } else {
+            wake = true;
+          }
+        }
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+      }
+    }
+    if (pfds[1].revents & POLLIN) {
+      tnk_vm_handle_watch();
+    }
+    __atomic_store_n(&vm.stats.objects, (uint64_t)vm.user_mrb->gc.live, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; wake_routes; i++) {
+      if (wake_routes & (1u << i)) {
+        tnk_vm_wake(vm.routes[i].result_fd);
+        wake_routes &= ~(1u << i);
+      }
+    }
+    if (wake) {
+      tnk_vm_wake(vm.result_fd);
+    }
+  }
+  return NULL;
+}
+
+bool
+tnk_vm_start(mrb_state *user_mrb, struct tnk_result_ring *results, int fds[2])
+{
+  vm.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  vm.result_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (vm.wake_fd == -1 || vm.result_fd == -1) {
+    perror("user vm: eventfd");
+    goto fail;
+  }
+  vm.user_mrb = user_mrb;
+  vm.results = results;
+  vm.watch_fd = tnk_user_watch();
+
+  /* signals stay with the forwarder thread */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  tnk_rt_thread_attr(&attr);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&vm.thread, &attr, tnk_vm_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    errno = err;
+    perror("user vm: pthread_create");
+    goto fail;
+  }
+  pthread_setname_np(vm.thread, "tnk-user-vm");
+  vm.running = true;
+  fds[0] = vm.wake_fd;
+  fds[1] = vm.result_fd;
+  return true;
+
+fail:
+  if (vm.wake_fd != -1) close(vm.wake_fd);
+  if (vm.result_fd != -1) close(vm.result_fd);
+  if (vm.watch_fd != -1) close(vm.watch_fd);
+  vm.wake_fd = vm.result_fd = vm.watch_fd = -1;
+  vm.user_mrb = NULL;
+  return false;
+}
+
+bool
+tnk_vm_post(uint32_t pair, uint32_t gen, const uint64_t pressed[TNK_HOTKEY_WORDS], uint32_t report_len)
+{
+  struct tnk_vm_queue *q = &vm.queues[pair];
+  if (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == TNK_VM_EVENTS) {
+    __atomic_add_fetch(&vm.stats.dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  struct tnk_vm_event *ev = &q->events[q->tail % TNK_VM_EVENTS];
+  ev->pair = pair;
+  ev->gen = gen;
+  ev->report_len = report_len;
+  memcpy(ev->pressed, pressed, sizeof(ev->pressed));
+  __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&vm.stats.events, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+void
+tnk_vm_route(uint32_t pair, struct tnk_result_ring *results, int result_fd)
+{
+  vm.routes[pair].result_fd = result_fd;
+  __atomic_store_n(&vm.routes[pair].results, results, __ATOMIC_RELEASE);
+}
+
+void
+tnk_vm_stats(struct tnk_vm_stats *stats)
+{
+  stats->events = __atomic_load_n(&vm.stats.events, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&vm.stats.dropped, __ATOMIC_RELAXED);
+  stats->reloads = __atomic_load_n(&vm.stats.reloads, __ATOMIC_RELAXED);
+  stats->objects = __atomic_load_n(&vm.stats.objects, __ATOMIC_RELAXED);
+}
+
+mrb_state *
+tnk_vm_stop(void)
+{
+  if (!vm.running) return NULL;
+
+  __atomic_store_n(&vm.stop, true, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write(vm.wake_fd, &one, sizeof(one)) < 0) {
+    perror("user vm: write(eventfd)");
+  }
+  pthread_join(vm.thread, NULL);
+  vm.running = false;
+
+  close(vm.wake_fd);
+  close(vm.result_fd);
+  if (vm.watch_fd != -1) close(vm.watch_fd);
+  vm.wake_fd = vm.result_fd = vm.watch_fd = -1;
+  mrb_state *user_mrb = vm.user_mrb;
+  vm.user_mrb = NULL;
+  return user_mrb;
+}